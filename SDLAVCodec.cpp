@@ -6,6 +6,8 @@
  */
 
 #include "SDLAVCodec.h"
+#include "yuvconvert.h"
+#include "scheduler.h"
 #include <string.h>
 
 #include <ogg/ogg.h>
@@ -28,6 +30,7 @@ extern "C"
 
 #include <chrono>
 #include <thread>
+#include <vector>
 
 #include "Log.h"
 
@@ -35,6 +38,48 @@ extern "C"
 namespace whiteice {
 namespace resonanz {
 
+// speed levels of encoding from the fastest: x264 preset (changed only by
+// starting a new encoder) and quantizer (changed while encoding), other
+// encoders (mpeg4) use macroblock decision, trellis quantization and
+// motion estimation (changed only by starting a new encoder)
+static const struct {
+  const char* preset;
+  const char* crf;
+  const char* mbd;
+  int trellis;
+  const char* motion;
+} SPEED_LEVELS[] = {
+  { "ultrafast", "38", "simple", 0, "zero" },
+  { "ultrafast", "32", "simple", 0, "epzs" }, // default
+  { "superfast", "30", "simple", 1, "epzs" },
+  { "veryfast",  "28", "bits",   0, "epzs" },
+  { "faster",    "26", "bits",   1, "epzs" },
+  { "fast",      "23", "rd",     0, "epzs" },
+  { "medium",    "21", "rd",     1, "epzs" },
+  { "slow",      "18", "rd",     1, "epzs" }  // offline, full quality
+};
+
+static const unsigned int NUM_SPEED_LEVELS = sizeof(SPEED_LEVELS)/sizeof(SPEED_LEVELS[0]);
+static const unsigned int DEFAULT_SPEED_LEVEL = 1;
+
+// adaptive speed does not go to slower levels than this on its own
+static const unsigned int MAX_ADAPTIVE_SPEED_LEVEL = 4;
+
+// quality up to 0.5 encodes at the default level, higher quality
+// selects slower levels up to the slowest one at 1.0
+static unsigned int quality_speed_level(float quality)
+{
+  if(quality <= 0.5f) return DEFAULT_SPEED_LEVEL;
+  
+  return DEFAULT_SPEED_LEVEL +
+    (unsigned int)((quality - 0.5f)*2.0f*(NUM_SPEED_LEVELS - 1 - DEFAULT_SPEED_LEVEL) + 0.5f);
+}
+
+// encoder is behind when encoding takes most of the frame time or frames pile
+// up in the queue and has time to spare when it is idle half of the time
+static const double SPEED_BEHIND_LOAD = 0.9;
+static const double SPEED_SPARE_LOAD = 0.5;
+
 SDLAVCodec::SDLAVCodec(float q) :
   FPS(100), MSECS_PER_FRAME(1000/100) // currently saves at 25 frames per second, now 100, now 30, now 60
 {
@@ -46,6 +91,10 @@ SDLAVCodec::SDLAVCodec(float q) :
   running = false;
   encoder_thread = nullptr;
   error_flag = false;
+
+  memset(&queue_stats, 0, sizeof(queue_stats));
+  memset(&latency_stats, 0, sizeof(latency_stats));
+  memset(&speed_stats, 0, sizeof(speed_stats));
   
   //av_register_all();
 }
@@ -56,7 +105,7 @@ SDLAVCodec::~SDLAVCodec()
   std::lock_guard<std::mutex> lock1(incoming_mutex);
   
   for(auto& i : incoming){
-    av_frame_free(&(i->frame));
+    release_frame(i->frame);
     delete i;
   }
   
@@ -80,6 +129,13 @@ SDLAVCodec::~SDLAVCodec()
     frame = NULL;
     pkt = NULL;
   }
+
+  if(rgb_frame) SDL_FreeSurface(rgb_frame);
+  if(yuv_frame) av_frame_free(&yuv_frame);
+
+  close_audio();
+
+  stop_decoding(); // start_lock is already held
   
 }
 
@@ -87,6 +143,23 @@ SDLAVCodec::~SDLAVCodec()
 // setups encoding structure
 bool SDLAVCodec::startEncoding(const std::string& filename,
 			       unsigned int width, unsigned int height)
+{
+  return start(filename, width, height, false);
+}
+
+
+bool SDLAVCodec::startStreaming(const std::string& url,
+				unsigned int width, unsigned int height)
+{
+  avformat_network_init(); // udp
+  
+  if(url == "-") return start("pipe:1", width, height, true);
+  else return start(url, width, height, true);
+}
+
+
+bool SDLAVCodec::start(const std::string& filename,
+		       unsigned int width, unsigned int height, bool live)
 {
   std::lock_guard<std::mutex> lock(start_lock);
   
@@ -100,6 +173,7 @@ bool SDLAVCodec::startEncoding(const std::string& filename,
   
   frameHeight = height;
   frameWidth = width;
+  this->live = live;
 
   const char* codec_name = "mpeg4";
   // const char* codec_name = "h264_mf";
@@ -107,20 +181,32 @@ bool SDLAVCodec::startEncoding(const std::string& filename,
   // const char* codec_name = "libx264";
   // const AVCodec *codec;
   int ret;
+
+  // x264 has zero latency tuning for live streams
+  if(live) codec = avcodec_find_encoder_by_name("libx264");
+  else codec = NULL;
+  
+  if(codec == NULL)
+    codec = avcodec_find_encoder_by_name(codec_name);
   
-  codec = avcodec_find_encoder_by_name(codec_name);
   if (!codec) {
     fprintf(stderr, "Codec '%s' not found\n", codec_name);
     return false;
   }
 
 #if 1
-  avformat_alloc_output_context2(&fmt_ctx,
-				 av_guess_format("mp4",
-						 filename.c_str(),
-						 "video/mp4"),
-				 NULL,
-				 filename.c_str());
+  if(live)
+    avformat_alloc_output_context2(&fmt_ctx,
+				   av_guess_format("mpegts", NULL, NULL),
+				   NULL,
+				   filename.c_str());
+  else
+    avformat_alloc_output_context2(&fmt_ctx,
+				   av_guess_format("mp4",
+						   filename.c_str(),
+						   "video/mp4"),
+				   NULL,
+				   filename.c_str());
   if(fmt_ctx == NULL)
     return false;
 
@@ -141,40 +227,19 @@ bool SDLAVCodec::startEncoding(const std::string& filename,
 
   //stream->index = 0;
 
-  /* put sample parameters */
-  av_ctx->bit_rate = frameWidth * frameHeight * FPS * 2;
-  /* resolution must be a multiple of two */
-  av_ctx->width = frameWidth;
-  av_ctx->height = frameHeight;
-  /* frames per second */
-  av_ctx->time_base = (AVRational){1, (int)FPS};
-  av_ctx->framerate = (AVRational){(int)FPS, 1};
-
-  // stream->time_base = av_ctx->time_base;
-  
-    /* emit one intra frame every ten frames
-     * check frame pict_type before passing frame
-     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
-     * then gop_size is ignored and the output of encoder
-     * will always be I frame irrespective to gop_size
-     */
+  // keyframes are placed at scene cuts (hints), GOP size is only the upper limit
+  if(max_keyframe_distance == 0) max_keyframe_distance = 10*FPS;
+  if(min_keyframe_distance == 0) min_keyframe_distance = FPS;
+  if(min_keyframe_distance > max_keyframe_distance)
+    min_keyframe_distance = max_keyframe_distance;
   
-  av_ctx->gop_size = 10;
-  av_ctx->max_b_frames = 1;
-  av_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  speed_level = quality_speed_level(quality);
+  speed_max = (speed_level > MAX_ADAPTIVE_SPEED_LEVEL) ? speed_level : MAX_ADAPTIVE_SPEED_LEVEL;
+  encoder_level = speed_level;
+  speed_hold = FPS;
+  speed_idle = 0;
 
-#if 1
-  if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
-    av_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-#endif
- 
-  //if (codec->id == AV_CODEC_ID_H264){
-  {
-    av_opt_set(av_ctx->priv_data, "preset", "ultrafast", 0); // "slow"
-    
-    // "quality of compression" (default: 23), 0 is lossless, 1 is high-quality, 32 is ok
-    av_opt_set(av_ctx->priv_data, "crf", "32", 0);
-  }
+  configure_encoder(av_ctx, speed_level);
   
   /* open it */
   ret = avcodec_open2(av_ctx, codec, NULL);
@@ -183,6 +248,25 @@ bool SDLAVCodec::startEncoding(const std::string& filename,
     return false;
   }
 
+  // x264 changes quantizer while encoding but preset only by starting a new
+  // encoder: the stream must carry its headers in-band (no global header) and
+  // no frames may be delayed inside the old encoder (no B-frames). mpeg4
+  // headers do not depend on the speed options: a new encoder continues the
+  // same stream after the old one is drained
+  speed_crf = adaptive_speed && strcmp(codec->name, "libx264") == 0;
+  
+  if(speed_crf)
+    speed_reopen = live &&
+      av_ctx->max_b_frames == 0 && (av_ctx->flags & AV_CODEC_FLAG_GLOBAL_HEADER) == 0;
+  else
+    speed_reopen = adaptive_speed && codec->id == AV_CODEC_ID_MPEG4;
+
+  if(adaptive_speed && speed_crf == false && speed_reopen == false){
+    char buffer[128];
+    snprintf(buffer, 128, "sdl-theora: encoder speed of %s cannot be changed while encoding", codec->name);
+    logging.info(buffer);
+  }
+
 #if 1
   ret = avcodec_parameters_from_context(stream->codecpar, av_ctx);
   if(ret < 0) return false;
@@ -207,11 +291,21 @@ bool SDLAVCodec::startEncoding(const std::string& filename,
   // fmt_ctx->oformat->video_codec = codec->id; // AV_CODEC_ID_H264;
   fmt_ctx->video_codec_id = codec->id;
   fmt_ctx->bit_rate = frameWidth * frameHeight * FPS * 2;
+
+  if(open_audio() == false){
+    logging.error("sdl-theora: opening audio track failed");
+    return false;
+  }
   
 
   // printf("VIDEO FORMAT:\n");
   av_dump_format(fmt_ctx, 0, filename.c_str(), 1);
 
+  if(live){
+    fmt_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    fmt_ctx->max_delay = 0;
+  }
+
 #if 1
   ret = avio_open(&fmt_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE);
   if(ret < 0) return false;
@@ -240,10 +334,43 @@ bool SDLAVCodec::startEncoding(const std::string& filename,
 
   pkt = av_packet_alloc();
   if (!pkt) return false;
+
+  if(!pool || pool->width() != frameWidth || pool->height() != frameHeight)
+    pool = std::make_shared<AVFramePool>(frameWidth, frameHeight, av_ctx->pix_fmt);
+
+  rgb_frame = SDL_CreateRGBSurface(0, frameWidth, frameHeight, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+  if(rgb_frame == NULL) return false;
+
+  pending_damage.resize(frameWidth, frameHeight);
+  pending_damage.addAll(); // the first frame is always converted fully
+
+  yuv_frame = av_frame_alloc();
+  if(yuv_frame == NULL) return false;
+
+  yuv_frame->format = av_ctx->pix_fmt;
+  yuv_frame->width  = frameWidth;
+  yuv_frame->height = frameHeight;
+
+  if(av_frame_get_buffer(yuv_frame, 0) != 0) return false;
+
+  {
+    std::lock_guard<std::mutex> lock2(incoming_mutex);
+    memset(&queue_stats, 0, sizeof(queue_stats));
+    memset(&latency_stats, 0, sizeof(latency_stats));
+    memset(&speed_stats, 0, sizeof(speed_stats));
+    speed_stats.level = speed_level;
+  }
   
   
   try{
     latest_frame_encoded = -1;
+    latest_keyframe = -1;
+    pending_keyframe = false;
+    previous_valid = false;
+
+    // frames are accepted as soon as start() returns, even if the
+    // encoder thread has not been scheduled yet
+    running = true;
     encoder_thread = new std::thread(&SDLAVCodec::encoder_loop, this);
     
     if(encoder_thread == nullptr){
@@ -260,18 +387,91 @@ bool SDLAVCodec::startEncoding(const std::string& filename,
 }
 
 
+void SDLAVCodec::configure_encoder(AVCodecContext* ctx, unsigned int level)
+{
+  /* put sample parameters */
+  ctx->bit_rate = frameWidth * frameHeight * FPS * 2;
+  /* resolution must be a multiple of two */
+  ctx->width = frameWidth;
+  ctx->height = frameHeight;
+  /* frames per second */
+  ctx->time_base = (AVRational){1, (int)FPS};
+  ctx->framerate = (AVRational){(int)FPS, 1};
+
+  // stream->time_base = ctx->time_base;
+  
+    /* emit intra frame at least every max_keyframe_distance frames
+     * check frame pict_type before passing frame
+     * to encoder, if frame->pict_type is AV_PICTURE_TYPE_I
+     * then gop_size is ignored and the output of encoder
+     * will always be I frame irrespective to gop_size
+     */
+  
+  ctx->gop_size = max_keyframe_distance;
+  ctx->keyint_min = min_keyframe_distance;
+  ctx->max_b_frames = 1;
+  ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+
+  // codec's own threads share the encode cores with the encoder thread
+  ctx->thread_count = TaskScheduler::instance().getThreads(STAGE_ENCODE);
+
+  if(live){
+    // every frame is sent out as soon as it is encoded: no reordering
+    // and quick recovery of viewers joining the stream
+    ctx->max_b_frames = 0;
+    ctx->gop_size = FPS/2;
+    ctx->keyint_min = 1;
+    ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+
+    av_opt_set(ctx->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(ctx->priv_data, "intra-refresh", "1", 0);
+  }
+
+#if 1
+  if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+#endif
+ 
+  //if (codec->id == AV_CODEC_ID_H264){
+  {
+    av_opt_set(ctx->priv_data, "preset", SPEED_LEVELS[level].preset, 0); // "slow"
+    
+    // "quality of compression" (default: 23), 0 is lossless, 1 is high-quality, 32 is ok
+    av_opt_set(ctx->priv_data, "crf", SPEED_LEVELS[level].crf, 0);
+  }
+
+  if(strcmp(codec->name, "libx264") != 0){
+    // x264 presets already choose these
+    av_opt_set(ctx, "mbd", SPEED_LEVELS[level].mbd, AV_OPT_SEARCH_CHILDREN);
+    av_opt_set_int(ctx, "trellis", SPEED_LEVELS[level].trellis, AV_OPT_SEARCH_CHILDREN);
+    av_opt_set(ctx, "motion_est", SPEED_LEVELS[level].motion, AV_OPT_SEARCH_CHILDREN);
+  }
+}
+
+
 // inserts SDL_Surface picture frame into video at msecs
 // onwards since the start of the encoding (msecs = 0 is the first frame)
-bool SDLAVCodec::insertFrame(unsigned long long msecs, SDL_Surface* surface)
+bool SDLAVCodec::insertFrame(unsigned long long msecs, SDL_Surface* surface,
+			     const DamageRegion* damage, bool keyframe)
 {
   // very quick skipping of frames [without conversion] when picture for the current frame has been already inserted
   const unsigned long long frame = msecs/MSECS_PER_FRAME;
+
+  // changes of skipped frames must be converted with the next inserted frame
+  if(damage) pending_damage.add(*damage);
+  else pending_damage.addAll();
+
+  pending_keyframe = pending_keyframe || keyframe;
+  
+  // picture of this frame time is already queued: changes go with the next frame
   if((signed)frame <= latest_frame_encoded)
-    return false;
+    return true;
   
   if(running){
-    if(__insert_frame(msecs, surface, false)){
+    if(__insert_frame(msecs, surface, &pending_damage, false, pending_keyframe)){
       latest_frame_encoded = frame;
+      pending_damage.clear();
+      pending_keyframe = false;
       return true;
     }
 		else{
@@ -288,7 +488,7 @@ bool SDLAVCodec::stopEncoding(unsigned long long msecs,
 			      SDL_Surface* surface)
 {
   if(running){
-    if(__insert_frame(msecs, surface, true) == false){
+    if(__insert_frame(msecs, surface, nullptr, true) == false){
       logging.fatal("sdl-theora: inserting LAST frame failed");
       return false;
     }
@@ -298,6 +498,40 @@ bool SDLAVCodec::stopEncoding(unsigned long long msecs,
     return false;
   }
 
+  return finish_encoding();
+}
+
+
+bool SDLAVCodec::stopEncoding(unsigned long long msecs, AVFrame* frame)
+{
+  if(running == false || frame == nullptr ||
+     frame->width != frameWidth || frame->height != frameHeight ||
+     frame->format != AV_PIX_FMT_YUV420P){
+    release_frame(frame);
+    logging.fatal("sdl-theora: inserting LAST frame failed");
+    return false;
+  }
+
+  SDLAVCodec::videoframe* f = new SDLAVCodec::videoframe;
+  
+  f->msecs = msecs;
+  f->frame = frame;
+  f->inserted = std::chrono::steady_clock::now();
+  f->frame->pts = msecs/MSECS_PER_FRAME;
+  f->last = true;
+  f->keyframe = false;
+
+  if(__queue_frame(f) == false){
+    logging.fatal("sdl-theora: inserting LAST frame failed");
+    return false;
+  }
+
+  return finish_encoding();
+}
+
+
+bool SDLAVCodec::finish_encoding()
+{
   std::lock_guard<std::mutex> lock(start_lock);
 
   while(this->busy()) // waits for encoding to finish..
@@ -328,6 +562,27 @@ bool SDLAVCodec::stopEncoding(unsigned long long msecs,
   
 
   av_write_trailer(fmt_ctx);
+  avio_closep(&fmt_ctx->pb); // FIFO and socket readers see end of stream
+
+  {
+    const QueueStats stats = getQueueStats();
+    char buffer[256];
+    snprintf(buffer, 256, "sdl-theora: queue: %llu admitted, %llu blocked, %llu dropped newest, %llu dropped oldest, %llu coalesced, %llu duplicates, peak %llu MB",
+	     stats.admitted, stats.blocked, stats.droppedNewest, stats.droppedOldest,
+	     stats.coalesced, stats.duplicates, stats.peakBytes/(1024*1024));
+    logging.info(buffer);
+
+    const LatencyStats latency = getLatencyStats();
+    snprintf(buffer, 256, "sdl-theora: insert to write latency: %.1f ms average, %.1f ms max",
+	     latency.avgMsecs, latency.maxMsecs);
+    logging.info(buffer);
+
+    const SpeedStats speed = getSpeedStats();
+    snprintf(buffer, 256, "sdl-theora: encoder speed: level %u, %llu faster, %llu slower, %llu restarts, load %.2f (%.1f ms per frame)",
+	     speed.level, speed.speedUps, speed.slowDowns, speed.reopens,
+	     speed.load, speed.encodeMsecs);
+    logging.info(buffer);
+  }
   
   avcodec_free_context(&av_ctx);
   av_frame_free(&frame);
@@ -337,6 +592,14 @@ bool SDLAVCodec::stopEncoding(unsigned long long msecs,
   av_ctx = NULL;
   frame = NULL;
   pkt = NULL;
+
+  if(rgb_frame) SDL_FreeSurface(rgb_frame);
+  if(yuv_frame) av_frame_free(&yuv_frame);
+
+  rgb_frame = NULL;
+  yuv_frame = NULL;
+
+  close_audio();
   
   running = false; // it is safe to do because we have start lock?
   
@@ -344,23 +607,122 @@ bool SDLAVCodec::stopEncoding(unsigned long long msecs,
 }
 
 
-bool SDLAVCodec::__insert_frame(unsigned long long msecs, SDL_Surface* surface, bool last)
+bool SDLAVCodec::__insert_frame(unsigned long long msecs, SDL_Surface* surface,
+				const DamageRegion* damage, bool last,
+				bool keyframe)
 {
+  const auto inserted = std::chrono::steady_clock::now();
+  
   // converts SDL into YUV format [each plane separatedly and have full width and height]
   // before sending it to the encoder thread
+
+  // only macroblock rows (16 lines) touched by the damaged area are
+  // updated, the rest of the picture is the same as in the previous frame
+  const int MBROWS = (frameHeight + 15)/16;
+  std::vector<bool> dirtyRows(MBROWS, (surface == NULL || damage == nullptr));
+
+  // surface pixels can be compared against the previous picture: row bands
+  // (macroblock rows) that did not really change are not converted again
+  const bool comparable =
+    (surface != NULL && previous_valid && last == false &&
+     surface->format->BytesPerPixel == 4 &&
+     surface->format->Rmask == rgb_frame->format->Rmask &&
+     surface->format->Gmask == rgb_frame->format->Gmask &&
+     surface->format->Bmask == rgb_frame->format->Bmask);
+
+  // 32bit 0x00RRGGBB surface (presenter's framebuffer) is converted directly,
+  // rgb_frame is then only the copy of the previous picture for comparisons
+  const bool direct =
+    (surface != NULL && SDL_MUSTLOCK(surface) == 0 &&
+     surface->w >= frameWidth && surface->h >= frameHeight &&
+     surface->format->BytesPerPixel == 4 &&
+     surface->format->Rmask == rgb_frame->format->Rmask &&
+     surface->format->Gmask == rgb_frame->format->Gmask &&
+     surface->format->Bmask == rgb_frame->format->Bmask);
+
+  // keeps rgb_frame in sync, the last frame is never compared against
+  auto copyArea = [&](const SDL_Rect& area){
+    if(direct){
+      if(last) return;
+      
+      for(int y=area.y;y<area.y+area.h;y++)
+	memcpy((Uint8*)rgb_frame->pixels + y*rgb_frame->pitch + 4*area.x,
+	       (const Uint8*)surface->pixels + y*surface->pitch + 4*area.x,
+	       4*area.w);
+    }
+    else{
+      SDL_Rect src = area, dst = area;
+      SDL_FillRect(rgb_frame, &dst, SDL_MapRGB(rgb_frame->format, 0, 0, 0));
+      SDL_BlitSurface(surface, &src, rgb_frame, &dst);
+    }
+  };
+
+  DamageRegion all(frameWidth, frameHeight);
   
-  SDL_Surface* frame = SDL_CreateRGBSurface(0, frameWidth, frameHeight, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
-  
-  if(frame == NULL){
-    logging.error("sdl-theora::__insert_frame failed [1]");
-    return false;
+  if(comparable && damage == nullptr){
+    all.addAll();
+    damage = &all;
+    dirtyRows.assign(MBROWS, false);
   }
+
+  unsigned long long bandsSkipped = 0;
   
-  if(surface != NULL){
-    SDL_BlitSurface(surface, NULL, frame, NULL);
+  if(surface != NULL && damage != nullptr){
+    for(const auto& r : damage->rects()){
+      for(int row=r.y/16;row<MBROWS && row*16<r.y+r.h;row++){
+	// part of the rectangle inside the row band
+	SDL_Rect band = { 0, row*16, frameWidth, 16 };
+	SDL_Rect dst;
+	
+	if(SDL_IntersectRect(&r, &band, &dst) == SDL_FALSE) continue;
+
+	if(comparable && samePixels(surface, rgb_frame, dst)){
+	  bandsSkipped++;
+	  continue;
+	}
+	
+	copyArea(dst);
+
+	dirtyRows[row] = true;
+      }
+    }
+  }
+  else if(surface != NULL){
+    copyArea(SDL_Rect{ 0, 0, frameWidth, frameHeight });
   }
   else{ // just fills the frame with black
-    SDL_FillRect(frame, NULL, SDL_MapRGB(frame->format, 0, 0, 0));
+    SDL_FillRect(rgb_frame, NULL, SDL_MapRGB(rgb_frame->format, 0, 0, 0));
+  }
+
+  bool changed = false;
+  for(int row=0;row<MBROWS;row++)
+    changed = changed || dirtyRows[row];
+
+  if(comparable){
+    std::lock_guard<std::mutex> lock(incoming_mutex);
+    queue_stats.bandsSkipped += bandsSkipped;
+
+    // identical picture: encoder repeats the previous frame in its place
+    if(changed == false && keyframe == false){
+      queue_stats.duplicates++;
+      return true;
+    }
+  }
+
+  if(av_frame_make_writable(yuv_frame) != 0){
+    error_flag = true;
+    return false;
+  }
+
+  for(int row=0;row<MBROWS;){
+    if(dirtyRows[row] == false){ row++; continue; }
+
+    int end = row;
+    while(end < MBROWS && dirtyRows[end]) end++;
+
+    convertRGBToYUV420(direct ? surface : rgb_frame, yuv_frame, row*16, end*16);
+
+    row = end;
   }
   
   // assumes yuv pixels format is full plane for each component:
@@ -369,26 +731,19 @@ bool SDLAVCodec::__insert_frame(unsigned long long msecs, SDL_Surface* surface,
   SDLAVCodec::videoframe* f = new SDLAVCodec::videoframe;
   
   f->msecs = msecs;
+  f->inserted = inserted;
   
-  f->frame = av_frame_alloc();
-  
-  f->frame->format = av_ctx->pix_fmt;
-  f->frame->width = frameWidth;
-  f->frame->height = frameHeight;
+  f->frame = pool->acquire();
 
-  const long long f_frame = (f->msecs / MSECS_PER_FRAME);
-  f->frame->pts = f_frame;
-
-  if(av_frame_get_buffer(f->frame, 0) != 0){
-    error_flag = true;
-    printf("ERROR\n");
-  }
-  
-  if(av_frame_make_writable(f->frame) != 0){
+  if(f->frame == nullptr){
     error_flag = true;
-    printf("ERROR\n");
+    delete f;
+    return false;
   }
 
+  const long long f_frame = (f->msecs / MSECS_PER_FRAME);
+  f->frame->pts = f_frame;
+
   /*
   printf("FRAMEDATA: %llx %llx %llx %llx PTS: %ld\n",
 	 (unsigned long long)(f->frame),
@@ -399,116 +754,763 @@ bool SDLAVCodec::__insert_frame(unsigned long long msecs, SDL_Surface* surface,
   */
   
   
-  // perfect opportunity for parallelization: pixel conversions are independet from each other
-#pragma omp parallel for
-  for(int y=0; y<f->frame->height; y++) {
-    for(int x=0; x<f->frame->width; x++) {
-      
-      const unsigned int index = x + frameWidth*y;
-      unsigned int* source = (unsigned int*)(frame->pixels);
-      
-      const unsigned int r = (source[index] & 0x00FF0000)>>16;
-      const unsigned int g = (source[index] & 0x0000FF00)>> 8;
-      const unsigned int b = (source[index] & 0x000000FF)>> 0;
-      
-      auto Y  =  (0.257*r) + (0.504*g) + (0.098*b) + 16.0;
-      auto Cr =  (0.439*r) - (0.368*g) - (0.071*b) + 128.0;
-      auto Cb = -(0.148*r) - (0.291*g) + (0.439*b) + 128.0;
-      
-      if(Y < 0.0) Y = 0.0;
-      else if(Y > 255.0) Y = 255.0;
-      
-      if(Cr < 0.0) Cr = 0.0;
-      else if(Cr > 255.0) Cr = 255.0;
-      
-      if(Cb < 0.0) Cb = 0.0;
-      else if(Cb > 255.0) Cb = 255.0;
-      
-      f->frame->data[0][y * f->frame->linesize[0] + x] =
-	(unsigned char)round(Y);  // Y
-      //f->frame->data[1][y * f->frame->linesize[1] + x] =
-      //(unsigned char)round(Cb);  // Cb
-      //f->frame->data[2][y * f->frame->linesize[2] + x] =
-      //(unsigned char)round(Cr);  // Cr
-    }
-  }
-
-
-#pragma omp parallel for
-  for(int y=0; y<f->frame->height; y++) {
-    for(int x=0; x<f->frame->width; x++) {
-      
-      const unsigned int index = x + frameWidth*y;
-      unsigned int* source = (unsigned int*)(frame->pixels);
-      
-      const unsigned int r = (source[index] & 0x00FF0000)>>16;
-      const unsigned int g = (source[index] & 0x0000FF00)>> 8;
-      const unsigned int b = (source[index] & 0x000000FF)>> 0;
-      
-      auto Y  =  (0.257*r) + (0.504*g) + (0.098*b) + 16.0;
-      auto Cr =  (0.439*r) - (0.368*g) - (0.071*b) + 128.0;
-      auto Cb = -(0.148*r) - (0.291*g) + (0.439*b) + 128.0;
-      
-      if(Y < 0.0) Y = 0.0;
-      else if(Y > 255.0) Y = 255.0;
-      
-      if(Cr < 0.0) Cr = 0.0;
-      else if(Cr > 255.0) Cr = 255.0;
-      
-      if(Cb < 0.0) Cb = 0.0;
-      else if(Cb > 255.0) Cb = 255.0;
-      
-      //f->frame->data[0][y * f->frame->linesize[0] + x] =
-      //(unsigned char)round(Y);  // Y
-
-      int xx = x/2;
-      int yy = y/2;
-      
-      f->frame->data[1][yy * f->frame->linesize[1] + xx] =
-	(unsigned char)round(Cb);  // Cb
-      f->frame->data[2][yy * f->frame->linesize[2] + xx] =
-	(unsigned char)round(Cr);  // Cr
-    }
+  if(av_frame_copy(f->frame, yuv_frame) < 0){
+    error_flag = true;
+    printf("ERROR\n");
   }
   
   
   f->last = last; // IMPORTANT!
+  f->keyframe = keyframe;
+
+  // rgb_frame is now the picture of the latest queued frame
+  previous_valid = true;
+
+  return __queue_frame(f);
+}
+
+
+bool SDLAVCodec::__queue_frame(SDLAVCodec::videoframe* f)
+{
+  std::lock_guard<std::mutex> lock1(start_lock);
+  std::unique_lock<std::mutex> lock2(incoming_mutex);
+
+  f->bytes = pool ? pool->frameBytes() : 0;
   
-  {
-    std::lock_guard<std::mutex> lock1(start_lock);
-    std::lock_guard<std::mutex> lock2(incoming_mutex);
+  if(running == false && f->last != true){
+    logging.error("sdl-theora::__insert_frame failed [3]");
     
-    // always processes special LAST frames
-    if((running == false || incoming.size() >= MAX_QUEUE_LENGTH) && f->last != true){
-      logging.error("sdl-theora::__insert_frame failed [3]");
+    release_frame(f->frame);
+    delete f;
+    
+    return false;
+  }
 
-      av_frame_free(&(f->frame));
-      delete f;
+  // always processes special LAST frames, other frames must fit into the budget
+  auto full = [&]() -> bool {
+    return (incoming.size() > 0 &&
+	    queue_stats.queueBytes + f->bytes > max_queue_bytes);
+  };
 
-      SDL_FreeSurface(frame);
-      return false;
+  if(f->last == false && full()){
+    
+    if(queue_policy == QUEUE_BLOCK){
+      queue_stats.blocked++;
+      
+      incoming_cond.wait(lock2, [&]() { return (full() == false || running == false); });
+
+      if(running == false){
+	release_frame(f->frame);
+	delete f;
+	return false;
+      }
+    }
+    else if(queue_policy == QUEUE_DROP_OLDEST_NONKEY){
+      // makes room by dropping oldest frames, the encoder repeats
+      // the previous frame in their place
+      for(auto i = incoming.begin();i != incoming.end() && full();){
+	if((*i)->last || (*i)->keyframe){ i++; continue; }
+
+	queue_stats.queueBytes -= (*i)->bytes;
+	queue_stats.droppedOldest++;
+	
+	release_frame((*i)->frame);
+	delete (*i);
+	i = incoming.erase(i);
+      }
+
+      if(full()){ // only keyframes in queue
+	queue_stats.droppedNewest++;
+	previous_valid = false; // encoder does not get this picture
+	release_frame(f->frame);
+	delete f;
+	return true;
+      }
+    }
+    else if(queue_policy == QUEUE_COALESCE && incoming.back()->last == false){
+      // the newest queued picture is never shown: this frame takes its place
+      // and its timestamp so that the encoder repeats this one instead
+      SDLAVCodec::videoframe* b = incoming.back();
+
+      f->keyframe = f->keyframe || b->keyframe;
+
+      f->frame->pts = b->frame->pts;
+      f->msecs = b->msecs;
+
+      release_frame(b->frame);
+      delete b;
+      incoming.back() = f;
+      
+      queue_stats.coalesced++;
+      return true;
+    }
+    else{ // QUEUE_DROP_NEWEST
+      queue_stats.droppedNewest++;
+      previous_valid = false;
+      release_frame(f->frame);
+      delete f;
+      return true;
     }
-    else
-      incoming.push_back(f);
   }
+
+  incoming.push_back(f);
+
+  queue_stats.admitted++;
+  queue_stats.queueBytes += f->bytes;
+  if(queue_stats.queueBytes > queue_stats.peakBytes)
+    queue_stats.peakBytes = queue_stats.queueBytes;
   
-  SDL_FreeSurface(frame);
+  lock2.unlock();
+  incoming_cond.notify_all();
   
   return true;
 }
 
 
-// thread to do all encoding communication between theora and
-// writing resulting frames into disk
-void SDLAVCodec::encoder_loop()
+void SDLAVCodec::setQueuePolicy(QueuePolicy policy, unsigned long long maxBytes)
 {
-  running = true;
-  
-  logging.info("sdl-theora: encoder thread started..");
+  std::lock_guard<std::mutex> lock(incoming_mutex);
   
-  prev = nullptr;
+  queue_policy = policy;
+  max_queue_bytes = (maxBytes > 0) ? maxBytes : DEFAULT_QUEUE_BYTES;
+}
+
+
+SDLAVCodec::QueueStats SDLAVCodec::getQueueStats() const
+{
+  std::lock_guard<std::mutex> lock(incoming_mutex);
+  return queue_stats;
+}
+
+
+void SDLAVCodec::setAdaptiveSpeed(bool enabled)
+{
+  std::lock_guard<std::mutex> lock(start_lock);
+  adaptive_speed = enabled;
+}
+
+
+SDLAVCodec::SpeedStats SDLAVCodec::getSpeedStats() const
+{
+  std::lock_guard<std::mutex> lock(incoming_mutex);
+  return speed_stats;
+}
+
+
+AVFrame* SDLAVCodec::acquireFrame()
+{
+  std::lock_guard<std::mutex> lock(start_lock);
   
-  logging.info("sdl-theora: theora video headers written..");
+  if(pool) return pool->acquire();
+  else return nullptr;
+}
+
+
+void SDLAVCodec::setKeyframeDistance(unsigned int maxFrames, unsigned int minFrames)
+{
+  std::lock_guard<std::mutex> lock(start_lock);
+  
+  max_keyframe_distance = maxFrames;
+  min_keyframe_distance = minFrames;
+}
+
+
+void SDLAVCodec::setFramePool(std::shared_ptr<AVFramePool> pool)
+{
+  std::lock_guard<std::mutex> lock(start_lock);
+  this->pool = pool;
+}
+
+
+void SDLAVCodec::release_frame(AVFrame* frame)
+{
+  if(frame == nullptr) return;
+  
+  if(pool) pool->release(frame);
+  else av_frame_free(&frame);
+}
+
+
+bool SDLAVCodec::insertFrame(unsigned long long msecs, AVFrame* frame,
+			     bool keyframe)
+{
+  if(frame == nullptr) return false;
+  
+  const unsigned long long fn = msecs/MSECS_PER_FRAME;
+
+  pending_keyframe = pending_keyframe || keyframe;
+
+  // picture of this frame time is already queued: keyframe hint goes with the next frame
+  if(running && (signed)fn <= latest_frame_encoded){
+    release_frame(frame);
+    return true;
+  }
+  
+  if(running == false ||
+     frame->width != frameWidth || frame->height != frameHeight ||
+     frame->format != AV_PIX_FMT_YUV420P){
+    release_frame(frame);
+    return false;
+  }
+
+  // previous surface based picture is no longer the previous frame
+  pending_damage.addAll();
+  previous_valid = false;
+  
+  SDLAVCodec::videoframe* f = new SDLAVCodec::videoframe;
+  
+  f->msecs = msecs;
+  f->frame = frame;
+  f->inserted = std::chrono::steady_clock::now();
+  f->frame->pts = fn;
+  f->last = false;
+  f->keyframe = pending_keyframe;
+
+  if(__queue_frame(f) == false)
+    return false;
+
+  latest_frame_encoded = fn;
+  pending_keyframe = false;
+  
+  return true;
+}
+
+
+bool SDLAVCodec::addAudioTrack(const std::string& filename,
+			       unsigned long long offsetMsecs, bool loop)
+{
+  std::lock_guard<std::mutex> lock(start_lock);
+  if(running || filename.size() == 0) return false;
+
+  audio_filename = filename;
+  audio_offset = offsetMsecs;
+  audio_loop = loop;
+  audio_sample_rate = 0;
+  audio_channels = 0;
+
+  return true;
+}
+
+
+bool SDLAVCodec::addAudioTrack(int sampleRate, int channels)
+{
+  std::lock_guard<std::mutex> lock(start_lock);
+  if(running || sampleRate <= 0 || channels <= 0) return false;
+
+  audio_filename = "";
+  audio_offset = 0;
+  audio_sample_rate = sampleRate;
+  audio_channels = channels;
+
+  return true;
+}
+
+
+bool SDLAVCodec::open_audio()
+{
+  if(audio_filename.size() > 0){
+    // stream copy: audio packets are muxed as they are
+    if(avformat_open_input(&audio_in, audio_filename.c_str(), NULL, NULL) < 0){
+      audio_in = nullptr;
+      return false;
+    }
+
+    if(avformat_find_stream_info(audio_in, NULL) < 0) return false;
+
+    audio_in_index = av_find_best_stream(audio_in, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+    if(audio_in_index < 0) return false;
+
+    AVStream* in = audio_in->streams[audio_in_index];
+
+    audio_stream = avformat_new_stream(fmt_ctx, NULL);
+    if(audio_stream == NULL) return false;
+
+    if(avcodec_parameters_copy(audio_stream->codecpar, in->codecpar) < 0)
+      return false;
+
+    audio_stream->codecpar->codec_tag = 0; // lets mp4 muxer choose the tag
+    audio_stream->time_base = in->time_base;
+    audio_stream->id = fmt_ctx->nb_streams - 1;
+
+    audio_pkt = av_packet_alloc();
+    if(audio_pkt == NULL) return false;
+    
+    audio_pending = false;
+    audio_loop_pts = 0;
+    audio_end_pts = 0;
+  }
+  else if(audio_sample_rate > 0){
+    // generated PCM is encoded to AAC
+    const AVCodec* aac = avcodec_find_encoder(AV_CODEC_ID_AAC);
+    if(aac == NULL) return false;
+
+    audio_ctx = avcodec_alloc_context3(aac);
+    if(audio_ctx == NULL) return false;
+
+    audio_ctx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+    audio_ctx->sample_rate = audio_sample_rate;
+    av_channel_layout_default(&audio_ctx->ch_layout, audio_channels);
+    audio_ctx->bit_rate = 64000*audio_channels;
+    audio_ctx->time_base = (AVRational){1, audio_sample_rate};
+
+    if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+      audio_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if(avcodec_open2(audio_ctx, aac, NULL) < 0) return false;
+
+    audio_stream = avformat_new_stream(fmt_ctx, NULL);
+    if(audio_stream == NULL) return false;
+
+    if(avcodec_parameters_from_context(audio_stream->codecpar, audio_ctx) < 0)
+      return false;
+
+    audio_stream->time_base = audio_ctx->time_base;
+    audio_stream->id = fmt_ctx->nb_streams - 1;
+
+    audio_frame = av_frame_alloc();
+    if(audio_frame == NULL) return false;
+
+    audio_frame->nb_samples = audio_ctx->frame_size > 0 ? audio_ctx->frame_size : 1024;
+    audio_frame->format = audio_ctx->sample_fmt;
+    audio_frame->sample_rate = audio_sample_rate;
+    av_channel_layout_copy(&audio_frame->ch_layout, &audio_ctx->ch_layout);
+
+    if(av_frame_get_buffer(audio_frame, 0) != 0) return false;
+
+    audio_pcm.clear();
+    audio_samples = 0;
+  }
+
+  return true;
+}
+
+
+bool SDLAVCodec::insertAudio(const int16_t* samples, unsigned int numSamples)
+{
+  std::lock_guard<std::mutex> lock(audio_mutex);
+  
+  if(audio_ctx == nullptr || samples == nullptr) return false;
+
+  for(unsigned int i=0;i<numSamples*audio_channels;i++)
+    audio_pcm.push_back(samples[i]/32768.0f);
+
+  const unsigned int N = audio_frame->nb_samples;
+  unsigned int used = 0;
+
+  // encodes full frames, packets wait in queue until encoder thread muxes them
+  while(audio_pcm.size() - used >= N*audio_channels){
+    if(av_frame_make_writable(audio_frame) != 0) return false;
+
+    for(int c=0;c<audio_channels;c++){
+      float* plane = (float*)audio_frame->data[c];
+      for(unsigned int n=0;n<N;n++)
+	plane[n] = audio_pcm[used + n*audio_channels + c];
+    }
+
+    used += N*audio_channels;
+
+    audio_frame->pts = audio_samples;
+    audio_samples += N;
+
+    if(avcodec_send_frame(audio_ctx, audio_frame) < 0) return false;
+
+    while(1){
+      AVPacket* p = av_packet_alloc();
+      if(p == NULL) return false;
+      
+      if(avcodec_receive_packet(audio_ctx, p) < 0){
+	av_packet_free(&p);
+	break;
+      }
+
+      audio_packets.push_back(p);
+    }
+  }
+
+  audio_pcm.erase(audio_pcm.begin(), audio_pcm.begin() + used);
+
+  return true;
+}
+
+
+bool SDLAVCodec::write_audio(long long frame, bool flush)
+{
+  const AVRational video_tb = (AVRational){1, (int)FPS};
+  
+  if(audio_in){
+    AVStream* in = audio_in->streams[audio_in_index];
+    const int64_t start = (in->start_time != AV_NOPTS_VALUE) ? in->start_time : 0;
+    const int64_t offset = av_rescale_q(audio_offset, (AVRational){1, 1000}, in->time_base);
+    
+    while(1){
+      if(audio_pending == false){
+	int ret = av_read_frame(audio_in, audio_pkt);
+
+	if(ret == AVERROR_EOF){
+	  // nothing read since the previous loop started: no audio
+	  if(audio_loop == false || audio_end_pts <= audio_loop_pts)
+	    return true;
+
+	  if(av_seek_frame(audio_in, audio_in_index, start, AVSEEK_FLAG_BACKWARD) < 0)
+	    return false;
+
+	  audio_loop_pts = audio_end_pts;
+	  continue;
+	}
+	else if(ret < 0) return false;
+
+	if(audio_pkt->stream_index != audio_in_index){
+	  av_packet_unref(audio_pkt);
+	  continue;
+	}
+
+	// places packet on video's timeline
+	int64_t pts = (audio_pkt->pts != AV_NOPTS_VALUE) ? audio_pkt->pts : audio_pkt->dts;
+	pts = pts - start + audio_loop_pts;
+
+	if(pts + audio_pkt->duration > audio_end_pts)
+	  audio_end_pts = pts + audio_pkt->duration;
+
+	audio_pkt->pts = pts + offset;
+	audio_pkt->dts = pts + offset;
+	audio_pending = true;
+      }
+
+      // audio of the video frames encoded so far
+      if(av_compare_ts(audio_pkt->pts, in->time_base, frame, video_tb) >= 0){
+	if(flush){ // after the end of video
+	  av_packet_unref(audio_pkt);
+	  audio_pending = false;
+	}
+	
+	return true;
+      }
+
+      av_packet_rescale_ts(audio_pkt, in->time_base, audio_stream->time_base);
+      audio_pkt->stream_index = audio_stream->index;
+      audio_pkt->pos = -1;
+
+      audio_pending = false;
+
+      if(write_packet(audio_pkt) == false)
+	return false;
+    }
+  }
+  else if(audio_ctx){
+    std::lock_guard<std::mutex> lock(audio_mutex);
+
+    if(flush){ // drains the encoder
+      avcodec_send_frame(audio_ctx, NULL);
+      
+      while(1){
+	AVPacket* p = av_packet_alloc();
+	if(p == NULL) return false;
+	
+	if(avcodec_receive_packet(audio_ctx, p) < 0){
+	  av_packet_free(&p);
+	  break;
+	}
+	
+	audio_packets.push_back(p);
+      }
+    }
+
+    while(audio_packets.size() > 0){
+      AVPacket* p = audio_packets.front();
+
+      if(flush == false && av_compare_ts(p->pts, audio_ctx->time_base, frame, video_tb) >= 0)
+	break;
+
+      audio_packets.pop_front();
+      
+      av_packet_rescale_ts(p, audio_ctx->time_base, audio_stream->time_base);
+      p->stream_index = audio_stream->index;
+
+      const bool ok = write_packet(p);
+      av_packet_free(&p);
+
+      if(ok == false) return false;
+    }
+  }
+
+  return true;
+}
+
+
+void SDLAVCodec::close_audio()
+{
+  if(audio_in) avformat_close_input(&audio_in);
+  if(audio_pkt) av_packet_free(&audio_pkt);
+
+  audio_in = nullptr;
+  audio_pkt = nullptr;
+  audio_pending = false;
+
+  std::lock_guard<std::mutex> lock(audio_mutex);
+  
+  for(auto& p : audio_packets)
+    av_packet_free(&p);
+  audio_packets.clear();
+
+  if(audio_ctx) avcodec_free_context(&audio_ctx);
+  if(audio_frame) av_frame_free(&audio_frame);
+
+  audio_ctx = nullptr;
+  audio_frame = nullptr;
+  audio_stream = nullptr;
+  audio_pcm.clear();
+}
+
+
+bool SDLAVCodec::startDecoding(const std::string& filename, unsigned int prefetchFrames)
+{
+  std::lock_guard<std::mutex> lock(start_lock);
+
+  if(decoder_thread) return false;
+
+  if(avformat_open_input(&dec_fmt_ctx, filename.c_str(), NULL, NULL) < 0){
+    dec_fmt_ctx = nullptr;
+    return false;
+  }
+
+  if(avformat_find_stream_info(dec_fmt_ctx, NULL) < 0){
+    avformat_close_input(&dec_fmt_ctx);
+    return false;
+  }
+
+  const AVCodec* decoder = NULL;
+  
+  dec_stream_index = av_find_best_stream(dec_fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+  if(dec_stream_index < 0 || decoder == NULL){
+    avformat_close_input(&dec_fmt_ctx);
+    return false;
+  }
+
+  dec_ctx = avcodec_alloc_context3(decoder);
+  if(dec_ctx == NULL){
+    avformat_close_input(&dec_fmt_ctx);
+    return false;
+  }
+
+  avcodec_parameters_to_context(dec_ctx, dec_fmt_ctx->streams[dec_stream_index]->codecpar);
+
+  // libavcodec's own threads: decoding must keep ahead of the presentation
+  dec_ctx->thread_count = 0; // automatic
+  dec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+
+  if(avcodec_open2(dec_ctx, decoder, NULL) < 0 ||
+     (dec_ctx->pix_fmt != AV_PIX_FMT_YUV420P && dec_ctx->pix_fmt != AV_PIX_FMT_YUVJ420P)){
+    logging.error("sdl-theora: cannot decode video (YUV420P video only)");
+    
+    avcodec_free_context(&dec_ctx);
+    avformat_close_input(&dec_fmt_ctx);
+    return false;
+  }
+
+  decodeWidth = dec_ctx->width;
+  decodeHeight = dec_ctx->height;
+
+  {
+    std::lock_guard<std::mutex> lock2(decoded_mutex);
+    max_decoded = (prefetchFrames > 0) ? prefetchFrames : 1;
+    frames_dropped = 0;
+    decoder_eof = false;
+    decoding = true;
+  }
+
+  try{
+    decoder_thread = new std::thread(&SDLAVCodec::decoder_loop, this);
+  }
+  catch(std::exception& e){
+    decoder_thread = nullptr;
+    decoding = false;
+    avcodec_free_context(&dec_ctx);
+    avformat_close_input(&dec_fmt_ctx);
+    return false;
+  }
+
+  return true;
+}
+
+
+void SDLAVCodec::decoder_loop()
+{
+  logging.info("sdl-theora: decoder thread started..");
+  
+  AVPacket* packet = av_packet_alloc();
+  AVStream* in = dec_fmt_ctx->streams[dec_stream_index];
+  const int64_t start = (in->start_time != AV_NOPTS_VALUE) ? in->start_time : 0;
+
+  bool eof = false;
+
+  while(packet && decoding){
+    if(eof == false){
+      int ret = av_read_frame(dec_fmt_ctx, packet);
+      
+      if(ret < 0){
+	eof = true;
+	avcodec_send_packet(dec_ctx, NULL); // drains the decoder
+      }
+      else{
+	if(packet->stream_index == dec_stream_index)
+	  avcodec_send_packet(dec_ctx, packet);
+	
+	av_packet_unref(packet);
+      }
+    }
+
+    int ret = 0;
+
+    while(decoding){
+      AVFrame* frame = av_frame_alloc();
+      if(frame == NULL){ ret = AVERROR_EOF; break; }
+
+      ret = avcodec_receive_frame(dec_ctx, frame);
+      if(ret < 0){
+	av_frame_free(&frame);
+	break;
+      }
+
+      int64_t ts = frame->best_effort_timestamp;
+      if(ts == AV_NOPTS_VALUE) ts = frame->pts;
+      if(ts == AV_NOPTS_VALUE) ts = start;
+
+      SDLAVCodec::decodedframe d;
+      d.frame = frame;
+      d.msecs = (unsigned long long)
+	av_rescale_q(ts - start, in->time_base, (AVRational){1, 1000});
+
+      // waits until there is room in the prefetch queue
+      std::unique_lock<std::mutex> lock(decoded_mutex);
+      decoded_cond.wait(lock, [&]() { return (decoded.size() < max_decoded || decoding == false); });
+
+      if(decoding == false){
+	av_frame_free(&frame);
+	break;
+      }
+
+      decoded.push_back(d);
+    }
+
+    if(eof && ret == AVERROR_EOF) break; // all frames decoded
+  }
+
+  av_packet_free(&packet);
+
+  {
+    std::lock_guard<std::mutex> lock(decoded_mutex);
+    decoder_eof = true;
+  }
+
+  decoded_cond.notify_all();
+  
+  logging.info("sdl-theora: decoder thread halt.");
+}
+
+
+bool SDLAVCodec::showFrame(unsigned long long msecs, SDL_Surface* surface)
+{
+  if(surface == nullptr) return false;
+  
+  SDLAVCodec::decodedframe d;
+  
+  {
+    std::lock_guard<std::mutex> lock(decoded_mutex);
+
+    // skips frames whose successor is already due
+    while(decoded.size() >= 2 && (++decoded.begin())->msecs <= msecs){
+      av_frame_free(&(decoded.front().frame));
+      decoded.pop_front();
+      frames_dropped++;
+    }
+
+    if(decoded.size() == 0 || decoded.front().msecs > msecs)
+      return false;
+
+    d = decoded.front();
+    decoded.pop_front();
+  }
+
+  decoded_cond.notify_all(); // decoder can continue
+
+  bool ok = true;
+
+  if(SDL_MUSTLOCK(surface)) ok = (SDL_LockSurface(surface) == 0);
+  
+  if(ok){
+    convertYUV420ToRGB(d.frame, surface);
+    if(SDL_MUSTLOCK(surface)) SDL_UnlockSurface(surface);
+  }
+
+  av_frame_free(&d.frame);
+
+  return ok;
+}
+
+
+bool SDLAVCodec::endOfStream() const
+{
+  std::lock_guard<std::mutex> lock(decoded_mutex);
+  return (decoder_thread == nullptr || (decoder_eof && decoded.size() == 0));
+}
+
+
+unsigned long long SDLAVCodec::getDroppedFrames() const
+{
+  std::lock_guard<std::mutex> lock(decoded_mutex);
+  return frames_dropped;
+}
+
+
+void SDLAVCodec::stopDecoding()
+{
+  std::lock_guard<std::mutex> lock(start_lock);
+  stop_decoding();
+}
+
+
+void SDLAVCodec::stop_decoding()
+{
+  {
+    std::lock_guard<std::mutex> lock2(decoded_mutex);
+    decoding = false;
+  }
+
+  decoded_cond.notify_all();
+
+  if(decoder_thread){
+    decoder_thread->join();
+    delete decoder_thread;
+  }
+  decoder_thread = nullptr;
+
+  {
+    std::lock_guard<std::mutex> lock2(decoded_mutex);
+    
+    for(auto& d : decoded)
+      av_frame_free(&d.frame);
+    decoded.clear();
+  }
+
+  if(dec_ctx) avcodec_free_context(&dec_ctx);
+  if(dec_fmt_ctx) avformat_close_input(&dec_fmt_ctx);
+
+  dec_ctx = nullptr;
+  dec_fmt_ctx = nullptr;
+}
+
+
+// thread to do all encoding communication between theora and
+// writing resulting frames into disk
+void SDLAVCodec::encoder_loop()
+{
+  TaskScheduler::instance().joinStage(STAGE_ENCODE);
+  
+  logging.info("sdl-theora: encoder thread started..");
+  
+  prev = nullptr;
+  
+  logging.info("sdl-theora: theora video headers written..");
   
   // keeps encoding incoming frames
   SDLAVCodec::videoframe* f = nullptr;
@@ -517,8 +1519,11 @@ void SDLAVCodec::encoder_loop()
   
   while(1)
   {
+    size_t queued = 0;
+    double queueFill = 0.0;
+    
     {
-      incoming_mutex.lock();
+      std::unique_lock<std::mutex> lock(incoming_mutex);
 
       {
 	char buffer[80];
@@ -529,20 +1534,35 @@ void SDLAVCodec::encoder_loop()
       if(incoming.size() > 0){ // has incoming picture data
 	f = incoming.front();
 	incoming.pop_front();
-	incoming_mutex.unlock();
+	
+	queue_stats.queueBytes -= f->bytes;
+
+	queued = incoming.size();
+	queueFill = (double)queue_stats.queueBytes/(double)max_queue_bytes;
+	
+	lock.unlock();
+	incoming_cond.notify_all(); // wakes up blocked producer
       }
       else{
-	incoming_mutex.unlock();
-	
-	// sleep here ~10ms [time between frames 1ms]
-	std::this_thread::sleep_for(std::chrono::milliseconds(MSECS_PER_FRAME/10));
+	// waits for frames ~1ms [time between frames 10ms]
+	incoming_cond.wait_for(lock, std::chrono::milliseconds(MSECS_PER_FRAME/10));
 	
 	continue;
       }
     }
     
+    const auto busyStart = std::chrono::steady_clock::now();
+    
     // converts milliseconds field to frame number
     long long f_frame = (f->msecs / MSECS_PER_FRAME);
+    const long long previous_generated = latest_frame_generated;
+
+    // preset (mpeg4: all settings) is changed by starting a new encoder:
+    // its first frame is a keyframe
+    if(encoder_level != speed_level){
+      if(reopen_encoder() == false)
+	logging.error("sdl-theora: restarting encoder failed, speed level is not changed");
+    }
     
     // if there has been no frames between:
     // last_frame_generated .. f_frame
@@ -597,6 +1617,16 @@ void SDLAVCodec::encoder_loop()
       logging.info("sdl-theora: writing current frame");
 
       f->frame->pts = f_frame;
+
+      measure_latency = true;
+      current_inserted = f->inserted;
+
+      // scene cut hint forces keyframe unless the previous one is too close
+      if(f->keyframe &&
+	 (latest_keyframe < 0 || f_frame - latest_keyframe >= (long long)min_keyframe_distance))
+	f->frame->pict_type = AV_PICTURE_TYPE_I;
+      else
+	f->frame->pict_type = AV_PICTURE_TYPE_NONE;
       
       if(encode_frame(f->frame, f->last) == false)
 	logging.error("sdl-theora: encoding frame failed");
@@ -609,10 +1639,26 @@ void SDLAVCodec::encoder_loop()
     }
     
     latest_frame_generated = f_frame;
+    
+    f->frame->pict_type = AV_PICTURE_TYPE_NONE; // repeats of f are not keyframes
+
+    // audio packets of the frame's duration go to the file with it
+    if(write_audio(f_frame + 1, f->last) == false)
+      logging.error("sdl-theora: writing audio failed");
+
+    const double busyMsecs = std::chrono::duration<double, std::milli>
+      (std::chrono::steady_clock::now() - busyStart).count();
+    
+    TaskScheduler::instance().addBusyTime(STAGE_ENCODE, busyMsecs);
+
+    // frames of video written during busy time (gap frames and the current one)
+    adapt_speed(busyMsecs,
+		(previous_generated < 0) ? f_frame + 1 : f_frame - previous_generated,
+		queued, queueFill);
 
     if(prev != nullptr){
 
-      av_frame_free(&(prev->frame));
+      release_frame(prev->frame);
       delete prev;
       prev = nullptr;
     }
@@ -633,7 +1679,7 @@ void SDLAVCodec::encoder_loop()
   
   // all frames has been written
   if(prev != nullptr){
-    av_frame_free(&(prev->frame));
+    release_frame(prev->frame);
     delete prev;
     prev = nullptr;
   }
@@ -643,18 +1689,185 @@ void SDLAVCodec::encoder_loop()
   {
     std::lock_guard<std::mutex> lock1(incoming_mutex);
     for(auto i : incoming){
-      av_frame_free(&(i->frame));
+      release_frame(i->frame);
       delete i;
     }
     
     incoming.clear();
+    queue_stats.queueBytes = 0;
+    
+    logging.info("sdl-theora: encoder thread halt. running = false");
+    running = false; // under incoming_mutex so blocked producer cannot miss it
   }
+
+  incoming_cond.notify_all();
+  
+}
+
+
+bool SDLAVCodec::write_packet(AVPacket* packet)
+{
+  int ret = 0;
+  
+  if(live){
+    // no buffering for interleaving: packet goes out immediately
+    ret = av_write_frame(fmt_ctx, packet);
+    av_packet_unref(packet);
+    avio_flush(fmt_ctx->pb);
+  }
+  else{
+    // interleaved with audio packets, takes ownership of the packet data
+    ret = av_interleaved_write_frame(fmt_ctx, packet);
+  }
+
+  return (ret >= 0);
+}
+
+
+SDLAVCodec::LatencyStats SDLAVCodec::getLatencyStats() const
+{
+  std::lock_guard<std::mutex> lock(incoming_mutex);
+  return latency_stats;
+}
+
+
+void SDLAVCodec::adapt_speed(double busyMsecs, long long frames, size_t queued,
+			     double queueFill)
+{
+  if(frames < 1) frames = 1;
+
+  // encoding time per video time, recent frames are weighted
+  // more (time constant of ~10 frames)
+  double load = busyMsecs/(double)(frames*MSECS_PER_FRAME);
   
   {
-    logging.info("sdl-theora: encoder thread halt. running = false");
-    running = false;
+    std::lock_guard<std::mutex> lock(incoming_mutex);
+    
+    SpeedStats& s = speed_stats;
+    
+    if(s.load <= 0.0){
+      s.load = load;
+      s.encodeMsecs = busyMsecs/frames;
+    }
+    else{
+      s.load = 0.9*s.load + 0.1*load;
+      s.encodeMsecs = 0.9*s.encodeMsecs + 0.1*(busyMsecs/frames);
+    }
+
+    load = s.load;
+  }
+
+  if(speed_crf == false && speed_reopen == false) return;
+  
+  if(speed_hold > 0){ // previous change has not yet shown its effect
+    speed_hold--;
+    return;
+  }
+
+  // more than 0.1 seconds of video waiting or half of the queue budget used
+  const bool behind = load > SPEED_BEHIND_LOAD ||
+    queued >= (size_t)(FPS/10) || queueFill > 0.5;
+
+  if(behind == false && load < SPEED_SPARE_LOAD && queued <= 1) speed_idle++;
+  else speed_idle = 0;
+
+  unsigned int level = speed_level;
+
+  if(behind && level > 0) level--;
+  else if(speed_idle >= 2*FPS && level < speed_max) level++;
+  else return;
+
+  speed_idle = 0;
+
+  if(speed_crf &&
+     strcmp(SPEED_LEVELS[level].preset, SPEED_LEVELS[encoder_level].preset) == 0){
+    // quantizer is changed in place (x264 reconfigures from the next frame)
+    if(av_opt_set(av_ctx->priv_data, "crf", SPEED_LEVELS[level].crf, 0) < 0)
+      return;
+    
+    encoder_level = level;
+  }
+  else if(speed_reopen == false){
+    return; // preset of the file's encoder is fixed
   }
   
+  {
+    char buffer[160];
+    if(speed_crf)
+      snprintf(buffer, 160, "sdl-theora: encoder speed level %u -> %u (%s, crf %s): load %.2f, %d frames queued",
+	       speed_level, level, SPEED_LEVELS[level].preset, SPEED_LEVELS[level].crf,
+	       load, (int)queued);
+    else
+      snprintf(buffer, 160, "sdl-theora: encoder speed level %u -> %u (mbd %s, trellis %d, %s): load %.2f, %d frames queued",
+	       speed_level, level, SPEED_LEVELS[level].mbd, SPEED_LEVELS[level].trellis,
+	       SPEED_LEVELS[level].motion, load, (int)queued);
+    logging.info(buffer);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(incoming_mutex);
+    
+    if(level < speed_level) speed_stats.speedUps++;
+    else speed_stats.slowDowns++;
+    
+    speed_stats.level = level;
+  }
+
+  speed_level = level; // different settings: encoder is restarted before the next frame
+  speed_hold = FPS/2;
+}
+
+
+bool SDLAVCodec::reopen_encoder()
+{
+  AVCodecContext* ctx = avcodec_alloc_context3(codec);
+  
+  if(ctx){
+    configure_encoder(ctx, speed_level);
+    
+    if(avcodec_open2(ctx, codec, NULL) < 0)
+      avcodec_free_context(&ctx);
+  }
+
+  if(ctx == NULL){
+    // keeps the old encoder and stops changing presets
+    speed_reopen = false;
+    speed_level = encoder_level;
+    
+    std::lock_guard<std::mutex> lock(incoming_mutex);
+    speed_stats.level = speed_level;
+    
+    return false;
+  }
+
+  // frames delayed inside the old encoder (mpeg4 B-frames) are written
+  // first: the new encoder starts with a keyframe of the next frame
+  if(avcodec_send_frame(av_ctx, NULL) >= 0){
+    AVPacket packet;
+    av_init_packet(&packet);
+    
+    while(avcodec_receive_packet(av_ctx, &packet) >= 0){
+      packet.stream_index = stream->index;
+      av_packet_rescale_ts(&packet, av_ctx->time_base, stream->time_base);
+      write_packet(&packet);
+    }
+  }
+
+  avcodec_free_context(&av_ctx);
+  av_ctx = ctx;
+  encoder_level = speed_level;
+
+  {
+    std::lock_guard<std::mutex> lock(incoming_mutex);
+    speed_stats.reopens++;
+  }
+
+  char buffer[80];
+  snprintf(buffer, 80, "sdl-theora: encoder restarted at speed level %u",
+	   speed_level);
+  logging.info(buffer);
+  
+  return true;
 }
 
 
@@ -680,9 +1893,12 @@ bool SDLAVCodec::encode_frame(AVFrame* buffer,
     // av_packet_rescale_ts(&packet, av_ctx->time_base, av_ctx->time_base);
 
 
-    // packet.stream_index = stream->id;
-    packet.pts = buffer->pts;
-    packet.dts = buffer->pts;
+    // packet keeps timestamps set by the encoder: with B-frames packets
+    // leave in decoding order and are not the frame that was just sent
+    packet.stream_index = stream->index;
+
+    if((packet.flags & AV_PKT_FLAG_KEY) && packet.pts != AV_NOPTS_VALUE)
+      latest_keyframe = packet.pts;
 
 #if 0
     printf("STREAMS:\n");
@@ -700,9 +1916,22 @@ bool SDLAVCodec::encode_frame(AVFrame* buffer,
     
     
     //fwrite(packet.data, 1, packet.size, handle);
-    av_write_frame(fmt_ctx, &packet);
-    
-    av_packet_unref(&packet);
+    write_packet(&packet);
+
+    if(measure_latency){ // the first packet after encoding the current frame
+      const double ms = std::chrono::duration<double, std::milli>
+	(std::chrono::steady_clock::now() - current_inserted).count();
+      
+      measure_latency = false;
+
+      std::lock_guard<std::mutex> lock(incoming_mutex);
+      
+      LatencyStats& l = latency_stats;
+      l.avgMsecs = (l.avgMsecs*l.frames + ms)/(l.frames + 1);
+      l.frames++;
+      l.lastMsecs = ms;
+      if(ms > l.maxMsecs) l.maxMsecs = ms;
+    }
   }
 	  
   return true;
@@ -25,9 +25,16 @@ extern "C" {
 #include <string>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <chrono>
 
 #include <dinrhiw.h>
 
+#include "damage.h"
+#include "framepool.h"
+
 
 namespace whiteice {
   namespace resonanz {
@@ -39,24 +46,128 @@ namespace whiteice {
      */
     class SDLAVCodec {
     public:
-      SDLAVCodec(float q = 0.8f); // encoding quality between 0 and 1
+      // what to do with inserted frame when frames waiting for the
+      // encoder already use all of the queue's memory budget
+      enum QueuePolicy {
+	QUEUE_BLOCK,              // waits until the encoder has room for the frame
+	QUEUE_DROP_NEWEST,        // drops the inserted frame
+	QUEUE_DROP_OLDEST_NONKEY, // drops the oldest queued frame that is not a keyframe
+	QUEUE_COALESCE            // inserted frame replaces the newest queued frame
+      };
+
+      // counters of admission decisions
+      struct QueueStats {
+	unsigned long long admitted;      // frames queued without problems
+	unsigned long long blocked;       // insertions that had to wait
+	unsigned long long droppedNewest;
+	unsigned long long droppedOldest;
+	unsigned long long coalesced;
+	unsigned long long duplicates;    // unchanged pictures not queued at all
+	unsigned long long bandsSkipped;  // unchanged row bands not converted
+	unsigned long long queueBytes;    // memory used by the queue now
+	unsigned long long peakBytes;     // and at most
+      };
+
+      // adaptive encoder speed: level 0 is the fastest, higher levels use
+      // slower presets and smaller quantizers when the encoder has time
+      struct SpeedStats {
+	unsigned int level;           // current speed level
+	unsigned long long speedUps;  // changes to a faster level
+	unsigned long long slowDowns; // changes to a slower (better quality) level
+	unsigned long long reopens;   // encoder restarts (at keyframes) for level changes
+	double load;                  // encoding time per video time of recent frames
+	double encodeMsecs;           // encoding time per frame of recent frames
+      };
+      
+      // encoding quality between 0 and 1: above 0.5 slower encoder settings
+      // are used (1.0 is the slowest and best, for offline encoding)
+      SDLAVCodec(float q = 0.8f);
       virtual ~SDLAVCodec();
       
+      // adds soundtrack from an audio file (call before startEncoding()): audio
+      // packets are copied into the video without re-encoding starting at
+      // offsetMsecs of the video and looped (if loop is true) until the video ends
+      bool addAudioTrack(const std::string& filename,
+			 unsigned long long offsetMsecs = 0, bool loop = true);
+
+      // adds AAC encoded soundtrack for generated 16-bit interleaved PCM audio
+      // (call before startEncoding()), samples are given using insertAudio()
+      bool addAudioTrack(int sampleRate, int channels);
+
+      // inserts numSamples (per channel) PCM samples following the previous ones,
+      // the first sample is at msecs = 0 of the video
+      bool insertAudio(const int16_t* samples, unsigned int numSamples);
+      
+      // latency from insertFrame() to writing the frame's packet out
+      struct LatencyStats {
+	unsigned long long frames;
+	double avgMsecs;
+	double maxMsecs;
+	double lastMsecs;
+      };
+      
       // setups encoding structure
       bool startEncoding(const std::string& filename, unsigned int width, unsigned int height);
 
+      // setups low latency live encoding into MPEG-TS stream which can be watched
+      // while recording: url is "udp://host:port", a file (FIFO) or "-" for stdout
+      bool startStreaming(const std::string& url, unsigned int width, unsigned int height);
+
+      LatencyStats getLatencyStats() const;
+
       bool setupEncoder(); // helper function..
       
       // inserts SDL_Surface picture frame into video at msecs
       // onwards since the start of the encoding (msecs = 0 is the first frame)
-      // [nullptr means black empty frame]
+      // [nullptr means black empty frame]. If damage is given only the
+      // damaged area has changed since the previous inserted frame and
+      // only macroblock rows touching it are converted again
+      // keyframe hints scene cut: the picture changes so much that it should
+      // start a new GOP (ignored if the previous keyframe is too close).
+      // Frames at an already inserted frame time are absorbed into the next
+      // frame and return true, false means an error
       bool insertFrame(unsigned long long msecs,
-		       SDL_Surface* surface = nullptr);
+		       SDL_Surface* surface = nullptr,
+		       const DamageRegion* damage = nullptr,
+		       bool keyframe = false);
+      
+      // returns writable YUV420P frame (of encoding width and height) from
+      // the encoder's frame pool for rendering directly into YUV planes
+      AVFrame* acquireFrame();
+
+      // inserts YUV420P frame (from acquireFrame()) into video at msecs without
+      // copying or conversion, the encoder takes ownership of the frame
+      bool insertFrame(unsigned long long msecs, AVFrame* frame,
+		       bool keyframe = false);
+
+      // keyframes are at most maxFrames apart (GOP size) and keyframe hints
+      // closer than minFrames to the previous keyframe are ignored
+      // (call before startEncoding(), default: 10 seconds and 1 second)
+      void setKeyframeDistance(unsigned int maxFrames, unsigned int minFrames);
+
+      // shares frame pool with other encoders (call before startEncoding())
+      void setFramePool(std::shared_ptr<AVFramePool> pool);
+
+      // sets admission control of the encoder queue: maxBytes is the memory
+      // budget of frames waiting for encoding (0 = default 256 MB)
+      void setQueuePolicy(QueuePolicy policy, unsigned long long maxBytes = 0);
+
+      QueueStats getQueueStats() const;
+
+      // adapts encoder speed to queue depth and encoding time so that the
+      // encoder keeps up with real time (call before startEncoding(), default: on)
+      void setAdaptiveSpeed(bool enabled);
+
+      SpeedStats getSpeedStats() const;
       
       // stops encoding with a final frame [nullptr means black empty frame]
       bool stopEncoding(unsigned long long msecs,
 			SDL_Surface* surface = nullptr);
 
+      // stops encoding with a final YUV420P frame (from acquireFrame()),
+      // the encoder takes ownership of the frame
+      bool stopEncoding(unsigned long long msecs, AVFrame* frame);
+
       bool busy() const {
 	std::lock_guard<std::mutex> lock1(incoming_mutex);
 	bool r = (bool)(((this->incoming).size()) > 0);
@@ -66,9 +177,33 @@ namespace whiteice {
       
       // error was detected during encoding: restart encoding to try again
       bool error() const { return error_flag; }
+
+      unsigned long long getFPS() const { return FPS; }
+
+      // opens video file and starts decoding thread which keeps up to
+      // prefetchFrames decoded frames ready for presentation
+      bool startDecoding(const std::string& filename, unsigned int prefetchFrames = 32);
+
+      // presentation clock: shows the frame of video at msecs (since the start
+      // of the video) on surface, late frames are skipped. Returns false if the
+      // frame on screen did not change
+      bool showFrame(unsigned long long msecs, SDL_Surface* surface);
+
+      // all frames of the video have been shown
+      bool endOfStream() const;
+      
+      void stopDecoding();
+
+      unsigned int getDecodeWidth() const { return decodeWidth; }
+      unsigned int getDecodeHeight() const { return decodeHeight; }
+
+      // number of decoded frames skipped because they were late
+      unsigned long long getDroppedFrames() const;
       
     private:
-      bool __insert_frame(unsigned long long msecs, SDL_Surface* surface, bool last);
+      bool __insert_frame(unsigned long long msecs, SDL_Surface* surface,
+			  const DamageRegion* damage, bool last,
+			  bool keyframe = false);
       
       struct videoframe {
 	AVFrame* frame;
@@ -78,7 +213,51 @@ namespace whiteice {
 	
 	// last frame in video: instructs encoder loop to shutdown after this one
 	bool last;
+
+	bool keyframe; // scene cut hint
+
+	unsigned long long bytes; // memory reserved from the queue budget
+
+	std::chrono::steady_clock::time_point inserted; // insertFrame() call
       };
+
+      // setups encoding into file (mp4) or live stream (mpegts)
+      bool start(const std::string& filename, unsigned int width, unsigned int height,
+		 bool live);
+      
+      // waits for encoder thread to encode all frames and closes the file
+      bool finish_encoding();
+
+      // sets parameters of the (not yet opened) encoder at speed level
+      void configure_encoder(AVCodecContext* ctx, unsigned int level);
+
+      // measures encoding of the latest frame and changes speed level if
+      // the encoder is behind or has had time to spare for a while
+      // (busyMsecs to encode frames of video, queueFill is used part of budget)
+      void adapt_speed(double busyMsecs, long long frames, size_t queued,
+		       double queueFill);
+
+      // applies the settings of speed level that cannot be changed while
+      // encoding by reopening the encoder, the next frame is the first
+      // keyframe of the new encoder
+      bool reopen_encoder();
+
+      // writes packet to the output (takes ownership of the packet data)
+      bool write_packet(AVPacket* packet);
+      
+      // pushes frame to encoder queue
+      bool __queue_frame(SDLAVCodec::videoframe* f);
+
+      // returns frame back to the frame pool
+      void release_frame(AVFrame* frame);
+
+      // creates audio stream and opens audio source or encoder
+      bool open_audio();
+
+      // muxes audio packets before the start of video frame (flush writes all)
+      bool write_audio(long long frame, bool flush = false);
+
+      void close_audio();
       
       float quality;
       
@@ -87,14 +266,43 @@ namespace whiteice {
       long long latest_frame_encoded;
       
       mutable std::mutex incoming_mutex;
+      std::condition_variable incoming_cond; // queue has changed
       
       SDLAVCodec::videoframe* prev;
       
-      const unsigned int MAX_QUEUE_LENGTH = 10000*FPS; // maximum of 1 minute (60 seconds) of frames..
       std::list<SDLAVCodec::videoframe*> incoming; // incoming frames for the encoder (loop)
+
+      // admission control: frames are accepted while they fit into max_queue_bytes
+      // (at least one frame is always accepted so tiny budgets cannot stall)
+      static const unsigned long long DEFAULT_QUEUE_BYTES = 256ULL*1024ULL*1024ULL;
+      unsigned long long max_queue_bytes = DEFAULT_QUEUE_BYTES;
+      QueuePolicy queue_policy = QUEUE_BLOCK;
+      QueueStats queue_stats;
       
       bool running;
       bool error_flag;
+      bool live = false; // streaming: packets are written out immediately
+
+      unsigned int max_keyframe_distance = 0; // 0 = defaults
+      unsigned int min_keyframe_distance = 0;
+      long long latest_keyframe = -1; // frame number of the latest keyframe packet
+      bool pending_keyframe = false;  // hint of skipped frames
+
+      // latency of the frame being encoded (prev frame repeats are not measured)
+      bool measure_latency = false;
+      std::chrono::steady_clock::time_point current_inserted;
+      LatencyStats latency_stats;
+
+      // adaptive speed (used by the encoder thread, speed_stats under incoming_mutex)
+      bool adaptive_speed = true;
+      bool speed_crf = false;     // quantizer can be changed while encoding
+      bool speed_reopen = false;  // level can be changed by reopening at keyframe
+      unsigned int speed_level = 0;
+      unsigned int speed_max = 0;     // slowest level chosen by adaptation
+      unsigned int encoder_level = 0; // preset of the open encoder
+      unsigned int speed_hold = 0;    // frames before the next change is allowed
+      unsigned int speed_idle = 0;    // frames with time to spare in a row
+      SpeedStats speed_stats;
       
       // thread to do all encoding communication between theora and
       // writing resulting frames into disk
@@ -119,6 +327,63 @@ namespace whiteice {
       
       AVFrame *frame = nullptr;
       AVPacket *pkt = nullptr;
+
+      // previous inserted picture (RGB) and its conversion (YUV), unchanged
+      // areas of the next frame are copied from here
+      SDL_Surface* rgb_frame = nullptr;
+      AVFrame* yuv_frame = nullptr;
+      DamageRegion pending_damage; // changes not yet in rgb_frame
+      bool previous_valid = false; // rgb_frame is the picture of the latest queued frame
+
+      std::shared_ptr<AVFramePool> pool;
+
+      // soundtrack: audio file (stream copy) or generated PCM (AAC encoder)
+      std::string audio_filename;
+      long long audio_offset = 0; // msecs
+      bool audio_loop = true;
+      int audio_sample_rate = 0, audio_channels = 0;
+
+      AVStream* audio_stream = nullptr;
+
+      AVFormatContext* audio_in = nullptr;
+      int audio_in_index = -1;
+      AVPacket* audio_pkt = nullptr; // read from file but not yet muxed
+      bool audio_pending = false;
+      int64_t audio_loop_pts = 0; // start of the current loop (input time base)
+      int64_t audio_end_pts = 0;  // end of the latest packet read (input time base)
+      
+      std::mutex audio_mutex; // protects PCM encoder
+      AVCodecContext* audio_ctx = nullptr;
+      AVFrame* audio_frame = nullptr;
+      std::vector<float> audio_pcm; // interleaved samples waiting for a full frame
+      int64_t audio_samples = 0;    // samples sent to the encoder
+      std::list<AVPacket*> audio_packets; // encoded packets waiting for muxing
+
+      // decoding
+      struct decodedframe {
+	AVFrame* frame;
+	unsigned long long msecs; // presentation time
+      };
+
+      void decoder_loop();
+
+      // stops decoder thread and frees decoder (caller holds start_lock)
+      void stop_decoding();
+      
+      AVFormatContext* dec_fmt_ctx = nullptr;
+      AVCodecContext* dec_ctx = nullptr;
+      int dec_stream_index = -1;
+      unsigned int decodeWidth = 0, decodeHeight = 0;
+
+      std::thread* decoder_thread = nullptr;
+      bool decoding = false;     // decoder thread keeps running
+      bool decoder_eof = false;  // decoder thread has decoded all frames
+
+      mutable std::mutex decoded_mutex;
+      std::condition_variable decoded_cond;
+      std::list<SDLAVCodec::decodedframe> decoded; // prefetched frames
+      unsigned int max_decoded = 32;
+      unsigned long long frames_dropped = 0;
       
     };
     
@@ -0,0 +1,557 @@
+/*
+ * SDLAVEncoderProcess.cpp
+ *
+ */
+
+#include "SDLAVEncoderProcess.h"
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+// first argument of the encoder process' command line
+static const char* ENCODER_PROCESS_ARG = "--encoder-process";
+
+
+SDLAVEncoderProcess::SDLAVEncoderProcess(float q, unsigned int slots)
+{
+  if(q >= 0.0f && q <= 1.0f)
+    quality = q;
+  else
+    quality = 0.5f;
+
+  numSlots = (slots >= 2) ? slots : 2;
+  queue_policy = SDLAVCodec::QUEUE_BLOCK;
+  queue_bytes = 0;
+  adaptive_speed = true;
+
+  audio_offset = 0;
+  audio_loop = true;
+
+  stream = false;
+  width = 0;
+  height = 0;
+
+  running = false;
+  failed = false;
+  pid = 0;
+  epoch = 0;
+  restarted = false;
+  pending_keyframe = false;
+
+  stats.frames = 0;
+  stats.dropped = 0;
+  stats.restarts = 0;
+}
+
+
+SDLAVEncoderProcess::~SDLAVEncoderProcess()
+{
+#ifdef __linux__
+  if(pid > 0){
+    // not stopped: the recording cannot be finished
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    pid = 0;
+  }
+#endif
+
+  ring.close();
+}
+
+
+void SDLAVEncoderProcess::setQueuePolicy(SDLAVCodec::QueuePolicy policy,
+					 unsigned long long maxBytes)
+{
+  queue_policy = policy;
+  queue_bytes = maxBytes;
+}
+
+
+void SDLAVEncoderProcess::setAdaptiveSpeed(bool enabled)
+{
+  adaptive_speed = enabled;
+}
+
+
+bool SDLAVEncoderProcess::addAudioTrack(const std::string& filename,
+					unsigned long long offsetMsecs, bool loop)
+{
+  if(running) return false;
+
+  audio_filename = filename;
+  audio_offset = offsetMsecs;
+  audio_loop = loop;
+
+  return true;
+}
+
+
+bool SDLAVEncoderProcess::startEncoding(const std::string& filename,
+					unsigned int width, unsigned int height)
+{
+  return start(filename, false, width, height);
+}
+
+
+bool SDLAVEncoderProcess::startStreaming(const std::string& url,
+					 unsigned int width, unsigned int height)
+{
+  return start(url, true, width, height);
+}
+
+
+bool SDLAVEncoderProcess::start(const std::string& target, bool stream,
+				unsigned int width, unsigned int height)
+{
+#ifdef __linux__
+  if(running || width == 0 || height == 0) return false;
+
+  // the same layout as presenter's framebuffer: rows can be copied as they are
+  const unsigned int pitch = (4*width + 63) & ~63;
+
+  char name[80];
+  static unsigned int counter = 0;
+  snprintf(name, 80, "/resonanz-frames-%d-%u", (int)getpid(), counter++);
+
+  if(ring.create(name, width, height, pitch,
+		 0x00FF0000, 0x0000FF00, 0x000000FF, numSlots) == false)
+    return false;
+
+  this->target = target;
+  this->stream = stream;
+  this->width = width;
+  this->height = height;
+
+  // slots are uninitialized: everything is copied into them the first time
+  stale.assign(ring.getSlots(), SDLAVEncoderProcess::rows{ 0, (int)height });
+
+  pending_damage.resize(width, height);
+  pending_damage.addAll();
+  pending_keyframe = false;
+
+  epoch = 0;
+  restarted = true;
+  failed = false;
+
+  if(spawn(target, (long long)audio_offset) == false){
+    ring.close();
+    return false;
+  }
+
+  running = true;
+
+  return true;
+#else
+  logging.error("encoder process: separate encoder process is not supported on this platform");
+  return false;
+#endif
+}
+
+
+bool SDLAVEncoderProcess::spawn(const std::string& target, long long audioOffset)
+{
+#ifdef __linux__
+  // argument strings are prepared before fork(): the child only calls execv()
+  char q[32], policy[32], bytes[32], offset[32], threads[32];
+  snprintf(q, 32, "%f", quality);
+  snprintf(policy, 32, "%d", (int)queue_policy);
+  snprintf(bytes, 32, "%llu", queue_bytes);
+  snprintf(offset, 32, "%lld", audioOffset);
+  snprintf(threads, 32, "%u", TaskScheduler::instance().getThreads(STAGE_ENCODE));
+
+  // audio cannot start from the middle of the file: restarted encoders
+  // that begin after the music has started are recorded without audio
+  const std::string audio =
+    (audio_filename.size() > 0 && audioOffset >= 0) ? audio_filename : "-";
+
+  const std::string ringName = ring.getName();
+
+  const char* args[] = {
+    "SDLtest", ENCODER_PROCESS_ARG, ringName.c_str(),
+    stream ? "stream" : "file", target.c_str(),
+    q, policy, bytes, adaptive_speed ? "1" : "0", audio.c_str(), offset, audio_loop ? "1" : "0", threads,
+    NULL
+  };
+
+  const pid_t child = fork();
+
+  if(child < 0){
+    logging.error("encoder process: fork() failed");
+    return false;
+  }
+  else if(child == 0){
+    execv("/proc/self/exe", (char* const*)args);
+    _exit(127);
+  }
+
+  pid = child;
+
+  char buffer[160];
+  snprintf(buffer, 160, "encoder process: started (pid %d) writing into %s",
+	   (int)pid, target.c_str());
+  logging.info(buffer);
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+std::string SDLAVEncoderProcess::restart_target() const
+{
+  if(stream) return target; // stream continues from the same place
+
+  char suffix[32];
+  snprintf(suffix, 32, "-%llu", stats.restarts);
+
+  const size_t dot = target.rfind('.');
+  const size_t slash = target.rfind('/');
+
+  if(dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return target + suffix;
+  else
+    return target.substr(0, dot) + suffix + target.substr(dot);
+}
+
+
+void SDLAVEncoderProcess::check_process(unsigned long long msecs)
+{
+#ifdef __linux__
+  if(pid <= 0 || failed) return;
+
+  int status = 0;
+  if(waitpid(pid, &status, WNOHANG) != pid) return; // still running
+
+  char buffer[160];
+
+  if(WIFSIGNALED(status))
+    snprintf(buffer, 160, "encoder process: pid %d killed by signal %d",
+	     (int)pid, WTERMSIG(status));
+  else
+    snprintf(buffer, 160, "encoder process: pid %d exited with code %d",
+	     (int)pid, WEXITSTATUS(status));
+
+  logging.error(buffer);
+  pid = 0;
+
+  if(stats.restarts >= MAX_RESTARTS){
+    logging.error("encoder process: too many restarts, recording stopped");
+    failed = true;
+    return;
+  }
+
+  // frames left in the ring are lost, the new encoder starts a new video
+  // (from msecs = 0) with a complete picture
+  ring.reset();
+  stats.restarts++;
+
+  epoch = msecs;
+  restarted = true;
+  pending_damage.addAll();
+
+  if(spawn(restart_target(), (long long)audio_offset - (long long)epoch) == false)
+    failed = true;
+#endif
+}
+
+
+bool SDLAVEncoderProcess::insertFrame(unsigned long long msecs,
+				      SDL_Surface* surface,
+				      const DamageRegion* damage,
+				      bool keyframe)
+{
+  if(running == false || surface == nullptr) return false;
+
+  check_process(msecs);
+
+  if(surface->format->BytesPerPixel != 4 ||
+     surface->format->Rmask != 0x00FF0000 ||
+     surface->format->Gmask != 0x0000FF00 ||
+     surface->format->Bmask != 0x000000FF){
+    logging.error("encoder process: surface is not 32bit 0x00RRGGBB");
+    return false;
+  }
+
+  // rows touched by this frame differ now in every slot
+  SDLAVEncoderProcess::rows changed = { (int)height, 0 };
+
+  if(damage){
+    pending_damage.add(*damage);
+
+    for(const auto& r : damage->rects()){
+      if(r.y < changed.y0) changed.y0 = r.y;
+      if(r.y + r.h > changed.y1) changed.y1 = r.y + r.h;
+    }
+  }
+  else{
+    pending_damage.addAll();
+    changed = SDLAVEncoderProcess::rows{ 0, (int)height };
+  }
+
+  pending_keyframe = pending_keyframe || keyframe;
+
+  if(changed.y0 < changed.y1){
+    for(auto& s : stale){
+      if(s.y0 >= s.y1) s = changed;
+      else{
+	if(changed.y0 < s.y0) s.y0 = changed.y0;
+	if(changed.y1 > s.y1) s.y1 = changed.y1;
+      }
+    }
+  }
+
+  if(failed || pid <= 0 || msecs < epoch){
+    stats.dropped++;
+    return true;
+  }
+
+  // renderer never waits for the encoder
+  const int slot = ring.acquireSlot(0);
+
+  if(slot < 0){
+    stats.dropped++;
+    return true;
+  }
+
+  {
+    SDLAVEncoderProcess::rows& s = stale[slot];
+
+    const int y1 = (s.y1 < surface->h) ? s.y1 : surface->h;
+    const unsigned int pitch = ring.getPitch();
+    const unsigned int rowBytes =
+      4*(((unsigned int)surface->w < width) ? (unsigned int)surface->w : width);
+
+    Uint8* dst = ring.pixels(slot);
+    const Uint8* src = (const Uint8*)surface->pixels;
+
+    if((unsigned int)surface->pitch == pitch && rowBytes == 4*width){
+      if(s.y0 < y1)
+	memcpy(dst + s.y0*pitch, src + s.y0*pitch, (size_t)(y1 - s.y0)*pitch);
+    }
+    else{
+      for(int y=s.y0;y<y1;y++)
+	memcpy(dst + y*pitch, src + y*surface->pitch, rowBytes);
+    }
+
+    s = SDLAVEncoderProcess::rows{ 0, 0 };
+  }
+
+  SharedFrameRing::FrameInfo* info = ring.info(slot);
+
+  info->msecs = msecs - epoch;
+  info->keyframe = pending_keyframe ? 1 : 0;
+  info->last = 0;
+  info->fullDamage =
+    (restarted || pending_damage.rects().size() > SharedFrameRing::MAX_RECTS) ? 1 : 0;
+  info->numRects = 0;
+
+  if(info->fullDamage == 0){
+    for(const auto& r : pending_damage.rects())
+      info->rects[info->numRects++] = r;
+  }
+
+  ring.publish();
+
+  pending_damage.clear();
+  pending_keyframe = false;
+  restarted = false;
+  stats.frames++;
+
+  return true;
+}
+
+
+bool SDLAVEncoderProcess::stopEncoding(unsigned long long msecs)
+{
+#ifdef __linux__
+  if(running == false) return false;
+
+  running = false;
+  check_process(msecs);
+
+  bool ok = false;
+
+  if(pid > 0 && failed == false){
+    // waits for room in the ring while the encoder process is alive
+    int slot = -1;
+
+    while(slot < 0){
+      slot = ring.acquireSlot(100);
+      if(slot >= 0) break;
+
+      int status = 0;
+      if(waitpid(pid, &status, WNOHANG) == pid){
+	logging.error("encoder process: exited before the end of the video");
+	pid = 0;
+	break;
+      }
+    }
+
+    if(slot >= 0){
+      SharedFrameRing::FrameInfo* info = ring.info(slot);
+
+      info->msecs = (msecs > epoch) ? msecs - epoch : 0;
+      info->keyframe = 0;
+      info->last = 1;
+      info->fullDamage = 1;
+      info->numRects = 0;
+
+      ring.publish();
+
+      int status = 0;
+
+      if(waitpid(pid, &status, 0) == pid)
+	ok = (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+      pid = 0;
+
+      if(ok == false)
+	logging.error("encoder process: finishing the video failed");
+    }
+  }
+
+  ring.close();
+
+  return ok;
+#else
+  return false;
+#endif
+}
+
+
+bool SDLAVEncoderProcess::isEncoderProcess(int argc, char** argv)
+{
+  return (argc >= 2 && strcmp(argv[1], ENCODER_PROCESS_ARG) == 0);
+}
+
+
+int SDLAVEncoderProcess::encoderProcessMain(int argc, char** argv)
+{
+#ifdef __linux__
+  // <program> --encoder-process <ring> <file|stream> <target> <quality>
+  //   <queue policy> <queue bytes> <adaptive speed> <audio file|-> <audio offset>
+  //   <loop> <threads>
+  if(argc < 13){
+    logging.error("encoder process: bad command line");
+    return 2;
+  }
+
+  // interrupt from terminal goes to the whole process group: the
+  // renderer decides when the video ends, its exit is noticed below
+  signal(SIGINT, SIG_IGN);
+  const pid_t parent = getppid();
+
+  TaskScheduler::instance().configure(1, (unsigned int)atoi(argv[12]), false);
+  TaskScheduler::instance().joinStage(STAGE_ENCODE);
+
+  SharedFrameRing ring;
+  if(ring.attach(argv[2]) == false) return 1;
+
+  Uint32 rmask = 0, gmask = 0, bmask = 0;
+  ring.getMasks(rmask, gmask, bmask);
+
+  // encoder reads the slots in place
+  std::vector<SDL_Surface*> surfaces(ring.getSlots());
+
+  for(unsigned int i=0;i<surfaces.size();i++){
+    surfaces[i] = SDL_CreateRGBSurfaceFrom(ring.pixels(i), ring.getWidth(), ring.getHeight(),
+					   32, ring.getPitch(), rmask, gmask, bmask, 0);
+    if(surfaces[i] == NULL){
+      logging.error("encoder process: cannot create surface");
+      return 1;
+    }
+  }
+
+  SDLAVCodec* codec = new SDLAVCodec((float)atof(argv[5]));
+  codec->setQueuePolicy((SDLAVCodec::QueuePolicy)atoi(argv[6]), strtoull(argv[7], NULL, 10));
+  codec->setAdaptiveSpeed(atoi(argv[8]) != 0);
+
+  if(strcmp(argv[9], "-") != 0)
+    codec->addAudioTrack(argv[9], strtoull(argv[10], NULL, 10), atoi(argv[11]) != 0);
+
+  const bool started = (strcmp(argv[3], "stream") == 0) ?
+    codec->startStreaming(argv[4], ring.getWidth(), ring.getHeight()) :
+    codec->startEncoding(argv[4], ring.getWidth(), ring.getHeight());
+
+  if(started == false){
+    logging.error("encoder process: cannot start encoding");
+    delete codec;
+    return 1;
+  }
+
+  DamageRegion damage(ring.getWidth(), ring.getHeight());
+  unsigned long long latest = 0;
+  int code = 0;
+
+  while(1){
+    const int slot = ring.waitFrame(200);
+
+    if(slot < 0){
+      if(getppid() != parent){
+	// renderer has exited without ending the video: closes it here
+	logging.error("encoder process: renderer has exited");
+	codec->stopEncoding(latest);
+	code = 1;
+	break;
+      }
+
+      continue;
+    }
+
+    const SharedFrameRing::FrameInfo* info = ring.info(slot);
+
+    if(info->last){
+      if(codec->stopEncoding(info->msecs) == false) code = 1;
+      ring.release();
+      break;
+    }
+
+    damage.clear();
+    for(unsigned int i=0;i<info->numRects && i<SharedFrameRing::MAX_RECTS;i++)
+      damage.add(info->rects[i]);
+
+    // picture is converted before insertFrame() returns: slot can be released
+    codec->insertFrame(info->msecs, surfaces[slot],
+		       info->fullDamage ? nullptr : &damage, info->keyframe != 0);
+
+    latest = info->msecs;
+    ring.release();
+
+    if(codec->error()){
+      logging.error("encoder process: encoding failed");
+      codec->stopEncoding(latest);
+      code = 1;
+      break;
+    }
+  }
+
+  delete codec;
+
+  for(auto& s : surfaces)
+    SDL_FreeSurface(s);
+
+  return code;
+#else
+  return 1;
+#endif
+}
+
+
+}
+}
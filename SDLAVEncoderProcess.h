@@ -0,0 +1,128 @@
+/*
+ * SDLAVEncoderProcess.h
+ *
+ * runs SDLAVCodec in a separate encoder process so that an encoder crash
+ * (or libav bug) cannot take down the renderer: frames are passed through
+ * SharedFrameRing and the dead encoder process is restarted (recording
+ * continues into a new file) while the renderer keeps presenting.
+ * The encoder process is this program started again with arguments
+ * recognized by isEncoderProcess() (Linux only)
+ *
+ */
+
+#ifndef SDLAVENCODERPROCESS_H_
+#define SDLAVENCODERPROCESS_H_
+
+#include <SDL.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+#include "SDLAVCodec.h"
+#include "framering.h"
+#include "damage.h"
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class SDLAVEncoderProcess {
+    public:
+      // encoding quality between 0 and 1, frames in the shared memory ring
+      SDLAVEncoderProcess(float q = 0.8f, unsigned int slots = 8);
+      virtual ~SDLAVEncoderProcess();
+
+      // passed to the encoder process (call before starting),
+      // see SDLAVCodec::setQueuePolicy(), SDLAVCodec::setAdaptiveSpeed()
+      // and SDLAVCodec::addAudioTrack()
+      void setQueuePolicy(SDLAVCodec::QueuePolicy policy, unsigned long long maxBytes = 0);
+      void setAdaptiveSpeed(bool enabled);
+      bool addAudioTrack(const std::string& filename,
+			 unsigned long long offsetMsecs = 0, bool loop = true);
+
+      // starts encoder process writing into file or live stream
+      // (see SDLAVCodec::startEncoding() and SDLAVCodec::startStreaming())
+      bool startEncoding(const std::string& filename, unsigned int width, unsigned int height);
+      bool startStreaming(const std::string& url, unsigned int width, unsigned int height);
+
+      // copies rows of surface changed since the slot was last used into a
+      // free slot of the ring (the encoder reads it in place). Never waits:
+      // the frame is dropped if the encoder process is behind or restarting.
+      // Returns false only if encoding has not been started
+      bool insertFrame(unsigned long long msecs,
+		       SDL_Surface* surface,
+		       const DamageRegion* damage = nullptr,
+		       bool keyframe = false);
+
+      // ends the video with a black frame at msecs and waits
+      // for the encoder process to finish writing it
+      bool stopEncoding(unsigned long long msecs);
+
+      struct ProcessStats {
+	unsigned long long frames;   // frames handed to the encoder process
+	unsigned long long dropped;  // ring was full or encoder was restarting
+	unsigned long long restarts; // encoder processes restarted after dying
+      };
+
+      ProcessStats getStats() const { return stats; }
+
+      // command line of the encoder process: main() calls encoderProcessMain()
+      static bool isEncoderProcess(int argc, char** argv);
+
+      // encoder process: encodes frames from the ring until the last frame
+      // or until the renderer exits, returns exit code of the process
+      static int encoderProcessMain(int argc, char** argv);
+
+    private:
+      bool start(const std::string& target, bool stream,
+		 unsigned int width, unsigned int height);
+
+      // forks and executes encoder process writing into target
+      bool spawn(const std::string& target, long long audioOffset);
+
+      // reaps dead encoder process and starts a new one (at most MAX_RESTARTS times)
+      void check_process(unsigned long long msecs);
+
+      // output of the restarted encoder: "intro.mp4" -> "intro-1.mp4"
+      std::string restart_target() const;
+
+      // restarts within the whole recording, encoder is not started again after these
+      static const unsigned int MAX_RESTARTS = 5;
+
+      float quality;
+      unsigned int numSlots;
+      SDLAVCodec::QueuePolicy queue_policy;
+      unsigned long long queue_bytes;
+      bool adaptive_speed;
+
+      std::string audio_filename;
+      unsigned long long audio_offset;
+      bool audio_loop;
+
+      std::string target;
+      bool stream;
+      unsigned int width, height;
+
+      bool running;
+      bool failed;       // encoder process gave up: frames are dropped
+      pid_t pid;         // encoder process (0 = none)
+      unsigned long long epoch; // msecs of the current encoder's first frame
+      bool restarted;    // next frame starts a new encoder
+
+      SharedFrameRing ring;
+
+      // rows [y0,y1) of each slot that differ from the renderer's picture
+      struct rows { int y0, y1; };
+      std::vector<SDLAVEncoderProcess::rows> stale;
+
+      DamageRegion pending_damage; // changes since the previous published frame
+      bool pending_keyframe;
+
+      ProcessStats stats;
+    };
+
+  }
+}
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * SDLAVLadder.cpp
+ *
+ */
+
+#include "SDLAVLadder.h"
+#include "yuvconvert.h"
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+SDLAVLadder::SDLAVLadder(float q)
+{
+  if(q >= 0.0f && q <= 1.0f)
+    quality = q;
+  else
+    quality = 0.5f;
+
+  running = false;
+  latest_frame_encoded = -1;
+  pending_keyframe = false;
+}
+
+
+SDLAVLadder::~SDLAVLadder()
+{
+  for(auto& r : renditions)
+    delete r.encoder;
+
+  renditions.clear();
+
+  if(rgb_frame) SDL_FreeSurface(rgb_frame);
+  if(yuv_frame) av_frame_free(&yuv_frame);
+}
+
+
+bool SDLAVLadder::addRendition(const std::string& filename,
+			       unsigned int width, unsigned int height)
+{
+  if(running || width == 0 || height == 0) return false;
+
+  // YUV420P picture needs even size
+  width &= ~1;
+  height &= ~1;
+
+  if(renditions.size() > 0){
+    if(width > renditions.back().width || height > renditions.back().height)
+      return false;
+  }
+
+  SDLAVLadder::rendition r;
+  r.filename = filename;
+  r.width = width;
+  r.height = height;
+  r.encoder = new SDLAVCodec(quality);
+  r.pool = std::make_shared<AVFramePool>(width, height, AV_PIX_FMT_YUV420P);
+
+  r.encoder->setFramePool(r.pool);
+
+  renditions.push_back(r);
+
+  return true;
+}
+
+
+SDLAVCodec* SDLAVLadder::getEncoder(unsigned int index)
+{
+  if(index >= renditions.size()) return nullptr;
+  return renditions[index].encoder;
+}
+
+
+bool SDLAVLadder::startEncoding()
+{
+  if(running || renditions.size() == 0) return false;
+
+  const unsigned int width = renditions[0].width;
+  const unsigned int height = renditions[0].height;
+
+  rgb_frame = SDL_CreateRGBSurface(0, width, height, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+  if(rgb_frame == NULL) return false;
+
+  yuv_frame = av_frame_alloc();
+  if(yuv_frame == NULL) return false;
+
+  yuv_frame->format = AV_PIX_FMT_YUV420P;
+  yuv_frame->width = width;
+  yuv_frame->height = height;
+
+  if(av_frame_get_buffer(yuv_frame, 0) != 0) return false;
+
+  pending_damage.resize(width, height);
+  pending_damage.addAll(); // the first frame is always converted fully
+
+  for(auto& r : renditions){
+    if(r.encoder->startEncoding(r.filename, r.width, r.height) == false){
+      logging.error("sdl-ladder: starting rendition encoder failed");
+      return false;
+    }
+  }
+
+  latest_frame_encoded = -1;
+  pending_keyframe = false;
+  running = true;
+
+  return true;
+}
+
+
+bool SDLAVLadder::insertFrame(unsigned long long msecs, SDL_Surface* surface,
+			      const DamageRegion* damage, bool keyframe)
+{
+  if(running == false) return false;
+
+  // skips conversions when the picture of the current frame is already inserted
+  const long long frame = (long long)(msecs*renditions[0].encoder->getFPS()/1000);
+
+  if(damage && surface) pending_damage.add(*damage);
+  else pending_damage.addAll();
+
+  pending_keyframe = pending_keyframe || keyframe;
+
+  // picture of this frame time is already queued: changes go with the next frame
+  if(frame <= latest_frame_encoded)
+    return true;
+
+  if(convert(surface, &pending_damage) == false)
+    return false;
+
+  pending_damage.clear();
+
+  if(encode(msecs, false, pending_keyframe) == false)
+    return false;
+
+  latest_frame_encoded = frame;
+  pending_keyframe = false;
+
+  return true;
+}
+
+
+bool SDLAVLadder::stopEncoding(unsigned long long msecs, SDL_Surface* surface)
+{
+  if(running == false) return false;
+
+  pending_damage.addAll();
+
+  bool ok = convert(surface, &pending_damage);
+  ok = encode(msecs, true) && ok;
+
+  running = false;
+
+  return ok;
+}
+
+
+bool SDLAVLadder::error() const
+{
+  for(const auto& r : renditions)
+    if(r.encoder->error()) return true;
+
+  return false;
+}
+
+
+bool SDLAVLadder::convert(SDL_Surface* surface, const DamageRegion* damage)
+{
+  // only macroblock rows (16 lines) touched by the damaged area are
+  // converted, the rest of the picture is the same as in the previous frame
+  const int MBROWS = (yuv_frame->height + 15)/16;
+  std::vector<bool> dirtyRows(MBROWS, (surface == NULL));
+
+  const Uint32 black = SDL_MapRGB(rgb_frame->format, 0, 0, 0);
+
+  if(surface != NULL){
+    for(const auto& r : damage->rects()){
+      SDL_Rect src = r;
+      SDL_Rect dst = r;
+
+      SDL_FillRect(rgb_frame, &dst, black);
+      SDL_BlitSurface(surface, &src, rgb_frame, &dst);
+
+      for(int row=r.y/16;row<MBROWS && row*16<r.y+r.h;row++)
+	dirtyRows[row] = true;
+    }
+  }
+  else{ // black frame
+    SDL_FillRect(rgb_frame, NULL, black);
+  }
+
+  if(av_frame_make_writable(yuv_frame) != 0)
+    return false;
+
+  for(int row=0;row<MBROWS;){
+    if(dirtyRows[row] == false){ row++; continue; }
+
+    int end = row;
+    while(end < MBROWS && dirtyRows[end]) end++;
+
+    convertRGBToYUV420(rgb_frame, yuv_frame, row*16, end*16);
+
+    row = end;
+  }
+
+  return true;
+}
+
+
+bool SDLAVLadder::encode(unsigned long long msecs, bool last, bool keyframe)
+{
+  std::vector<AVFrame*> frames(renditions.size(), nullptr);
+
+  // each rendition is scaled from the previous one (pyramid)
+  for(unsigned int i=0;i<renditions.size();i++){
+    frames[i] = renditions[i].pool->acquire();
+
+    bool ok = (frames[i] != nullptr);
+
+    if(ok){
+      if(i == 0)
+	ok = (av_frame_copy(frames[i], yuv_frame) >= 0);
+      else
+	scaleYUV420(frames[i-1], frames[i]);
+    }
+
+    if(ok == false){
+      for(unsigned int j=0;j<=i;j++)
+	if(frames[j]) renditions[j].pool->release(frames[j]);
+
+      logging.error("sdl-ladder: preparing rendition frames failed");
+      return false;
+    }
+  }
+
+  // encoders take ownership of the frames
+  bool ok = true;
+
+  for(unsigned int i=0;i<renditions.size();i++){
+    if(last)
+      ok = renditions[i].encoder->stopEncoding(msecs, frames[i]) && ok;
+    else
+      ok = renditions[i].encoder->insertFrame(msecs, frames[i], keyframe) && ok;
+  }
+
+  return ok;
+}
+
+
+}
+}
@@ -0,0 +1,95 @@
+/*
+ * SDLAVLadder.h
+ *
+ * encodes the same picture into several renditions (resolutions) at
+ * once: SDL_Surface is converted to YUV only once and smaller renditions
+ * are downscaled from the previous (larger) one, each rendition has
+ * its own SDLAVCodec encoder thread
+ *
+ */
+
+#ifndef SDLAVLADDER_H_
+#define SDLAVLADDER_H_
+
+#include <SDL.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+};
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "SDLAVCodec.h"
+#include "damage.h"
+#include "framepool.h"
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class SDLAVLadder {
+    public:
+      SDLAVLadder(float q = 0.8f); // encoding quality between 0 and 1
+      virtual ~SDLAVLadder();
+
+      // adds output file (call before startEncoding()), the first rendition
+      // is the master whose size the inserted surfaces have, the rest must
+      // be added in decreasing size
+      bool addRendition(const std::string& filename,
+			unsigned int width, unsigned int height);
+
+      unsigned int getNumberOfRenditions() const { return renditions.size(); }
+
+      // encoder of the rendition for setting up its queue policy, audio etc.
+      SDLAVCodec* getEncoder(unsigned int index);
+
+      bool startEncoding();
+
+      // inserts SDL_Surface picture frame into all renditions at msecs
+      // (see SDLAVCodec::insertFrame())
+      bool insertFrame(unsigned long long msecs,
+		       SDL_Surface* surface = nullptr,
+		       const DamageRegion* damage = nullptr,
+		       bool keyframe = false);
+
+      // stops encoding of all renditions with a final frame
+      bool stopEncoding(unsigned long long msecs,
+			SDL_Surface* surface = nullptr);
+
+      bool error() const;
+
+    private:
+      struct rendition {
+	std::string filename;
+	unsigned int width, height;
+
+	SDLAVCodec* encoder;
+	std::shared_ptr<AVFramePool> pool; // shared with encoder
+      };
+
+      // converts surface (damaged area) into master yuv frame
+      bool convert(SDL_Surface* surface, const DamageRegion* damage);
+
+      // sends master frame and its downscaled pyramid to encoders
+      bool encode(unsigned long long msecs, bool last, bool keyframe = false);
+
+      float quality;
+      bool running;
+
+      std::vector<SDLAVLadder::rendition> renditions;
+
+      long long latest_frame_encoded;
+      bool pending_keyframe; // hint of skipped frames
+
+      // previous inserted picture (RGB) and its conversion
+      SDL_Surface* rgb_frame = nullptr;
+      AVFrame* yuv_frame = nullptr;
+      DamageRegion pending_damage;
+    };
+
+  }
+}
+
+#endif
@@ -0,0 +1,490 @@
+/*
+ * SDLAVSegmentEncoder.cpp
+ *
+ */
+
+#include "SDLAVSegmentEncoder.h"
+#include "yuvconvert.h"
+#include "scheduler.h"
+
+#include <stdio.h>
+
+//def av_err2str
+#define av_err2str2(errnum) av_make_error_string((char*)__builtin_alloca(AV_ERROR_MAX_STRING_SIZE), AV_ERROR_MAX_STRING_SIZE, errnum)
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+SDLAVSegmentEncoder::SDLAVSegmentEncoder(float q,
+					 unsigned int segmentLength,
+					 unsigned int numThreads) :
+  FPS(100) // same frame rate as in SDLAVCodec
+{
+  if(q >= 0.0f && q <= 1.0f)
+    quality = q;
+  else
+    quality = 0.5f;
+
+  if(segmentLength > 0) SEGMENT_LENGTH = segmentLength;
+  else SEGMENT_LENGTH = FPS;
+
+  if(numThreads > 0) NUM_THREADS = numThreads;
+  else NUM_THREADS = TaskScheduler::instance().getThreads(STAGE_ENCODE);
+
+  if(NUM_THREADS <= 0) NUM_THREADS = 1;
+
+  codec_name = "mpeg4";
+
+  running = false;
+  error_flag = false;
+}
+
+
+SDLAVSegmentEncoder::~SDLAVSegmentEncoder()
+{
+  if(running)
+    stopEncoding();
+}
+
+
+bool SDLAVSegmentEncoder::setCodec(const std::string& codec_name)
+{
+  if(running) return false;
+  if(avcodec_find_encoder_by_name(codec_name.c_str()) == NULL) return false;
+
+  this->codec_name = codec_name;
+
+  return true;
+}
+
+
+bool SDLAVSegmentEncoder::open_codec_context(AVCodecContext** ctx) const
+{
+  *ctx = avcodec_alloc_context3(codec);
+  if(*ctx == NULL) return false;
+
+  AVCodecContext* av_ctx = *ctx;
+
+  av_ctx->bit_rate = frameWidth * frameHeight * FPS * 2;
+  av_ctx->width = frameWidth;
+  av_ctx->height = frameHeight;
+  av_ctx->time_base = (AVRational){1, (int)FPS};
+  av_ctx->framerate = (AVRational){(int)FPS, 1};
+
+  // every segment is a single closed GOP starting with an intra frame and
+  // there are no B-frames so segments' decoding timestamps never overlap
+  av_ctx->gop_size = SEGMENT_LENGTH;
+  av_ctx->max_b_frames = 0;
+  av_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+  av_ctx->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+
+  // parallelism comes from segments
+  av_ctx->thread_count = 1;
+
+  if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    av_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+  av_opt_set(av_ctx->priv_data, "preset", "ultrafast", 0);
+  av_opt_set(av_ctx->priv_data, "crf", "32", 0);
+
+  int ret = avcodec_open2(av_ctx, codec, NULL);
+  if (ret < 0) {
+    fprintf(stderr, "Could not open codec: %s\n", av_err2str2(ret));
+    avcodec_free_context(ctx);
+    return false;
+  }
+
+  return true;
+}
+
+
+bool SDLAVSegmentEncoder::startEncoding(const std::string& filename,
+					unsigned int width, unsigned int height)
+{
+  if(width <= 0 || height <= 0)
+    return false;
+
+  if(running)
+    return false;
+
+  error_flag = false;
+
+  frameWidth = width;
+  frameHeight = height;
+
+  codec = avcodec_find_encoder_by_name(codec_name.c_str());
+  if (!codec) {
+    fprintf(stderr, "Codec '%s' not found\n", codec_name.c_str());
+    return false;
+  }
+
+  avformat_alloc_output_context2(&fmt_ctx,
+				 av_guess_format("mp4",
+						 filename.c_str(),
+						 "video/mp4"),
+				 NULL,
+				 filename.c_str());
+  if(fmt_ctx == NULL)
+    return false;
+
+  stream = avformat_new_stream(fmt_ctx, NULL);
+  if(stream == NULL) return false;
+
+  // stream parameters (and global headers) come from a context that has the
+  // same setup as every segment's context
+  {
+    AVCodecContext* av_ctx = nullptr;
+    if(open_codec_context(&av_ctx) == false)
+      return false;
+
+    int ret = avcodec_parameters_from_context(stream->codecpar, av_ctx);
+    avcodec_free_context(&av_ctx);
+
+    if(ret < 0) return false;
+  }
+
+  stream->start_time = 0;
+  stream->time_base = (AVRational){1, (int)FPS};
+  stream->avg_frame_rate = (AVRational){(int)FPS, 1};
+  stream->r_frame_rate = (AVRational){(int)FPS, 1};
+  stream->id = fmt_ctx->nb_streams - 1;
+
+  fmt_ctx->start_time = 0;
+
+  av_dump_format(fmt_ctx, 0, filename.c_str(), 1);
+
+  int ret = avio_open(&fmt_ctx->pb, filename.c_str(), AVIO_FLAG_WRITE);
+  if(ret < 0) return false;
+
+  ret = avformat_write_header(fmt_ctx, NULL);
+  if (ret < 0) {
+    printf("Error occurred when opening output file\n");
+    return false;
+  }
+
+  if(!pool || pool->width() != frameWidth || pool->height() != frameHeight)
+    pool = std::make_shared<AVFramePool>(frameWidth, frameHeight, AV_PIX_FMT_YUV420P);
+
+  {
+    char buffer[120];
+    snprintf(buffer, 120, "sdl-segment: %d frames per segment, %d parallel segments",
+	     SEGMENT_LENGTH, NUM_THREADS);
+    logging.info(buffer);
+  }
+
+  running = true;
+
+  return true;
+}
+
+
+bool SDLAVSegmentEncoder::insertFrame(unsigned long long frameNumber,
+				      SDL_Surface* surface)
+{
+  if(running == false) return false;
+
+  SDL_Surface* rgb = SDL_CreateRGBSurface(0, frameWidth, frameHeight, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+
+  if(rgb == NULL){
+    logging.error("sdl-segment::insertFrame failed [1]");
+    return false;
+  }
+
+  if(surface != NULL){
+    SDL_BlitSurface(surface, NULL, rgb, NULL);
+  }
+  else{ // just fills the frame with black
+    SDL_FillRect(rgb, NULL, SDL_MapRGB(rgb->format, 0, 0, 0));
+  }
+
+  AVFrame* frame = pool->acquire();
+
+  if(frame == nullptr){
+    SDL_FreeSurface(rgb);
+    error_flag = true;
+    return false;
+  }
+
+  convertRGBToYUV420(rgb, frame);
+
+  SDL_FreeSurface(rgb);
+
+  return insertFrame(frameNumber, frame);
+}
+
+
+AVFrame* SDLAVSegmentEncoder::acquireFrame()
+{
+  if(pool) return pool->acquire();
+  else return nullptr;
+}
+
+
+void SDLAVSegmentEncoder::releaseFrame(AVFrame* frame)
+{
+  if(pool && frame) pool->release(frame);
+}
+
+
+bool SDLAVSegmentEncoder::insertFrame(unsigned long long frameNumber,
+				      AVFrame* frame)
+{
+  if(frame == nullptr) return false;
+
+  if(running == false ||
+     frame->width != frameWidth || frame->height != frameHeight ||
+     frame->format != AV_PIX_FMT_YUV420P){
+    pool->release(frame);
+    return false;
+  }
+
+  frame->pts = frameNumber;
+  frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+  std::unique_lock<std::mutex> lock(segment_mutex);
+
+  SDLAVSegmentEncoder::segment* s = nullptr;
+
+  if(segments.size() > 0)
+    if(segments.back()->closed == false)
+      s = segments.back();
+
+  if(s != nullptr)
+    if(frameNumber < s->firstFrame){ // frames must come in order
+      pool->release(frame);
+      return false;
+    }
+
+  if(s == nullptr || frameNumber >= s->firstFrame + SEGMENT_LENGTH){
+    if(s != nullptr){
+      s->closed = true;
+      segment_cond.notify_all();
+    }
+
+    // limits the number of segments in flight (and memory usage):
+    // writes the oldest segments into the file once they are ready
+    while(segments.size() >= NUM_THREADS){
+      if(segments.front()->done){
+	auto first = segments.front();
+	segments.pop_front();
+
+	lock.unlock();
+	if(mux_segment(first) == false) error_flag = true;
+	lock.lock();
+      }
+      else{
+	segment_cond.wait(lock);
+      }
+    }
+
+    s = new SDLAVSegmentEncoder::segment;
+    s->firstFrame = frameNumber;
+    s->numFrames = 0;
+    s->closed = false;
+    s->done = false;
+    s->failed = false;
+
+    try{
+      s->worker = new std::thread(&SDLAVSegmentEncoder::segment_loop, this, s);
+    }
+    catch(std::exception& e){
+      delete s;
+      pool->release(frame);
+      error_flag = true;
+      return false;
+    }
+
+    segments.push_back(s);
+  }
+
+  s->frames.push_back(frame);
+  s->numFrames++;
+  segment_cond.notify_all();
+
+  return true;
+}
+
+
+bool SDLAVSegmentEncoder::stopEncoding()
+{
+  if(running == false){
+    logging.fatal("sdl-segment: not running and calling stopEncoding()");
+    return false;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(segment_mutex);
+
+    if(segments.size() > 0){
+      segments.back()->closed = true;
+      segment_cond.notify_all();
+    }
+
+    while(segments.size() > 0){
+      if(segments.front()->done){
+	auto first = segments.front();
+	segments.pop_front();
+
+	lock.unlock();
+	if(mux_segment(first) == false) error_flag = true;
+	lock.lock();
+      }
+      else{
+	segment_cond.wait(lock);
+      }
+    }
+  }
+
+  av_write_trailer(fmt_ctx);
+  avio_closep(&fmt_ctx->pb);
+  avformat_free_context(fmt_ctx);
+
+  fmt_ctx = nullptr;
+  stream = nullptr;
+
+  running = false;
+
+  return (error_flag == false);
+}
+
+
+// encodes single segment with its own codec context
+void SDLAVSegmentEncoder::segment_loop(SDLAVSegmentEncoder::segment* s)
+{
+  AVCodecContext* av_ctx = nullptr;
+  bool failed = false;
+
+  TaskScheduler::instance().joinStage(STAGE_ENCODE);
+
+  if(open_codec_context(&av_ctx) == false){
+    logging.error("sdl-segment: opening segment codec context failed");
+    failed = true;
+  }
+
+  bool first = true;
+
+  while(1){
+    AVFrame* frame = nullptr;
+
+    {
+      std::unique_lock<std::mutex> lock(segment_mutex);
+
+      while(s->frames.size() == 0 && s->closed == false)
+	segment_cond.wait(lock);
+
+      if(s->frames.size() == 0) break; // closed
+
+      frame = s->frames.front();
+      s->frames.pop_front();
+    }
+
+    const auto busyStart = std::chrono::steady_clock::now();
+
+    if(failed == false){
+      // timestamps are local to the segment: muxing adds the segment offset
+      frame->pts -= s->firstFrame;
+
+      if(first){
+	frame->pict_type = AV_PICTURE_TYPE_I;
+	first = false;
+      }
+
+      if(avcodec_send_frame(av_ctx, frame) < 0)
+	failed = true;
+    }
+
+    pool->release(frame);
+
+    while(failed == false){
+      AVPacket* pkt = av_packet_alloc();
+      int ret = avcodec_receive_packet(av_ctx, pkt);
+
+      if(ret < 0){
+	av_packet_free(&pkt);
+	if(ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) failed = true;
+	break;
+      }
+
+      s->packets.push_back(pkt);
+    }
+
+    TaskScheduler::instance().addBusyTime
+      (STAGE_ENCODE, std::chrono::duration<double, std::milli>
+       (std::chrono::steady_clock::now() - busyStart).count());
+  }
+
+  // drains the encoder
+  if(failed == false){
+    avcodec_send_frame(av_ctx, NULL);
+
+    while(1){
+      AVPacket* pkt = av_packet_alloc();
+      int ret = avcodec_receive_packet(av_ctx, pkt);
+
+      if(ret < 0){
+	av_packet_free(&pkt);
+	if(ret != AVERROR_EOF) failed = true;
+	break;
+      }
+
+      s->packets.push_back(pkt);
+    }
+  }
+
+  if(av_ctx)
+    avcodec_free_context(&av_ctx);
+
+  {
+    std::lock_guard<std::mutex> lock(segment_mutex);
+    s->failed = failed;
+    s->done = true;
+    segment_cond.notify_all();
+  }
+}
+
+
+bool SDLAVSegmentEncoder::mux_segment(SDLAVSegmentEncoder::segment* s)
+{
+  if(s->worker){
+    s->worker->join();
+    delete s->worker;
+    s->worker = nullptr;
+  }
+
+  bool ok = (s->failed == false);
+
+  for(auto& pkt : s->packets){
+    if(ok){
+      pkt->pts += s->firstFrame;
+      pkt->dts += s->firstFrame;
+      pkt->stream_index = stream->index;
+
+      av_packet_rescale_ts(pkt, (AVRational){1, (int)FPS}, stream->time_base);
+
+      if(av_interleaved_write_frame(fmt_ctx, pkt) < 0)
+	ok = false;
+    }
+
+    av_packet_free(&pkt);
+  }
+
+  s->packets.clear();
+
+  {
+    char buffer[120];
+    snprintf(buffer, 120, "sdl-segment: segment %llu..%llu written",
+	     s->firstFrame, s->firstFrame + s->numFrames);
+    logging.info(buffer);
+  }
+
+  delete s;
+
+  return ok;
+}
+
+
+}
+}
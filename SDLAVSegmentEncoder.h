@@ -0,0 +1,128 @@
+/*
+ * SDLAVSegmentEncoder.h
+ *
+ * offline (non-realtime) libavcodec video encoding which splits
+ * the timeline into closed GOP segments that are encoded in parallel
+ * each with its own codec context and then muxed into a single file
+ * without re-encoding
+ *
+ */
+
+#ifndef SDLAVSEGMENTENCODER_H_
+#define SDLAVSEGMENTENCODER_H_
+
+#include <SDL.h>
+
+extern "C" {
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/opt.h>
+
+};
+
+#include <list>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+
+#include "framepool.h"
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class SDLAVSegmentEncoder {
+    public:
+      // encoding quality between 0 and 1, segmentLength is the length of
+      // single closed GOP segment in frames (0 = one second) and
+      // numThreads is the number of segments encoded in parallel (0 = number of cores)
+      SDLAVSegmentEncoder(float q = 0.8f,
+			  unsigned int segmentLength = 0,
+			  unsigned int numThreads = 0);
+      virtual ~SDLAVSegmentEncoder();
+
+      // selects libavcodec encoder (default: "mpeg4"), call before startEncoding()
+      bool setCodec(const std::string& codec_name);
+
+      // setups encoding structure and writes file header
+      bool startEncoding(const std::string& filename, unsigned int width, unsigned int height);
+
+      // inserts frameNumber:th frame of the video (frameNumber = 0 is the first frame),
+      // frames must be inserted in increasing order. Blocks when all encoding threads
+      // are busy [nullptr means black empty frame]
+      bool insertFrame(unsigned long long frameNumber,
+		       SDL_Surface* surface = nullptr);
+
+      // returns writable YUV420P frame from the encoder's frame pool
+      AVFrame* acquireFrame();
+
+      // returns frame from acquireFrame() back to the pool without encoding it
+      void releaseFrame(AVFrame* frame);
+
+      // inserts YUV420P frame (from acquireFrame()) without copying,
+      // the encoder takes ownership of the frame
+      bool insertFrame(unsigned long long frameNumber, AVFrame* frame);
+
+      // waits for all segments to be encoded and closes the file
+      bool stopEncoding();
+
+      unsigned long long getFPS() const { return FPS; }
+
+      // error was detected during encoding
+      bool error() const { return error_flag; }
+
+    private:
+
+      struct segment {
+	unsigned long long firstFrame;
+	unsigned long long numFrames;
+
+	std::list<AVFrame*> frames;   // frames waiting for encoding
+	std::list<AVPacket*> packets; // encoded packets waiting for muxing
+
+	bool closed; // no more incoming frames
+	bool done;   // all packets have been encoded
+	bool failed;
+
+	std::thread* worker;
+      };
+
+      bool open_codec_context(AVCodecContext** ctx) const;
+
+      void segment_loop(SDLAVSegmentEncoder::segment* s);
+
+      // writes packets of finished segments (in order) into the file
+      bool mux_segment(SDLAVSegmentEncoder::segment* s);
+
+      float quality;
+
+      const long long FPS; // video frames per second
+      unsigned int SEGMENT_LENGTH;
+      unsigned int NUM_THREADS;
+
+      std::string codec_name;
+
+      int frameHeight, frameWidth;
+
+      bool running;
+      bool error_flag;
+
+      std::mutex segment_mutex;
+      std::condition_variable segment_cond;
+      std::list<SDLAVSegmentEncoder::segment*> segments; // segments in encoding order
+
+      AVFormatContext* fmt_ctx = nullptr;
+      AVStream* stream = nullptr;
+      const AVCodec* codec = nullptr;
+
+      std::shared_ptr<AVFramePool> pool;
+
+    };
+
+  }
+}
+
+#endif /* SDLAVSEGMENTENCODER_H_ */
@@ -0,0 +1,735 @@
+/*
+ * SDLAVSpool.cpp
+ *
+ */
+
+#include "SDLAVSpool.h"
+#include "SDLAVCodec.h"
+#include "yuvconvert.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+static const char* Y4M_FRAME = "FRAME\n";
+static const size_t Y4M_FRAME_BYTES = 6;
+
+
+SDLAVSpool::SDLAVSpool(unsigned int fps, double preallocateSeconds) :
+  FPS(fps > 0 ? fps : 60),
+  preallocate_seconds(preallocateSeconds > 0.0 ? preallocateSeconds : 10.0)
+{
+}
+
+
+SDLAVSpool::~SDLAVSpool()
+{
+  // spool is also left open when insertFrame() has failed
+  if(running || fd >= 0) stopEncoding();
+
+  if(frame) av_frame_free(&frame);
+  if(previous) av_frame_free(&previous);
+}
+
+
+bool SDLAVSpool::addAudioTrack(const std::string& filename,
+			       unsigned long long offsetMsecs, bool loop)
+{
+  if(running || filename.size() >= sizeof(SpoolIndexHeader::audioFile))
+    return false;
+
+  audio_filename = filename;
+  audio_offset = (long long)offsetMsecs;
+  audio_loop = loop;
+
+  return true;
+}
+
+
+bool SDLAVSpool::startEncoding(const std::string& filename,
+			       unsigned int width, unsigned int height)
+{
+#ifndef _WIN32
+  if(running) return false;
+
+  // YUV420P picture needs even size
+  width &= ~1;
+  height &= ~1;
+
+  if(width == 0 || height == 0) return false;
+
+  fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0){
+    logging.error("spool: cannot create spool file");
+    return false;
+  }
+
+  const std::string indexFile = filename + ".idx";
+  index = fopen(indexFile.c_str(), "wb");
+
+  if(index == nullptr){
+    logging.error("spool: cannot create index file");
+    close_spool();
+    return false;
+  }
+
+  this->width = width;
+  this->height = height;
+
+  char header[128];
+  snprintf(header, 128, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", width, height, FPS);
+
+  header_bytes = strlen(header);
+  frame_bytes = Y4M_FRAME_BYTES + (size_t)width*height + 2*(size_t)(width/2)*(height/2);
+  capacity = 0;
+  frames = 0;
+  latest_frame = -1;
+
+  growing = true;
+  grow_failed = false;
+  grow_target = 0;
+  allocated_bytes = 0;
+
+  try{
+    grower = new std::thread(&SDLAVSpool::grow_loop, this);
+  }
+  catch(std::exception& e){
+    growing = false;
+    grower = nullptr;
+    close_spool();
+    return false;
+  }
+
+  if(reserve((unsigned long long)(preallocate_seconds*FPS) + 1) == false){
+    close_spool();
+    return false;
+  }
+
+  memcpy(mapping, header, header_bytes);
+
+  {
+    SpoolIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "Y4MSPOOL", 8);
+    h.width = width;
+    h.height = height;
+    h.fps = FPS;
+    h.audioLoop = audio_loop ? 1 : 0;
+    h.audioOffset = (audio_filename.size() > 0) ? audio_offset : -1;
+    strncpy(h.audioFile, audio_filename.c_str(), sizeof(h.audioFile) - 1);
+
+    if(fwrite(&h, sizeof(h), 1, index) != 1){
+      logging.error("spool: writing index failed");
+      close_spool();
+      return false;
+    }
+  }
+
+  if(frame == nullptr) frame = av_frame_alloc();
+  if(previous == nullptr) previous = av_frame_alloc();
+  if(frame == nullptr || previous == nullptr){
+    close_spool();
+    return false;
+  }
+
+  dirty_bands.resize((height + 15)/16);
+  pending_damage.resize(width, height);
+  pending_damage.addAll();
+  pending_keyframe = false;
+
+  running = true;
+
+  return true;
+#else
+  logging.error("spool: memory mapped spool is not supported on this platform");
+  return false;
+#endif
+}
+
+
+bool SDLAVSpool::reserve(unsigned long long capacity)
+{
+#ifndef _WIN32
+  const size_t bytes = spool_bytes(capacity);
+
+  {
+    std::unique_lock<std::mutex> lock(grow_mutex);
+
+    if(grow_target < bytes){
+      grow_target = bytes;
+      grow_cond.notify_all();
+    }
+
+    if(allocated_bytes < bytes && grow_failed == false && mapping)
+      logging.info("spool: disk is slower than recording, waiting for allocation");
+
+    grow_cond.wait(lock, [&]() { return (allocated_bytes >= bytes || grow_failed); });
+
+    if(allocated_bytes < bytes){
+      logging.error("spool: cannot allocate spool file");
+      return false;
+    }
+  }
+
+  // blocks are already allocated: only the mapping grows
+  void* m = MAP_FAILED;
+
+#ifdef __linux__
+  if(mapping)
+    m = mremap(mapping, mapped_bytes, bytes, MREMAP_MAYMOVE);
+  else
+    m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#else
+  if(mapping) munmap(mapping, mapped_bytes);
+  m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+#endif
+
+  if(m == MAP_FAILED){
+#ifndef __linux__
+    mapping = nullptr; // unmapped above
+    mapped_bytes = 0;
+#endif
+    logging.error("spool: cannot map spool file");
+    return false;
+  }
+
+  // frames are written once in order
+  madvise(m, bytes, MADV_SEQUENTIAL);
+
+  mapping = (Uint8*)m;
+  mapped_bytes = bytes;
+  this->capacity = capacity;
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+void SDLAVSpool::request_growth(unsigned long long capacity)
+{
+  std::lock_guard<std::mutex> lock(grow_mutex);
+
+  if(grow_target < spool_bytes(capacity)){
+    grow_target = spool_bytes(capacity);
+    grow_cond.notify_all();
+  }
+}
+
+
+void SDLAVSpool::grow_loop()
+{
+#ifndef _WIN32
+  std::unique_lock<std::mutex> lock(grow_mutex);
+
+  while(growing){
+    if(grow_target <= allocated_bytes || grow_failed){
+      grow_cond.wait(lock);
+      continue;
+    }
+
+    const size_t from = allocated_bytes;
+    const size_t to = grow_target;
+
+    lock.unlock();
+
+    // blocks are allocated now instead of when frames are written
+    // (may take long: glibc emulates fallocate by writing every block).
+    // Unallocated (sparse) pages would raise SIGBUS when written through
+    // the mapping on a full disk, so every error stops the growth
+    const int error = posix_fallocate(fd, from, to - from);
+
+    lock.lock();
+
+    if(error == 0){
+      allocated_bytes = to;
+    }
+    else{
+      char buffer[128];
+      snprintf(buffer, 128, "spool: allocating spool file failed: %s", strerror(error));
+      logging.error(buffer);
+      grow_failed = true;
+    }
+
+    grow_cond.notify_all();
+  }
+#endif
+}
+
+
+void SDLAVSpool::stop_grower()
+{
+  {
+    std::lock_guard<std::mutex> lock(grow_mutex);
+    growing = false;
+    grow_cond.notify_all();
+  }
+
+  if(grower){
+    grower->join();
+    delete grower;
+  }
+
+  grower = nullptr;
+}
+
+
+void SDLAVSpool::close_spool()
+{
+#ifndef _WIN32
+  stop_grower();
+
+  if(mapping){
+    munmap(mapping, mapped_bytes);
+    mapping = nullptr;
+    mapped_bytes = 0;
+  }
+
+  if(fd >= 0){
+    ::close(fd);
+    fd = -1;
+  }
+
+  if(index){
+    fclose(index);
+    index = nullptr;
+  }
+#endif
+}
+
+
+void SDLAVSpool::map_frame(unsigned long long index, AVFrame* f)
+{
+  Uint8* p = mapping + header_bytes + index*frame_bytes + Y4M_FRAME_BYTES;
+
+  f->format = AV_PIX_FMT_YUV420P;
+  f->width = width;
+  f->height = height;
+
+  f->data[0] = p;
+  f->data[1] = p + (size_t)width*height;
+  f->data[2] = f->data[1] + (size_t)(width/2)*(height/2);
+
+  f->linesize[0] = width;
+  f->linesize[1] = width/2;
+  f->linesize[2] = width/2;
+}
+
+
+bool SDLAVSpool::insertFrame(unsigned long long msecs, SDL_Surface* surface,
+			     const DamageRegion* damage, bool keyframe)
+{
+  if(running == false || surface == nullptr) return false;
+
+  if(surface->format->BytesPerPixel != 4 ||
+     surface->w < (int)width || surface->h < (int)height){
+    logging.error("spool: surface is not 32bit picture of the spool's size");
+    return false;
+  }
+
+  // changes of skipped frames are stored with the next frame
+  if(damage && frames > 0) pending_damage.add(*damage);
+  else pending_damage.addAll();
+
+  pending_keyframe = pending_keyframe || keyframe;
+
+  const long long fn = (long long)((msecs*FPS)/1000);
+  if(fn <= latest_frame) return true; // frame time already stored
+
+  const unsigned long long chunk = (unsigned long long)(preallocate_seconds*FPS) + 1;
+
+  if(frames >= capacity){
+    if(reserve(capacity + chunk) == false){
+      running = false;
+      return false;
+    }
+  }
+
+  // the next chunk is allocated in the background while half of this is left
+  if(capacity - frames <= chunk/2)
+    request_growth(capacity + chunk);
+
+  memcpy(mapping + header_bytes + frames*frame_bytes, Y4M_FRAME, Y4M_FRAME_BYTES);
+  map_frame(frames, frame);
+
+  std::fill(dirty_bands.begin(), dirty_bands.end(), false);
+
+  for(const auto& r : pending_damage.rects()){
+    for(int b=r.y/16;b<=(r.y + r.h - 1)/16 && b<(int)dirty_bands.size();b++)
+      if(b >= 0) dirty_bands[b] = true;
+  }
+
+  if(frames > 0) map_frame(frames - 1, previous);
+
+  // runs of bands: converted from the surface or copied from the previous frame
+  for(unsigned int b=0;b<dirty_bands.size();){
+    const bool convert = (frames == 0 || dirty_bands[b]);
+    unsigned int e = b + 1;
+
+    while(e < dirty_bands.size() && (frames == 0 || dirty_bands[e]) == convert)
+      e++;
+
+    const int y0 = b*16;
+    const int y1 = ((int)e*16 < (int)height) ? (int)e*16 : (int)height;
+
+    if(convert){
+      convertRGBToYUV420(surface, frame, y0, y1);
+    }
+    else{
+      memcpy(frame->data[0] + (size_t)y0*width, previous->data[0] + (size_t)y0*width,
+	     (size_t)(y1 - y0)*width);
+
+      for(unsigned int p=1;p<3;p++)
+	memcpy(frame->data[p] + (size_t)(y0/2)*(width/2),
+	       previous->data[p] + (size_t)(y0/2)*(width/2),
+	       (size_t)((y1 - y0)/2)*(width/2));
+    }
+
+    b = e;
+  }
+
+  SpoolIndexEntry entry;
+  entry.msecs = msecs;
+  entry.flags = pending_keyframe ? SPOOL_KEYFRAME : 0;
+  entry.reserved = 0;
+
+  if(fwrite(&entry, sizeof(entry), 1, index) != 1){
+    logging.error("spool: writing index failed");
+    running = false;
+    return false;
+  }
+
+  frames++;
+  latest_frame = fn;
+  pending_damage.clear();
+  pending_keyframe = false;
+
+  return true;
+}
+
+
+bool SDLAVSpool::stopEncoding()
+{
+#ifndef _WIN32
+  if(running == false && fd < 0) return false;
+
+  running = false;
+  bool ok = true;
+
+  stop_grower();
+
+  if(mapping){
+    munmap(mapping, mapped_bytes);
+    mapping = nullptr;
+    mapped_bytes = 0;
+  }
+
+  // unused preallocated frames are removed: the file is a valid Y4M stream
+  if(ftruncate(fd, header_bytes + frames*frame_bytes) != 0){
+    logging.error("spool: truncating spool file failed");
+    ok = false;
+  }
+
+  ::close(fd);
+  fd = -1;
+
+  if(index){
+    if(fclose(index) != 0) ok = false;
+    index = nullptr;
+  }
+
+  return ok;
+#else
+  return false;
+#endif
+}
+
+
+SDLAVSpoolReader::SDLAVSpoolReader()
+{
+  mapping = nullptr;
+  mapped_bytes = 0;
+  width = 0;
+  height = 0;
+  fps = 0;
+  header_bytes = 0;
+  frame_bytes = 0;
+  frames = 0;
+  has_index = false;
+  memset(&header, 0, sizeof(header));
+}
+
+
+SDLAVSpoolReader::~SDLAVSpoolReader()
+{
+  close();
+}
+
+
+bool SDLAVSpoolReader::open(const std::string& filename)
+{
+#ifndef _WIN32
+  close();
+
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0){
+    logging.error("spool: cannot open spool file");
+    return false;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || st.st_size == 0){
+    ::close(fd);
+    return false;
+  }
+
+  void* m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if(m == MAP_FAILED){
+    logging.error("spool: cannot map spool file");
+    return false;
+  }
+
+  mapping = (const Uint8*)m;
+  mapped_bytes = st.st_size;
+
+  // stream header: "YUV4MPEG2 W<width> H<height> F<num>:<den> ..."
+  const Uint8* end = (const Uint8*)memchr(mapping, '\n', mapped_bytes < 256 ? mapped_bytes : 256);
+
+  if(end == nullptr || memcmp(mapping, "YUV4MPEG2 ", 10) != 0){
+    logging.error("spool: not a Y4M file");
+    close();
+    return false;
+  }
+
+  header_bytes = end - mapping + 1;
+
+  std::string line((const char*)mapping, header_bytes - 1);
+  unsigned int num = 0, den = 1;
+  bool yuv420 = true;
+
+  for(size_t p = 0; p < line.size();){
+    size_t q = line.find(' ', p);
+    if(q == std::string::npos) q = line.size();
+
+    const std::string token = line.substr(p, q - p);
+
+    if(token.size() > 1){
+      if(token[0] == 'W') width = (unsigned int)atoi(token.c_str() + 1);
+      else if(token[0] == 'H') height = (unsigned int)atoi(token.c_str() + 1);
+      else if(token[0] == 'F') sscanf(token.c_str() + 1, "%u:%u", &num, &den);
+      else if(token[0] == 'C') yuv420 = (token.compare(1, 3, "420") == 0);
+    }
+
+    p = q + 1;
+  }
+
+  if(width == 0 || height == 0 || (width & 1) || (height & 1) || yuv420 == false ||
+     num == 0 || den == 0){
+    logging.error("spool: only even sized 4:2:0 Y4M spools are supported");
+    close();
+    return false;
+  }
+
+  fps = (num + den/2)/den;
+  if(fps == 0) fps = 1;
+
+  frame_bytes = Y4M_FRAME_BYTES + (size_t)width*height + 2*(size_t)(width/2)*(height/2);
+  frames = (mapped_bytes - header_bytes)/frame_bytes;
+
+  if(frames > 0 && memcmp(mapping + header_bytes, Y4M_FRAME, Y4M_FRAME_BYTES) != 0){
+    logging.error("spool: Y4M frame parameters are not supported");
+    close();
+    return false;
+  }
+
+  // index is optional: frames are then evenly timed
+  FILE* idx = fopen((filename + ".idx").c_str(), "rb");
+
+  if(idx){
+    if(fread(&header, sizeof(header), 1, idx) == 1 &&
+       memcmp(header.magic, "Y4MSPOOL", 8) == 0 &&
+       header.width == width && header.height == height){
+      header.audioFile[sizeof(header.audioFile) - 1] = 0;
+
+      SpoolIndexEntry e;
+      while(entries.size() < frames && fread(&e, sizeof(e), 1, idx) == 1)
+	entries.push_back(e);
+
+      has_index = true;
+    }
+    else{
+      logging.error("spool: index does not match the spool, ignored");
+    }
+
+    fclose(idx);
+  }
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+void SDLAVSpoolReader::close()
+{
+#ifndef _WIN32
+  if(mapping) munmap((void*)mapping, mapped_bytes);
+#endif
+
+  mapping = nullptr;
+  mapped_bytes = 0;
+  frames = 0;
+  entries.clear();
+  has_index = false;
+}
+
+
+unsigned long long SDLAVSpoolReader::getMsecs(unsigned long long frame) const
+{
+  if(frame < entries.size()) return entries[frame].msecs;
+
+  // frames after the index (recording was interrupted) continue evenly
+  if(entries.size() > 0)
+    return entries.back().msecs + ((frame - entries.size() + 1)*1000)/fps;
+  else
+    return (frame*1000)/fps;
+}
+
+
+bool SDLAVSpoolReader::isKeyframe(unsigned long long frame) const
+{
+  if(frame < entries.size()) return (entries[frame].flags & SPOOL_KEYFRAME) != 0;
+  return false;
+}
+
+
+unsigned long long SDLAVSpoolReader::findFrame(unsigned long long msecs) const
+{
+  if(frames == 0) return 0;
+
+  // frame times are increasing
+  unsigned long long a = 0, b = frames - 1;
+
+  while(a < b){
+    const unsigned long long m = (a + b + 1)/2;
+    if(getMsecs(m) <= msecs) a = m;
+    else b = m - 1;
+  }
+
+  return a;
+}
+
+
+bool SDLAVSpoolReader::copyFrame(unsigned long long frame, AVFrame* dst) const
+{
+  if(frame >= frames || dst == nullptr ||
+     dst->width != (int)width || dst->height != (int)height ||
+     dst->format != AV_PIX_FMT_YUV420P)
+    return false;
+
+  const Uint8* p = mapping + header_bytes + frame*frame_bytes + Y4M_FRAME_BYTES;
+
+  for(unsigned int plane=0;plane<3;plane++){
+    const unsigned int w = plane ? width/2 : width;
+    const unsigned int h = plane ? height/2 : height;
+
+    for(unsigned int y=0;y<h;y++)
+      memcpy(dst->data[plane] + y*dst->linesize[plane], p + (size_t)y*w, w);
+
+    p += (size_t)w*h;
+  }
+
+  return true;
+}
+
+
+bool SDLAVSpoolReader::getAudioTrack(std::string& filename, unsigned long long& offsetMsecs,
+				     bool& loop) const
+{
+  if(has_index == false || header.audioOffset < 0 || header.audioFile[0] == 0)
+    return false;
+
+  filename = header.audioFile;
+  offsetMsecs = (unsigned long long)header.audioOffset;
+  loop = (header.audioLoop != 0);
+
+  return true;
+}
+
+
+bool transcodeSpool(const std::string& spoolFile, const std::string& filename,
+		    float quality)
+{
+  SDLAVSpoolReader spool;
+  if(spool.open(spoolFile) == false) return false;
+
+  if(spool.getFrames() == 0){
+    logging.error("spool: no frames to transcode");
+    return false;
+  }
+
+  SDLAVCodec* codec = new SDLAVCodec(quality);
+  codec->setAdaptiveSpeed(false); // offline: no need to keep up with real time
+
+  {
+    std::string audio;
+    unsigned long long offset = 0;
+    bool loop = true;
+
+    if(spool.getAudioTrack(audio, offset, loop))
+      codec->addAudioTrack(audio, offset, loop);
+  }
+
+  if(codec->startEncoding(filename, spool.getWidth(), spool.getHeight()) == false){
+    delete codec;
+    return false;
+  }
+
+  bool ok = true;
+  const unsigned long long last = spool.getFrames() - 1;
+
+  for(unsigned long long i=0;i<=last && ok;i++){
+    AVFrame* f = codec->acquireFrame();
+
+    if(f == nullptr || spool.copyFrame(i, f) == false){
+      logging.error("spool: reading frame failed");
+      ok = false;
+      break;
+    }
+
+    // the last frame ends the video, frames of the same encoder frame are skipped
+    if(i == last)
+      ok = codec->stopEncoding(spool.getMsecs(i), f);
+    else if(codec->insertFrame(spool.getMsecs(i), f, spool.isKeyframe(i)) == false)
+      ok = (codec->error() == false);
+  }
+
+  if(ok == false && codec->error())
+    logging.error("spool: encoding failed");
+
+  delete codec;
+
+  return ok;
+}
+
+
+}
+}
@@ -0,0 +1,191 @@
+/*
+ * SDLAVSpool.h
+ *
+ * fast capture of live frames for compressing them later: frames are
+ * converted to raw YUV420P into a preallocated, memory mapped Y4M spool
+ * file (no encoding, unchanged rows are copied from the previous frame)
+ * and their times and scene cut hints are written into an index file
+ * (spool + ".idx"). SDLAVSpoolReader gives random access to the frames
+ * and transcodeSpool() encodes the spool with SDLAVCodec afterwards
+ *
+ */
+
+#ifndef SDLAVSPOOL_H_
+#define SDLAVSPOOL_H_
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdint.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+};
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "damage.h"
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    // index file: header followed by one entry per frame in the spool
+    struct SpoolIndexHeader {
+      char magic[8];          // "Y4MSPOOL"
+      uint32_t width, height;
+      uint32_t fps;
+      uint32_t audioLoop;
+      int64_t audioOffset;    // msecs of the video where audio starts (-1 = no audio)
+      char audioFile[256];
+    };
+
+    struct SpoolIndexEntry {
+      uint64_t msecs;         // since the start of the recording
+      uint32_t flags;         // SPOOL_KEYFRAME
+      uint32_t reserved;
+    };
+
+    const uint32_t SPOOL_KEYFRAME = 1; // scene cut hint
+
+
+    class SDLAVSpool {
+    public:
+      // frames are stored at fps frames per second, preallocateSeconds of
+      // frames are allocated at once when the spool is started and later
+      // in the background when half of the allocated frames have been used
+      SDLAVSpool(unsigned int fps = 60, double preallocateSeconds = 10.0);
+      virtual ~SDLAVSpool();
+
+      // soundtrack for the transcoded video (stored into index, call before startEncoding())
+      bool addAudioTrack(const std::string& filename,
+			 unsigned long long offsetMsecs = 0, bool loop = true);
+
+      bool startEncoding(const std::string& filename, unsigned int width, unsigned int height);
+
+      // stores SDL_Surface (32bit 0x00RRGGBB) picture at msecs (frames of the
+      // same frame time are skipped), only rows touched by damage are converted
+      bool insertFrame(unsigned long long msecs, SDL_Surface* surface,
+		       const DamageRegion* damage = nullptr, bool keyframe = false);
+
+      // truncates the spool to the stored frames and closes the files
+      bool stopEncoding();
+
+      unsigned long long getFrames() const { return frames; }
+
+      unsigned int getFPS() const { return FPS; }
+
+    private:
+      // maps frames [0, capacity) of the spool file, waits for the
+      // background allocation only if it has not kept up
+      bool reserve(unsigned long long capacity);
+
+      // asks the grower thread to allocate the file up to capacity frames
+      void request_growth(unsigned long long capacity);
+
+      // allocates spool file blocks in the background (grow_target)
+      void grow_loop();
+      void stop_grower();
+
+      // unmaps and closes the spool and index files (failed start)
+      void close_spool();
+
+      size_t spool_bytes(unsigned long long capacity) const {
+	return header_bytes + capacity*frame_bytes;
+      }
+
+      // points frame's planes to spool frame index
+      void map_frame(unsigned long long index, AVFrame* f);
+
+      const unsigned int FPS;
+      const double preallocate_seconds;
+
+      std::string audio_filename;
+      long long audio_offset = -1;
+      bool audio_loop = true;
+
+      bool running = false;
+
+      int fd = -1;
+      FILE* index = nullptr;
+      Uint8* mapping = nullptr;
+      size_t mapped_bytes = 0;
+
+      unsigned int width = 0, height = 0;
+      size_t header_bytes = 0;   // Y4M stream header
+      size_t frame_bytes = 0;    // "FRAME\n" and planes
+      unsigned long long capacity = 0;
+      unsigned long long frames = 0;
+      long long latest_frame = -1;
+
+      AVFrame* frame = nullptr;     // planes in the spool (not owned)
+      AVFrame* previous = nullptr;
+      std::vector<bool> dirty_bands; // 16 row bands converted again
+      DamageRegion pending_damage;   // changes since the previous stored frame
+      bool pending_keyframe = false;
+
+      std::thread* grower = nullptr;
+      std::mutex grow_mutex;
+      std::condition_variable grow_cond;
+      bool growing = false;       // grower thread keeps running
+      bool grow_failed = false;
+      size_t grow_target = 0;     // bytes requested from the grower thread
+      size_t allocated_bytes = 0; // bytes allocated in the spool file
+    };
+
+
+    class SDLAVSpoolReader {
+    public:
+      SDLAVSpoolReader();
+      virtual ~SDLAVSpoolReader();
+
+      // maps Y4M spool (4:2:0) read only and loads its index,
+      // without index frames are timed by the frame rate
+      bool open(const std::string& filename);
+      void close();
+
+      unsigned long long getFrames() const { return frames; }
+      unsigned int getWidth() const { return width; }
+      unsigned int getHeight() const { return height; }
+      unsigned int getFPS() const { return fps; }
+
+      unsigned long long getMsecs(unsigned long long frame) const;
+      bool isKeyframe(unsigned long long frame) const;
+
+      // the latest frame at or before msecs (random access)
+      unsigned long long findFrame(unsigned long long msecs) const;
+
+      // copies frame's planes into writable YUV420P frame of the same size
+      bool copyFrame(unsigned long long frame, AVFrame* dst) const;
+
+      // soundtrack recorded into the index (false if there is none)
+      bool getAudioTrack(std::string& filename, unsigned long long& offsetMsecs,
+			 bool& loop) const;
+
+    private:
+      const Uint8* mapping;
+      size_t mapped_bytes;
+
+      unsigned int width, height, fps;
+      size_t header_bytes, frame_bytes;
+      unsigned long long frames;
+
+      std::vector<SpoolIndexEntry> entries;
+      SpoolIndexHeader header;
+      bool has_index;
+    };
+
+
+    // encodes spool with SDLAVCodec into filename at given quality, 1.0 uses
+    // the slowest and best encoder settings (frame times, scene cuts and
+    // soundtrack from the index)
+    bool transcodeSpool(const std::string& spoolFile, const std::string& filename,
+			float quality = 1.0f);
+
+  }
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ * SDLPresenter.cpp
+ *
+ */
+
+#include "SDLPresenter.h"
+#include <string.h>
+#include <stdint.h>
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+// framebuffer rows start at cache line (and SIMD) boundaries
+static const unsigned int FRAMEBUFFER_ALIGNMENT = 64;
+
+
+SDLPresenter::SDLPresenter()
+{
+  renderer = NULL;
+  texture = NULL;
+  framebuffer = NULL;
+  software = false;
+}
+
+
+SDLPresenter::~SDLPresenter()
+{
+  close();
+}
+
+
+bool SDLPresenter::open(SDL_Window* window, bool vsync)
+{
+  close();
+
+  if(window == NULL) return false;
+
+  int width = 0, height = 0;
+  SDL_GetWindowSize(window, &width, &height);
+
+  if(width <= 0 || height <= 0) return false;
+
+  const Uint32 sync = vsync ? SDL_RENDERER_PRESENTVSYNC : 0;
+
+  software = false;
+  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | sync);
+
+  if(renderer == NULL){
+    software = true;
+    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE | sync);
+  }
+
+  if(renderer == NULL){
+    logging.error("sdl-presenter: cannot create renderer");
+    return false;
+  }
+
+  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888,
+			      SDL_TEXTUREACCESS_STREAMING, width, height);
+
+  if(texture == NULL){
+    logging.error("sdl-presenter: cannot create streaming texture");
+    close();
+    return false;
+  }
+
+  const int pitch = (4*width + FRAMEBUFFER_ALIGNMENT - 1) & ~(FRAMEBUFFER_ALIGNMENT - 1);
+
+  buffer.resize(pitch*height + FRAMEBUFFER_ALIGNMENT);
+
+  Uint8* pixels = (Uint8*)
+    (((uintptr_t)buffer.data() + FRAMEBUFFER_ALIGNMENT - 1) & ~(uintptr_t)(FRAMEBUFFER_ALIGNMENT - 1));
+
+  framebuffer = SDL_CreateRGBSurfaceFrom(pixels, width, height, 32, pitch,
+					 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+
+  if(framebuffer == NULL){
+    close();
+    return false;
+  }
+
+  SDL_FillRect(framebuffer, NULL, 0x00000000);
+
+  if(software) logging.info("sdl-presenter: using software renderer");
+
+  return true;
+}
+
+
+void SDLPresenter::close()
+{
+  if(framebuffer) SDL_FreeSurface(framebuffer);
+  if(texture) SDL_DestroyTexture(texture);
+  if(renderer) SDL_DestroyRenderer(renderer);
+
+  framebuffer = NULL;
+  texture = NULL;
+  renderer = NULL;
+
+  buffer.clear();
+}
+
+
+bool SDLPresenter::present(const DamageRegion* damage)
+{
+  if(renderer == NULL) return false;
+
+  if(damage){
+    for(const auto& r : damage->rects())
+      if(upload(r) == false) return false;
+  }
+  else{
+    if(upload(SDL_Rect{ 0, 0, framebuffer->w, framebuffer->h }) == false)
+      return false;
+  }
+
+  // renderer's back buffer is undefined after presenting: whole texture is drawn
+  if(SDL_RenderCopy(renderer, texture, NULL, NULL) != 0)
+    return false;
+
+  SDL_RenderPresent(renderer);
+
+  return true;
+}
+
+
+bool SDLPresenter::upload(const SDL_Rect& rect)
+{
+  if(rect.w <= 0 || rect.h <= 0) return true;
+
+  void* pixels = NULL;
+  int pitch = 0;
+
+  // locked area is write only: every pixel of the rectangle is written
+  if(SDL_LockTexture(texture, &rect, &pixels, &pitch) != 0)
+    return false;
+
+  const Uint8* source = (const Uint8*)framebuffer->pixels +
+    rect.y*framebuffer->pitch + 4*rect.x;
+
+  for(int y=0;y<rect.h;y++)
+    memcpy((Uint8*)pixels + y*pitch, source + y*framebuffer->pitch, 4*rect.w);
+
+  SDL_UnlockTexture(texture);
+
+  return true;
+}
+
+
+}
+}
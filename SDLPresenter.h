@@ -0,0 +1,56 @@
+/*
+ * SDLPresenter.h
+ *
+ * presents frames drawn into our own framebuffer surface through a
+ * streaming texture (SDL_LockTexture()), only damaged areas are uploaded.
+ * Works with the software renderer when no GPU renderer is available.
+ * The framebuffer is 32bit 0x00RRGGBB with 64 byte aligned rows so it can
+ * be given directly to SDLAVCodec::insertFrame()
+ *
+ */
+
+#ifndef SDLPRESENTER_H_
+#define SDLPRESENTER_H_
+
+#include <SDL.h>
+#include <vector>
+
+#include "damage.h"
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class SDLPresenter {
+    public:
+      SDLPresenter();
+      virtual ~SDLPresenter();
+
+      // creates renderer, texture and framebuffer of the window's size
+      bool open(SDL_Window* window, bool vsync = false);
+      void close();
+
+      // surface the frame is drawn into (owned by presenter)
+      SDL_Surface* getFramebuffer() const { return framebuffer; }
+
+      // uploads damaged area (whole framebuffer if damage is null)
+      // into texture and shows it in the window
+      bool present(const DamageRegion* damage = nullptr);
+
+      bool isSoftware() const { return software; }
+
+    private:
+      bool upload(const SDL_Rect& rect);
+
+      SDL_Renderer* renderer;
+      SDL_Texture* texture;
+      SDL_Surface* framebuffer;
+
+      std::vector<Uint8> buffer; // framebuffer pixels (unaligned allocation)
+      bool software;
+    };
+
+  }
+}
+
+#endif
@@ -1,11 +1,15 @@
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
-#include <dinrhiw.h>
-
 #include <string>
 #include <chrono>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 
 #define USESDL
@@ -21,103 +25,60 @@ extern "C" {
 
 
 #include "hermitecurve.h"
+#include "fastmath.h"
 #include "SDLAVCodec.h"
+#include "SDLAVSegmentEncoder.h"
+#include "SDLAVLadder.h"
+#include "SDLAVEncoderProcess.h"
+#include "SDLAVSpool.h"
+#include "SDLPresenter.h"
+#include "timeline.h"
+#include "startup.h"
+#include "scheduler.h"
+#include "damage.h"
+#include "renderscale.h"
+#include "yuvraster.h"
+#include "rgbraster.h"
+#include "geometrycache.h"
+#include "arena.h"
 
 
 
-Uint32 getpixel(SDL_Surface *surface, int x, int y)
-{
-  int bpp = surface->format->BytesPerPixel;
-  /* Here p is the address to the pixel we want to retrieve */
-  Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
-  
-  return *(Uint32 *)p;
-}
+using namespace whiteice;
+using namespace whiteice::resonanz;
 
 
-void setpixel(SDL_Surface *surface, int x, int y, Uint32 data)
-{
-  int bpp = surface->format->BytesPerPixel;
-  /* Here p is the address to the pixel we want to retrieve */
-  Uint8 *p = (Uint8 *)surface->pixels + y * surface->pitch + x * bpp;
-  
-  *(Uint32 *)p = data;
-}
 
+// computes blob's projected closed curve on width x height screen and its fill colour,
+// the blob moves between random control points generated from seed. There is no state
+// carried between frames: any tick can be computed directly (frames in parallel).
+// Curve is sampled until it is within tolerance pixels (at most maxSamples samples)
+bool blobGeometry(const unsigned long long tick,
+		  const double phase1, const double phase2, const double phase3,
+		  const uint64_t seed,
+		  const unsigned int TICKSPERCURVE,
+		  const float tolerance, const unsigned int maxSamples,
+		  const unsigned int SCREEN_WIDTH, const unsigned int SCREEN_HEIGHT,
+		  std::vector<SDL_Point>& polyline,
+		  SDL_Color& color);
 
 
+// bounding box of polyline with one pixel border, clipped to screen
+SDL_Rect polylineBounds(const std::vector<SDL_Point>& polyline,
+			const int width, const int height);
 
-void getRgbPixels(SDL_Surface* s, int x, int y, Uint8& r, Uint8&g, Uint8& b){
-  Uint32 data = getpixel(s, x, y);
-  SDL_GetRGB(data, s->format, &r, &g, &b);
-}
 
 
-void setRgbPixels(SDL_Surface* s, int x, int y, Uint8 r, Uint8 g, Uint8 b){
-  Uint32 data = ((Uint32)r) + (((Uint32)g)<<8) + (((Uint32)b)<<16) + 0x00000000; // 0%/50%/100% alpha mode.. 
-  setpixel(s, x, y, data);
-}
 
-  
-void floodfill(const int x, const int y,
-	       SDL_Surface* s, const Uint8 r, const Uint8 g, const Uint8 b)
+int main(int argc, char** argv)
 {
-  Uint8 rg,gg,bg;
-
-  std::vector< std::pair<int, int> > coords; 
+  // this program started again as the encoder of --separate-encoder
+  if(SDLAVEncoderProcess::isEncoderProcess(argc, argv))
+    return SDLAVEncoderProcess::encoderProcessMain(argc, argv);
   
-  coords.push_back(std::pair<int,int>(x,y));
-
-  while(coords.size() > 0){
-    auto iter = coords.end();
-    iter--;
-
-    const int x = iter->first;
-    const int y = iter->second;
-
-    coords.erase(iter);
-
-    if (x<0 || y<0 || x>=s->w || y>=s->h ){
-      continue;
-    }
-
-    getRgbPixels(s,x,y,rg,gg,bg);
-    
-    if (rg==0xFF && gg== 0xFF && bg== 0xFF) continue;
-    if (rg==r && gg== g && bg== b) continue;
-    
-    setRgbPixels(s,x,y,r,g,b);
-
-    coords.push_back(std::pair<int,int>(x+1,y));
-    coords.push_back(std::pair<int,int>(x-1,y));
-    coords.push_back(std::pair<int,int>(x,y+1));
-    coords.push_back(std::pair<int,int>(x,y-1));
-  }
+  // initialization runs in parallel tasks, also measures time to the first frame
+  whiteice::resonanz::StartupTasks startup;
   
-}
-
-
-
-
-
-using namespace whiteice;
-using namespace whiteice::resonanz;
-
-
-
-bool renderPlot(const unsigned long long tick,
-		const double phase1, const double phase2, const double phase3,
-		double& curveParameter,
-		unsigned long long& latestTickCurveDrawn,
-		const double TICKSPERCURVE,
-		std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > >& startPoint,
-		std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > >& endPoint,
-		SDL_Surface* surface);
-
-
-
-int main(int argc, char** argv)
-{
   srand(time(0));
   
   printf("Charm [64KB intro] by Sensar Studios\n");
@@ -126,11 +87,168 @@ int main(int argc, char** argv)
   const std::string windowTitle = "Charm [64KB]";
   const std::string audiofile = "charm.mp3";
   const std::string fontname = "Vera.ttf";
+
+  // --offline <seconds> [filename.mp4] renders video file frame by frame
+  // --render-scale <0.5-1.0> fixes the internal resolution of blob layers
+  // --target-fps <fps> frame rate kept by adjusting the render scale
+  // --no-window renders offline video directly into YUV frames without window
+  // --queue-policy <block|drop-newest|drop-oldest|coalesce> when recorder falls behind
+  // --queue-mb <MB> memory budget of frames waiting for the recorder
+  // --play [filename.mp4] plays prerendered video instead of rendering live
+  // --bake <filename> <frames> writes blob geometry of frames into file
+  // --replay <filename> draws blobs from baked geometry file
+  // --ladder records also 720p and 360p previews of the live recording
+  // --stream <udp://host:port|fifo|-> sends live MPEG-TS stream instead of recording
+  // --vsync synchronizes presenting frames to display refresh
+  // --render-threads <N> cores for rendering and conversions (default: rest)
+  // --encode-threads <N> cores for encoder threads (default: third of cores)
+  // --pin-threads pins render and encode threads to their own cores
+  // --blobs <N> number of blobs in the effect (default: 3)
+  // --curve-tolerance <pixels> maximum distance of drawn blob outline from the curve
+  // --curve-samples <N> maximum number of samples per blob outline
+  // --separate-encoder records in a separate encoder process (restarted if it crashes)
+  // --spool <filename.y4m> records raw YUV spool (and index) for transcoding later
+  // --transcode <spool.y4m> [filename.mp4] encodes recorded spool at full quality
+  // --check-allocs fails if live frames after warm-up allocate heap memory when rendering
+  // --fixed-encoder-speed keeps encoder preset and quantizer when recorder falls behind
+  double offlineSeconds = 0.0;
+  std::string offlineFile = "intro.mp4";
+  double renderScale = 0.0; // automatic
+  double targetFPS = 60.0;
+  bool noWindow = false;
+  SDLAVCodec::QueuePolicy queuePolicy = SDLAVCodec::QUEUE_BLOCK;
+  unsigned long long queueBytes = 0; // default
+  std::string playFile = "";
+  std::string bakeFile = "", replayFile = "";
+  unsigned long long bakeFrames = 0;
+  bool abrLadder = false;
+  std::string streamURL = "";
+  bool vsync = false;
+  unsigned int renderThreads = 0, encodeThreads = 0; // automatic
+  bool pinThreads = false;
+  unsigned int numBlobs = 3;
+  float curveTolerance = 0.5f;
+  unsigned int curveSamples = 400;
+  bool checkAllocs = false;
+  bool separateEncoder = false;
+  bool adaptiveSpeed = true;
+  std::string spoolFile = "";
+  std::string transcodeFile = "", transcodeOutput = "intro.mp4";
+
+  for(int i=1;i<argc;i++){
+    if(strcmp(argv[i], "--offline") == 0 && i+1 < argc){
+      offlineSeconds = atof(argv[++i]);
+      
+      if(i+1 < argc && argv[i+1][0] != '-')
+	offlineFile = argv[++i];
+    }
+    else if(strcmp(argv[i], "--render-scale") == 0 && i+1 < argc){
+      renderScale = atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--target-fps") == 0 && i+1 < argc){
+      targetFPS = atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--no-window") == 0){
+      noWindow = true;
+    }
+    else if(strcmp(argv[i], "--queue-policy") == 0 && i+1 < argc){
+      i++;
+      if(strcmp(argv[i], "block") == 0) queuePolicy = SDLAVCodec::QUEUE_BLOCK;
+      else if(strcmp(argv[i], "drop-newest") == 0) queuePolicy = SDLAVCodec::QUEUE_DROP_NEWEST;
+      else if(strcmp(argv[i], "drop-oldest") == 0) queuePolicy = SDLAVCodec::QUEUE_DROP_OLDEST_NONKEY;
+      else if(strcmp(argv[i], "coalesce") == 0) queuePolicy = SDLAVCodec::QUEUE_COALESCE;
+      else printf("unknown queue policy: %s\n", argv[i]);
+    }
+    else if(strcmp(argv[i], "--queue-mb") == 0 && i+1 < argc){
+      queueBytes = (unsigned long long)(atof(argv[++i])*1024.0*1024.0);
+    }
+    else if(strcmp(argv[i], "--bake") == 0 && i+2 < argc){
+      bakeFile = argv[++i];
+      bakeFrames = (unsigned long long)atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--replay") == 0 && i+1 < argc){
+      replayFile = argv[++i];
+    }
+    else if(strcmp(argv[i], "--stream") == 0 && i+1 < argc){
+      streamURL = argv[++i];
+    }
+    else if(strcmp(argv[i], "--vsync") == 0){
+      vsync = true;
+    }
+    else if(strcmp(argv[i], "--render-threads") == 0 && i+1 < argc){
+      renderThreads = (unsigned int)atoi(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--encode-threads") == 0 && i+1 < argc){
+      encodeThreads = (unsigned int)atoi(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--pin-threads") == 0){
+      pinThreads = true;
+    }
+    else if(strcmp(argv[i], "--blobs") == 0 && i+1 < argc){
+      numBlobs = (unsigned int)atoi(argv[++i]);
+      if(numBlobs == 0) numBlobs = 1;
+    }
+    else if(strcmp(argv[i], "--curve-tolerance") == 0 && i+1 < argc){
+      curveTolerance = (float)atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--curve-samples") == 0 && i+1 < argc){
+      curveSamples = (unsigned int)atoi(argv[++i]);
+      if(curveSamples < 3) curveSamples = 3;
+    }
+    else if(strcmp(argv[i], "--separate-encoder") == 0){
+      separateEncoder = true;
+    }
+    else if(strcmp(argv[i], "--spool") == 0 && i+1 < argc){
+      spoolFile = argv[++i];
+    }
+    else if(strcmp(argv[i], "--transcode") == 0 && i+1 < argc){
+      transcodeFile = argv[++i];
+      
+      if(i+1 < argc && argv[i+1][0] != '-')
+	transcodeOutput = argv[++i];
+    }
+    else if(strcmp(argv[i], "--check-allocs") == 0){
+      checkAllocs = true;
+    }
+    else if(strcmp(argv[i], "--fixed-encoder-speed") == 0){
+      adaptiveSpeed = false;
+    }
+    else if(strcmp(argv[i], "--ladder") == 0){
+      abrLadder = true;
+    }
+    else if(strcmp(argv[i], "--play") == 0){
+      playFile = "intro.mp4";
+      
+      if(i+1 < argc && argv[i+1][0] != '-')
+	playFile = argv[++i];
+    }
+  }
+
+  // render, conversion and encoder threads share the cores without oversubscribing
+  TaskScheduler::instance().configure(renderThreads, encodeThreads, pinThreads);
+  TaskScheduler::instance().joinStage(STAGE_RENDER);
+
+  // compression of the live recording's spool (no window or rendering)
+  if(transcodeFile.size() > 0){
+    if(transcodeSpool(transcodeFile, transcodeOutput) == false){
+      printf("Transcoding %s FAILED.\n", transcodeFile.c_str());
+      return -1;
+    }
+
+    return 0;
+  }
+
+  // nothing to present: frames are rasterized directly into encoder's YUV frames
+  const bool yuvMode = (noWindow && offlineSeconds > 0.0);
+
+  // no window or audio is needed
+  const bool headless = (yuvMode || bakeFile.size() > 0);
   
 
 #ifdef USESDL
   
   SDL_Window* window = NULL;
+  SDLPresenter presenter; // frames are drawn into its framebuffer
 
   SDL_Init(0);
   
@@ -142,29 +260,40 @@ int main(int argc, char** argv)
     return -1;;
   }
   
-  if(SDL_InitSubSystem(SDL_INIT_VIDEO) != 0){
+  // video and audio are not needed when rendering without window
+  if(SDL_InitSubSystem(SDL_INIT_VIDEO) != 0 && headless == false){
     return -1;
   }
 
-  if(SDL_InitSubSystem(SDL_INIT_AUDIO) != 0){
-    return -1;
-  }
-  
-  if(TTF_Init() != 0){
+  if(SDL_InitSubSystem(SDL_INIT_AUDIO) != 0 && headless == false){
     return -1;
   }
 
-  if(Mix_Init(MIX_INIT_MP3) != MIX_INIT_MP3){
-    return -1;
-  }
+  // font, audio device and music are set up in background while the
+  // window is created, the first frame waits only for the font
+  const int ttfTask = startup.addTask("ttf", [](){ return (TTF_Init() == 0); });
+
+  int audioTask = -1;
   
-  if(Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 4096) == -1){
-    return -1;
+  if(headless == false){
+    audioTask = startup.addTask("audio", []() -> bool
+    {
+      if(Mix_Init(MIX_INIT_MP3) != MIX_INIT_MP3) return false;
+      return (Mix_OpenAudio(44100, MIX_DEFAULT_FORMAT, 2, 4096) != -1);
+    });
   }
 
+  // music is only played and recorded in the live mode
+  Mix_Music* music = NULL;
+  int musicTask = -1;
 
-  
-
+  if(offlineSeconds <= 0.0 && headless == false){
+    musicTask = startup.addTask("music", [&]() -> bool
+    {
+      music = Mix_LoadMUS(audiofile.c_str());
+      return true;
+    }, { audioTask });
+  }
   
   if(SDL_GetCurrentDisplayMode(0, &mode) == 0){
     SCREEN_WIDTH = mode.w;
@@ -172,11 +301,12 @@ int main(int argc, char** argv)
   }
 
 #if 1
-  window = SDL_CreateWindow(windowTitle.c_str(),
-			    SDL_WINDOWPOS_CENTERED,
-			    SDL_WINDOWPOS_CENTERED,
-			    (3*SCREEN_WIDTH)/4, (3*SCREEN_HEIGHT)/4,
-			    SDL_WINDOW_SHOWN);
+  if(headless == false)
+    window = SDL_CreateWindow(windowTitle.c_str(),
+			      SDL_WINDOWPOS_CENTERED,
+			      SDL_WINDOWPOS_CENTERED,
+			      (3*SCREEN_WIDTH)/4, (3*SCREEN_HEIGHT)/4,
+			      SDL_WINDOW_SHOWN);
 #endif
 
 #if 0
@@ -187,154 +317,891 @@ int main(int argc, char** argv)
 			    SDL_WINDOW_SHOWN | SDL_WINDOW_FULLSCREEN_DESKTOP);
 #endif
   
-  if(window == NULL) return -1;
-
-  SDL_GetWindowSize(window, &SCREEN_WIDTH, &SCREEN_HEIGHT);
+  if(headless){
+    SCREEN_WIDTH = ((3*SCREEN_WIDTH)/4) & ~1;
+    SCREEN_HEIGHT = ((3*SCREEN_HEIGHT)/4) & ~1;
+  }
+  else{
+    if(window == NULL) return -1;
+    
+    SDL_GetWindowSize(window, &SCREEN_WIDTH, &SCREEN_HEIGHT);
+  }
 
   double fontSize = 50.0*sqrt(((float)(SCREEN_WIDTH*SCREEN_HEIGHT))/(640.0*480.0));
   unsigned int fs = (unsigned int)fontSize;
   if(fs <= 0) fs = 10;
 
   TTF_Font* font = nullptr;
-  font = 0;
-  font = TTF_OpenFont(fontname.c_str(), fs);
 
-  Mix_Music* music = Mix_LoadMUS(audiofile.c_str());
-  if(music){
-    if(Mix_PlayMusic(music, -1) == -1){
-      return -1;
-    }
-  }
+  const int fontTask = startup.addTask("font", [&]() -> bool
+  {
+    font = TTF_OpenFont(fontname.c_str(), fs);
+    return true;
+  }, { ttfTask });
+
+  // music starts playing as soon as it has been loaded
+  bool musicPlaying = (musicTask < 0);
+  unsigned long long musicStarted = 0; // msecs from the first frame
+
+  auto startMusic = [&](unsigned long long msecs) -> bool
+  {
+    if(musicPlaying || startup.finished(musicTask) == false) return true;
+
+    musicPlaying = true;
+    musicStarted = msecs;
+
+    if(startup.wait(audioTask) == false) return false;
+    if(music && Mix_PlayMusic(music, -1) == -1) return false;
 
+    return true;
+  };
   
   
-  SDL_SetWindowGrab(window, SDL_TRUE);
-  SDL_UpdateWindowSurface(window);
-  SDL_RaiseWindow(window);
+  if(window){
+    if(presenter.open(window, vsync) == false) return -1;
+    
+    SDL_SetWindowGrab(window, SDL_TRUE);
+    presenter.present();
+    SDL_RaiseWindow(window);
+  }
 
   bool running = true;
 
   SDL_Event event;
 
-  const unsigned int NUMBLOBS = 3; // number of graphic elements in effect..
+  if(playFile.size() > 0 && window){
+    // playback of prerendered intro: frames are decoded in background threads
+    // and shown when their presentation time has come
+    SDLAVCodec* player = new SDLAVCodec();
+    
+    if(player->startDecoding(playFile) == false){
+      printf("Cannot play video file: %s\n", playFile.c_str());
+      delete player;
+      return -1;
+    }
 
-  double phase1[NUMBLOBS];
-  double phase2[NUMBLOBS];
-  double phase3[NUMBLOBS];
+    SDL_Surface* surface = presenter.getFramebuffer();
+    SDL_Surface* picture = surface;
 
-  double curveParameter[NUMBLOBS];
-  const double TICKSPERCURVE = 10;
-  unsigned long long latestTickCurveDrawn[NUMBLOBS];
-  
-  std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > > startPoint[NUMBLOBS];
-  std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > > endPoint[NUMBLOBS];
+    // video of different size is scaled to window
+    if((int)player->getDecodeWidth() != surface->w ||
+       (int)player->getDecodeHeight() != surface->h){
+      picture = SDL_CreateRGBSurface(0, player->getDecodeWidth(), player->getDecodeHeight(),
+				     32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+      if(picture == NULL) return -1;
+    }
 
-  for(unsigned int i=0;i<NUMBLOBS;i++){
-    phase1[i] = rng.uniform().c[0];
-    phase2[i] = rng.uniform().c[0];
-    phase3[i] = rng.uniform().c[0];
+    auto playStarted = std::chrono::steady_clock::now();
+
+    while(running && player->endOfStream() == false){
+      const unsigned long long msecs = (unsigned long long)
+	std::chrono::duration_cast<std::chrono::milliseconds>
+	(std::chrono::steady_clock::now() - playStarted).count();
+
+      if(startMusic(msecs) == false) return -1;
+      
+      if(player->showFrame(msecs, picture)){
+	if(picture != surface)
+	  SDL_BlitScaled(picture, NULL, surface, NULL);
+	
+	presenter.present();
+      }
+      else{
+	SDL_Delay(1);
+      }
+
+      while(SDL_PollEvent(&event)){
+	if(event.type == SDL_KEYDOWN &&
+	   (event.key.keysym.sym == SDLK_ESCAPE ||
+	    event.key.keysym.sym == SDLK_RETURN))
+	  running = false;
+      }
+    }
+
+    printf("playback: %llu late frames skipped\n", player->getDroppedFrames());
+
+    player->stopDecoding();
+    delete player;
+
+    if(picture != surface) SDL_FreeSurface(picture);
+
+    startup.waitAll();
+    presenter.close();
+    SDL_Quit();
+
+    return 0;
+  }
+
+  const unsigned int NUMBLOBS = numBlobs; // number of graphic elements in effect..
+
+  std::vector<double> phase1(NUMBLOBS);
+  std::vector<double> phase2(NUMBLOBS);
+  std::vector<double> phase3(NUMBLOBS);
 
-    curveParameter[i] = 10.0;
-    latestTickCurveDrawn[i] = 0;
+  const unsigned int TICKSPERCURVE = 10;
+
+  // blob's movement is generated from its seed (blobs and frames are computed in parallel)
+  fastmath::Random random(time(0));
+  std::vector<uint64_t> blobSeed(NUMBLOBS);
+
+  for(unsigned int i=0;i<NUMBLOBS;i++){
+    phase1[i] = random.uniform();
+    phase2[i] = random.uniform();
+    phase3[i] = random.uniform();
+    blobSeed[i] = random.next();
   }
   
   
   
   unsigned long long tick = 0;
 
-  {
-    SDL_Surface* surface = SDL_GetWindowSurface(window);
-    SDL_FillRect(surface, NULL, 0x80FFFFFF);
-    SDL_FreeSurface(surface);
+  if(bakeFile.size() > 0){
+    // geometry of every frame is computed once in resolution independent
+    // coordinates and saved, rendering can then replay it
+    GeometryBaker baker;
+    
+    if(baker.open(bakeFile, NUMBLOBS) == false){
+      printf("Cannot write geometry file: %s\n", bakeFile.c_str());
+      return -1;
+    }
+
+    std::vector<SDL_Point> polyline;
+    SDL_Color color;
+
+    // tolerance in screen pixels when replayed at the screen's resolution
+    const float bakeTolerance = (curveTolerance*GEOMETRY_SCALE)/SCREEN_WIDTH;
+
+    for(unsigned long long frame=0;frame<bakeFrames;frame++){
+      tick++;
+
+      ArenaScope frameScope;
+      
+      for(unsigned int i=0;i<NUMBLOBS;i++){
+	blobGeometry(tick, phase1[i], phase2[i], phase3[i],
+		     blobSeed[i],
+		     TICKSPERCURVE,
+		     bakeTolerance, curveSamples,
+		     GEOMETRY_SCALE, GEOMETRY_SCALE,
+		     polyline,
+		     color);
+	
+	if(baker.addBlob(polyline, color) == false) return -1;
+      }
+    }
+
+    if(baker.close() == false) return -1;
+
+    printf("%llu frames baked into %s\n", baker.frames(), bakeFile.c_str());
+
+    startup.waitAll();
+    SDL_Quit();
+    
+    return 0;
   }
 
-  SDL_Surface* black = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32,
-					    0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000);
-  SDL_FillRect(black, NULL, 0xA0FFFFFF);
-  SDL_SetSurfaceBlendMode(black, SDL_BLENDMODE_BLEND);
+  // baked geometry replaces computing the blobs
+  GeometryCache replay;
   
-  SDLAVCodec* video = new SDLAVCodec(0.50f);
-  if(video->startEncoding("intro.mp4", SCREEN_WIDTH, SCREEN_HEIGHT) == false)
+  if(replayFile.size() > 0 && replay.open(replayFile) == false){
+    printf("Cannot open geometry file: %s\n", replayFile.c_str());
     return -1;
+  }
 
+  if(window)
+    SDL_FillRect(presenter.getFramebuffer(), NULL, 0x80FFFFFF);
 
-  auto t0 = std::chrono::system_clock::now().time_since_epoch();
-  auto t0ms = std::chrono::duration_cast<std::chrono::milliseconds>(t0).count();
-  unsigned long long programStarted = t0ms;
+  // blobs are rendered at internal render scale which is
+  // reduced when frames take longer than the target frame time
+  RenderScaleController scaleController(targetFPS);
   
+  if(renderScale > 0.0)
+    scaleController.setFixedScale(renderScale);
+  else if(offlineSeconds > 0.0)
+    scaleController.setFixedScale(1.0); // no time budget when rendering offline
+  
+  // background is blended over the previous frame so blobs leave fading
+  // trails: areas covered during the last TRAILFRAMES frames are redrawn too
+  const unsigned int TRAILFRAMES = 8;
+
+  // blobs are binned into TILESIZE x TILESIZE tiles by their bounding boxes:
+  // each damaged tile is cleared, rasterized and composited once with only
+  // the blobs overlapping it (tiles in parallel). Even size keeps YUV chroma
+  // samples inside tiles
+  const int TILESIZE = 64;
+
+  // carried from frame to frame by a renderer, offline renderers have their own
+  struct FrameState {
+    std::vector<std::vector<SDL_Point> > blobPolyline; // in canvas coordinates
+    std::vector<SDL_Color> blobColor;
+    std::vector<SDL_Rect> blobBounds; // in canvas coordinates
+
+    int width, height; // canvas size of the latest frame
+    int tilesX, tilesY;
+    std::vector<std::vector<unsigned int> > tileBlobs; // blobs overlapping each tile
+
+    // tiles covered by blobs in the latest TRAILFRAMES+1 frames (ring, the
+    // current frame overwrites the oldest one), empty entries are not used
+    std::vector<std::vector<Uint8> > tileHistory;
+    unsigned int historyNext;
+    unsigned int fullDamageFrames;
+
+    // latest rendered frame does not continue the previous one (replay
+    // loop wrapped or render scale changed): hints encoder to place
+    // keyframe here
+    bool sceneCut;
+  };
+
+  auto resetFrameState = [&](FrameState& state)
+  {
+    state.blobPolyline.resize(NUMBLOBS);
+    state.blobColor.resize(NUMBLOBS);
+    state.blobBounds.assign(NUMBLOBS, SDL_Rect{ 0, 0, 0, 0 });
+    state.width = 0;
+    state.height = 0;
+    state.tilesX = 0;
+    state.tilesY = 0;
+    state.tileBlobs.clear();
+    state.tileHistory.resize(TRAILFRAMES + 1);
+    for(auto& h : state.tileHistory) h.clear(); // keeps capacity
+    state.historyNext = 0;
+    state.fullDamageFrames = TRAILFRAMES;
+    state.sceneCut = false;
+  };
+
+  FrameState frameState;
+  resetFrameState(frameState);
+
+  // the scene (background and blobs) is drawn directly into the framebuffer or
+  // into this canvas at internal render scale which is upscaled into the
+  // framebuffer. Memory use does not depend on the number of blobs
+  SDL_Surface* canvas = NULL;
+
+  auto createCanvas = [&]() -> bool
+  {
+    if(canvas) SDL_FreeSurface(canvas);
+    canvas = NULL;
 
-  while(running){
-    tick++;
+    const int w = scaleController.scaled(SCREEN_WIDTH);
+    const int h = scaleController.scaled(SCREEN_HEIGHT);
+    
+    if(w != SCREEN_WIDTH || h != SCREEN_HEIGHT){
+      canvas = SDL_CreateRGBSurface(0, w, h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+      if(canvas == NULL) return false;
+
+      SDL_FillRect(canvas, NULL, SDL_MapRGB(canvas->format, 0xFF, 0xFF, 0xFF));
+    }
+
+    resetFrameState(frameState); // everything is redrawn
+    
+    return true;
+  };
 
+  // text never changes: renders it only once
+  std::vector<SDL_Surface*> messages;
+  std::vector<SDL_Rect> messageRects;
+
+  if(startup.wait(fontTask) == false)
+    return -1;
+  
+  {
     std::vector<std::string> message;
     message.push_back("Charm");
     message.push_back("[sensar studios]");
+    
+    const SDL_Color white = { 255, 255, 255 };
+    
+    for(unsigned int i=0;i<message.size();i++){
+      
+      SDL_Surface* msg = TTF_RenderUTF8_Blended(font, message[i].c_str(), white);
+      if(msg == NULL) return -1;
+      
+      SDL_Rect messageRect;
+      
+      messageRect.x = (SCREEN_WIDTH - msg->w)/2;
+      messageRect.y = (SCREEN_HEIGHT - 2*(msg->h)*(message.size()-i))/2;
+      messageRect.w = msg->w;
+      messageRect.h = msg->h;
+      
+      messages.push_back(msg);
+      messageRects.push_back(messageRect);
+    }
+  }
 
-    SDL_Surface* surface = SDL_GetWindowSurface(window);
+  std::vector<YUVSprite> messageSprites(messages.size());
+  
+  if(yuvMode){
+    for(unsigned int i=0;i<messages.size();i++)
+      if(createYUVSprite(messages[i], messageSprites[i]) == false)
+	return -1;
+  }
+
+  // draws frame tick of the effect into surface (or into yuv frame when it is
+  // given) over the previous frame drawn with the same state, damage is set
+  // to the area of the frame that was changed
+  auto renderFrame = [&](const unsigned long long tick, FrameState& state,
+			 SDL_Surface* surface, AVFrame* yuv, DamageRegion& damage) -> bool
+  {
+    ArenaScope frameScope; // temporaries of the frame
+    
+    // blobs are computed in the resolution they are rasterized in
+    SDL_Surface* target = canvas ? canvas : surface;
+    const int cw = yuv ? SCREEN_WIDTH : target->w;
+    const int ch = yuv ? SCREEN_HEIGHT : target->h;
+    
+    TaskScheduler::instance().parallelFor(STAGE_RENDER, 0, NUMBLOBS, [&](int i){
+      if(replay.frames() > 0){
+	// baked animation loops, only rasterization is left
+	const unsigned long long frame = (tick - 1) % replay.frames();
+	
+	replay.getBlob(frame, i % replay.blobs(), cw, ch,
+		       state.blobPolyline[i], state.blobColor[i]);
+      }
+      else{
+	blobGeometry(tick, phase1[i], phase2[i], phase3[i],
+		     blobSeed[i],
+		     TICKSPERCURVE,
+		     curveTolerance, curveSamples,
+		     cw, ch,
+		     state.blobPolyline[i],
+		     state.blobColor[i]);
+      }
+      
+      state.blobBounds[i] = polylineBounds(state.blobPolyline[i], cw, ch);
+    });
+
+    // blobs moving to new control points continue smoothly, only jumps
+    // in the picture are cuts (not the first frame: it is a keyframe anyway)
+    const bool loopWrapped =
+      (replay.frames() > 0 && tick > 1 && ((tick - 1) % replay.frames()) == 0);
+    const bool rescaled =
+      (state.width != 0 && (state.width != cw || state.height != ch));
+    state.sceneCut = (loopWrapped || rescaled);
+    state.width = cw;
+    state.height = ch;
+
+    // bins blobs into tiles
+    const int tilesX = (cw + TILESIZE - 1)/TILESIZE;
+    const int tilesY = (ch + TILESIZE - 1)/TILESIZE;
+
+    if(tilesX != state.tilesX || tilesY != state.tilesY){
+      state.tilesX = tilesX;
+      state.tilesY = tilesY;
+      state.tileBlobs.resize(tilesX*tilesY);
+      for(auto& h : state.tileHistory) h.clear();
+      state.fullDamageFrames = TRAILFRAMES;
+    }
 
-    SDL_BlitSurface(black, NULL, surface, NULL);
+    for(auto& bin : state.tileBlobs)
+      bin.clear(); // keeps capacity
 
-    SDL_Surface* pic[10];
+    std::vector<Uint8>& covered = state.tileHistory[state.historyNext];
+    covered.assign(tilesX*tilesY, 0);
+    state.historyNext = (state.historyNext + 1) % state.tileHistory.size();
 
-#pragma omp parallel for
     for(unsigned int i=0;i<NUMBLOBS;i++){
-      pic[i] = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32,
-				    0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000);
+      const SDL_Rect& r = state.blobBounds[i];
+      if(r.w <= 0 || r.h <= 0) continue;
+
+      for(int ty=r.y/TILESIZE;ty<=(r.y + r.h - 1)/TILESIZE;ty++){
+	for(int tx=r.x/TILESIZE;tx<=(r.x + r.w - 1)/TILESIZE;tx++){
+	  state.tileBlobs[tx + ty*tilesX].push_back(i);
+	  covered[tx + ty*tilesX] = 1;
+	}
+      }
+    }
+
+    // redrawn tiles: blobs now and fading trails of the previous frames
+    ArenaVector<Uint8> dirty(covered.size(), 0);
+
+    for(const auto& h : state.tileHistory)
+      if(h.size() == dirty.size())
+	for(unsigned int t=0;t<dirty.size();t++)
+	  dirty[t] |= h[t];
+
+    if(state.fullDamageFrames > 0){
+      std::fill(dirty.begin(), dirty.end(), 1);
+      state.fullDamageFrames--;
+    }
+
+    ArenaVector<SDL_Rect> tiles;
+    tiles.reserve(dirty.size());
+
+    for(int ty=0;ty<tilesY;ty++){
+      for(int tx=0;tx<tilesX;tx++){
+	if(dirty[tx + ty*tilesX] == 0) continue;
+
+	const int x0 = tx*TILESIZE, y0 = ty*TILESIZE;
+	tiles.push_back(SDL_Rect{ x0, y0,
+	      std::min(TILESIZE, cw - x0), std::min(TILESIZE, ch - y0) });
+      }
+    }
+
+    // clears tiles with the background and draws blobs overlapping them
+    auto drawTiles = [&](auto& painter, const auto& background, const auto& white,
+			 const auto& colors)
+    {
+      TaskScheduler::instance().parallelFor(STAGE_RENDER, 0, (int)tiles.size(), [&](int t){
+	const SDL_Rect& tile = tiles[t];
+	const unsigned int index = tile.x/TILESIZE + (tile.y/TILESIZE)*tilesX;
+
+	painter.fillRect(tile, background);
+
+	for(const auto& i : state.tileBlobs[index]){
+	  SDL_Rect clip;
+
+	  if(SDL_IntersectRect(&tile, &state.blobBounds[i], &clip)){
+	    painter.fillPolygon(state.blobPolyline[i], colors[i], clip);
+	    painter.drawPolyline(state.blobPolyline[i], white, clip);
+	  }
+	}
+      });
+    };
+
+    // damaged area of the screen: runs of dirty tiles in each row of tiles
+    damage.resize(SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    for(unsigned int t=0;t<tiles.size();){
+      SDL_Rect run = tiles[t++];
+
+      while(t < tiles.size() && tiles[t].y == run.y && tiles[t].x == run.x + run.w)
+	run.w += tiles[t++].w;
+
+      if(cw == SCREEN_WIDTH && ch == SCREEN_HEIGHT){
+	damage.add(run);
+      }
+      else{
+	// canvas to screen coordinates, bilinear filtering spreads one pixel further
+	const int x0 = (run.x*SCREEN_WIDTH)/cw - 1;
+	const int y0 = (run.y*SCREEN_HEIGHT)/ch - 1;
+	const int x1 = ((run.x + run.w)*SCREEN_WIDTH + cw - 1)/cw + 1;
+	const int y1 = ((run.y + run.h)*SCREEN_HEIGHT + ch - 1)/ch + 1;
+	
+	damage.add(SDL_Rect{ x0, y0, x1 - x0, y1 - y0 });
+      }
+    }
+
+    if(yuv){
+      // colours are converted once per fill colour instead of once per pixel
+      YUVCanvas painter(yuv);
       
-      renderPlot(tick, phase1[i], phase2[i], phase3[i],
-		 curveParameter[i],
-		 latestTickCurveDrawn[i],
-		 TICKSPERCURVE,
-		 startPoint[i],
-		 endPoint[i],
-		 pic[i]);
+      const YUVColor background = rgbToYUVColor(0xFF, 0xFF, 0xFF, 0xA0);
+      const YUVColor white = rgbToYUVColor(0xFF, 0xFF, 0xFF, 0xFF);
+      ArenaVector<YUVColor> colors(NUMBLOBS);
       
-      SDL_SetSurfaceBlendMode(pic[i], SDL_BLENDMODE_BLEND);
+      for(unsigned int i=0;i<NUMBLOBS;i++)
+	colors[i] = rgbToYUVColor(state.blobColor[i].r, state.blobColor[i].g,
+				  state.blobColor[i].b, state.blobColor[i].a);
+
+      drawTiles(painter, background, white, colors);
+      
+      for(const auto& r : damage.rects())
+	for(unsigned int i=0;i<messageSprites.size();i++)
+	  painter.blendSprite(messageSprites[i], messageRects[i].x, messageRects[i].y, r);
+      
+      return true;
     }
 
-    for(unsigned int i=0;i<NUMBLOBS;i++){
-      SDL_BlitSurface(pic[i], NULL, surface, NULL);
-      SDL_FreeSurface(pic[i]);
+    {
+      RGBCanvas painter(target);
 
+      drawTiles(painter, SDL_Color{ 0xFF, 0xFF, 0xFF, 0xA0 },
+		SDL_Color{ 0xFF, 0xFF, 0xFF, 0xFF }, state.blobColor);
     }
-      
+
+    for(const auto& r : damage.rects()){
+      if(canvas)
+	upscaleBilinear(canvas, surface, r);
+
+      for(unsigned int i=0;i<messages.size();i++){
+	SDL_Rect src, dst;
+	
+	if(SDL_IntersectRect(&r, &messageRects[i], &dst)){
+	  src = dst;
+	  src.x -= messageRects[i].x;
+	  src.y -= messageRects[i].y;
+	  
+	  if(SDL_BlitSurface(messages[i], &src, surface, &dst) != 0)
+	    return false;
+	}
+      }
+    }
+
+    return true;
+  };
+
+
+  // scenes of the intro: render canvas is allocated by the timeline's background
+  // thread before the scene starts and freed after it has ended
+  Timeline timeline;
+
+  if(yuvMode == false){
+    timeline.addScene("blobs",
+		      new FunctionEffect([&]() -> bool { return createCanvas(); },
+					 [&](unsigned long long msecs, SDL_Surface* surface,
+					     DamageRegion& damage) -> bool
+					 {
+					   return renderFrame(tick, frameState, surface, NULL, damage);
+					 },
+					 [&](){
+					   if(canvas) SDL_FreeSurface(canvas);
+					   canvas = NULL;
+					 }),
+		      0);
     
-    {
-      const SDL_Color white = { 255, 255, 255 };
+    if(timeline.start() == false) return -1;
+  }
+
+  // frame cost of each scene
+  auto printSceneStats = [&]()
+  {
+    for(const auto& st : timeline.getStats())
+      fprintf(stderr, "scene %s: %llu frames, %.2f ms average, %.2f ms max, %.1f ms waiting for prepare\n",
+	      st.name.c_str(), st.frames, st.avgMsecs, st.maxMsecs, st.stallMsecs);
+
+    TaskScheduler::instance().report(stderr);
+
+    const AllocationStats allocs = renderAllocationStats();
+    fprintf(stderr, "render path: %llu heap allocations (%llu bytes)\n",
+	    allocs.allocations, allocs.bytes);
+  };
+
+
+  if(offlineSeconds > 0.0){
+    // offline rendering: every video frame is rendered (one tick per frame)
+    // and encoded in parallel closed GOP segments
+    SDLAVSegmentEncoder* video = new SDLAVSegmentEncoder(0.50f);
+    if(video->startEncoding(offlineFile, SCREEN_WIDTH, SCREEN_HEIGHT) == false)
+      return -1;
+
+    const unsigned long long NUMFRAMES =
+      (unsigned long long)(offlineSeconds*video->getFPS());
+
+    if(yuvMode){
+      // frames depend on each other only through the fading trails: chunks of
+      // consecutive frames are rendered in parallel, each chunk starts TRAILFRAMES
+      // frames early from an empty picture (trails have faded out by then), and
+      // frames are reordered before inserting them into the encoder.
+      // Chunks are a quarter of each thread's share (warm-up is at most 1/4 of
+      // a chunk) but at most 16 trail lengths to bound the reorder buffer
+      const unsigned long long THREADS = TaskScheduler::instance().getThreads(STAGE_RENDER);
+      unsigned long long CHUNK = NUMFRAMES/(4*THREADS);
+      if(CHUNK < 4*TRAILFRAMES) CHUNK = 4*TRAILFRAMES;
+      if(CHUNK > 16*TRAILFRAMES) CHUNK = 16*TRAILFRAMES;
       
-      for(unsigned int i=0;i<message.size();i++){
+      const unsigned long long NUMCHUNKS = (NUMFRAMES + CHUNK - 1)/CHUNK;
+
+      // every thread works on its own chunk of the window, one chunk of
+      // slack keeps threads busy while the oldest chunk is finishing
+      const unsigned long long MAXAHEAD = CHUNK*(THREADS + 1);
+
+      std::map<unsigned long long, AVFrame*> reorder; // waiting for earlier frames
+      unsigned long long nextFrame = 0;
+      bool inserting = false;
+      std::atomic<bool> failed(false);
+      std::mutex reorder_mutex;
+      std::condition_variable reorder_cond;
+
+      // wakes up threads waiting for the reorder buffer
+      auto renderFailed = [&]()
+      {
+	std::lock_guard<std::mutex> lock(reorder_mutex);
+	failed = true;
+	reorder_cond.notify_all();
+      };
+
+      // the thread completing the next frame inserts all frames ready in order
+      auto deliverFrame = [&](unsigned long long frame, AVFrame* f)
+      {
+	std::unique_lock<std::mutex> lock(reorder_mutex);
+	reorder[frame] = f;
+
+	if(inserting) return; // picked up by the inserting thread
+	inserting = true;
+
+	while(reorder.size() > 0 && reorder.begin()->first == nextFrame){
+	  AVFrame* next = reorder.begin()->second;
+	  reorder.erase(reorder.begin());
+
+	  lock.unlock();
+	  const bool ok = video->insertFrame(nextFrame, next);
+	  lock.lock();
+
+	  if(ok == false) failed = true;
+	  nextFrame++;
+	  reorder_cond.notify_all();
+	}
+
+	inserting = false;
+      };
+
+      TaskScheduler::instance().parallelFor(STAGE_RENDER, 0, (int)NUMCHUNKS, [&](int c){
+	const unsigned long long first = c*CHUNK;
+	const unsigned long long last = (first + CHUNK < NUMFRAMES) ? first + CHUNK : NUMFRAMES;
+	const unsigned long long warmup = (first > TRAILFRAMES) ? first - TRAILFRAMES : 0;
+
+	AVFrame* picture = video->acquireFrame();
+	if(picture == nullptr){ renderFailed(); return; }
+
+	YUVCanvas(picture).fillRect(SDL_Rect{ 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT },
+				    rgbToYUVColor(0xFF, 0xFF, 0xFF));
 	
-	SDL_Surface* msg = TTF_RenderUTF8_Blended(font, message[i].c_str(), white);
+	FrameState state;
+	resetFrameState(state);
+	DamageRegion damage; // keeps capacity between frames
+
+	for(unsigned long long frame=warmup;frame<last && failed == false;frame++){
+	  if(renderFrame(frame + 1, state, NULL, picture, damage) == false){
+	    renderFailed();
+	    break;
+	  }
+
+	  if(frame < first) continue; // only builds up trails
+
+	  {
+	    // limits frames waiting in the reorder buffer
+	    std::unique_lock<std::mutex> lock(reorder_mutex);
+	    while(frame >= nextFrame + MAXAHEAD && failed == false)
+	      reorder_cond.wait(lock);
+	  }
+
+	  AVFrame* f = video->acquireFrame();
+	  if(f == nullptr){ renderFailed(); break; }
+
+	  av_frame_copy(f, picture);
+	  deliverFrame(frame, f);
+	}
+
+	video->releaseFrame(picture);
+      }, 1); // one chunk at a time: chunks are taken in frame order
+
+      if(failed){
+	printf("video->insertFrame() FAILED.\n");
+	return -1;
+      }
+    }
+    else{
+      DamageRegion damage;
+      
+      for(unsigned long long frame=0;frame<NUMFRAMES && running;frame++){
+	tick++;
 	
-	SDL_Rect messageRect;
+	damage.resize(0, 0);
+	SDL_Surface* surface = presenter.getFramebuffer();
+
+	{
+	  ArenaScope frameScope;
+	  
+	  if(timeline.render((frame*1000)/video->getFPS(), surface, damage) == false)
+	    return -1;
+	}
 	
-	messageRect.x = (SCREEN_WIDTH - msg->w)/2;
-	messageRect.y = (SCREEN_HEIGHT - 2*(msg->h)*(message.size()-i))/2;
-	messageRect.w = msg->w;
-	messageRect.h = msg->h;
+	if(video->insertFrame(frame, surface) == false){
+	  printf("video->insertFrame() FAILED.\n");
+	  return -1;
+	}
 	
-	if(SDL_BlitSurface(msg, NULL, surface, &messageRect) != 0)
-	  return false;
+	presenter.present(&damage);
 	
-	SDL_FreeSurface(msg);
+	while(SDL_PollEvent(&event)){
+	  if(event.type == SDL_KEYDOWN &&
+	     event.key.keysym.sym == SDLK_ESCAPE)
+	    running = false;
+	}
       }
     }
 
-    // update video recorder
+    video->stopEncoding();
+    delete video;
+
+    timeline.stop();
+    printSceneStats();
+
+    startup.waitAll();
+    presenter.close();
+    SDL_Quit();
+
+    return 0;
+  }
+  
+  // ABR ladder: the same recording in smaller preview resolutions, the
+  // picture is converted only once and scaled down for the previews
+  SDLAVLadder* ladder = nullptr;
+  SDLAVCodec* video = nullptr;
+
+  // encoder crashes do not stop the show: frames go to another process
+  SDLAVEncoderProcess* encoderProcess = nullptr;
+
+  // capture costs only conversion and memory copies, compression is done later
+  SDLAVSpool* spool = nullptr;
+
+  if(spoolFile.size() > 0){
+    spool = new SDLAVSpool((unsigned int)(targetFPS + 0.5));
+  }
+  else if(separateEncoder && abrLadder == false){
+    encoderProcess = new SDLAVEncoderProcess(0.50f);
+    encoderProcess->setQueuePolicy(queuePolicy, queueBytes);
+    encoderProcess->setAdaptiveSpeed(adaptiveSpeed);
+  }
+  else if(abrLadder && streamURL.size() == 0){
+    ladder = new SDLAVLadder(0.50f);
+    ladder->addRendition("intro.mp4", SCREEN_WIDTH, SCREEN_HEIGHT);
+
+    const int heights[2] = { 720, 360 };
+    
+    for(unsigned int i=0;i<2;i++){
+      if(heights[i] >= SCREEN_HEIGHT) continue;
+
+      char filename[80];
+      snprintf(filename, 80, "intro_%dp.mp4", heights[i]);
+      
+      ladder->addRendition(filename, (SCREEN_WIDTH*heights[i])/SCREEN_HEIGHT, heights[i]);
+    }
+
+    for(unsigned int i=0;i<ladder->getNumberOfRenditions();i++){
+      ladder->getEncoder(i)->setQueuePolicy(queuePolicy, queueBytes);
+      ladder->getEncoder(i)->setAdaptiveSpeed(adaptiveSpeed);
+    }
+
+    video = ladder->getEncoder(0); // master
+  }
+  else{
+    video = new SDLAVCodec(0.50f);
+    video->setQueuePolicy(queuePolicy, queueBytes);
+    video->setAdaptiveSpeed(adaptiveSpeed);
+  }
+
+  // encoder (codec setup, opening output) is started in background when the
+  // music is playing, frames shown before the recorder is ready are not recorded
+  int recorderTask = -1;
+  bool recording = false;
+
+  auto startRecorder = [&]() -> bool
+  {
+    if(spool){
+      if(music) spool->addAudioTrack(audiofile, musicStarted, true);
+      return spool->startEncoding(spoolFile, SCREEN_WIDTH, SCREEN_HEIGHT);
+    }
+    
+    if(encoderProcess){
+      if(music) encoderProcess->addAudioTrack(audiofile, musicStarted, true);
+
+      if(streamURL.size() > 0)
+	return encoderProcess->startStreaming(streamURL, SCREEN_WIDTH & ~1, SCREEN_HEIGHT & ~1);
+      else
+	return encoderProcess->startEncoding("intro.mp4", SCREEN_WIDTH, SCREEN_HEIGHT);
+    }
+    
+    // music is placed on the recording's timeline where it started playing
+    if(music) video->addAudioTrack(audiofile, musicStarted, true);
+
+    if(ladder)
+      return ladder->startEncoding();
+    else if(streamURL.size() > 0)
+      return video->startStreaming(streamURL, SCREEN_WIDTH & ~1, SCREEN_HEIGHT & ~1);
+    else
+      return video->startEncoding("intro.mp4", SCREEN_WIDTH, SCREEN_HEIGHT);
+  };
+
+
+  auto t0 = std::chrono::system_clock::now().time_since_epoch();
+  auto t0ms = std::chrono::duration_cast<std::chrono::milliseconds>(t0).count();
+  unsigned long long programStarted = t0ms;
+
+  // rendering should not touch the heap after the first frames (arenas and
+  // buffers have grown) or after the render scale has changed
+  const unsigned long long WARMUPFRAMES = 100;
+  unsigned long long steadyFrom = WARMUPFRAMES;
+  unsigned long long steadyFrames = 0, allocatingFrames = 0;
+  AllocationStats steadyAllocs = { 0, 0 };
+
+  DamageRegion damage; // keeps capacity between frames
+
+  while(running){
+    tick++;
+
+    auto frameStart = std::chrono::steady_clock::now();
+
+    // the same framebuffer is presented and read by the encoder (no copies)
+    SDL_Surface* surface = presenter.getFramebuffer();
+    damage.resize(0, 0);
+
+    auto t1 = std::chrono::system_clock::now().time_since_epoch();
+    auto t1ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1).count();
+    
+    const unsigned long long msecs = (unsigned long long)(t1ms - programStarted);
+
     {
-      auto t1 = std::chrono::system_clock::now().time_since_epoch();
-      auto t1ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1).count();
+      const AllocationStats before = renderAllocationStats();
+
+      {
+	ArenaScope frameScope; // render temporaries are released at frame boundary
+	
+	if(timeline.render(msecs, surface, damage) == false)
+	  return false;
+      }
+
+      const AllocationStats after = renderAllocationStats();
+
+      if(tick > steadyFrom){
+	steadyFrames++;
+
+	if(after.allocations > before.allocations){
+	  allocatingFrames++;
+	  steadyAllocs.allocations += after.allocations - before.allocations;
+	  steadyAllocs.bytes += after.bytes - before.bytes;
+	}
+      }
+    }
+
+    if(startMusic(msecs) == false) return -1;
+
+    if(musicPlaying && recorderTask < 0)
+      recorderTask = startup.addTask("recorder", startRecorder);
+
+    if(recording == false && recorderTask >= 0 && startup.finished(recorderTask)){
+      if(startup.wait(recorderTask) == false){
+	printf("Cannot start video recording.\n");
+	return -1;
+      }
+      
+      recording = true;
+      damage.addAll(); // the first recorded frame is the whole picture
+    }
+
+    // update video recorder
+    if(recording){
+      const bool sceneCut = timeline.sceneSwitched() || frameState.sceneCut;
       
-      if(video->insertFrame((unsigned long long)(t1ms - programStarted),
-			    surface) == false){
+      if((spool ? spool->insertFrame(msecs, surface, &damage, sceneCut) :
+	  encoderProcess ? encoderProcess->insertFrame(msecs, surface, &damage, sceneCut) :
+	  ladder ? ladder->insertFrame(msecs, surface, &damage, sceneCut) :
+	  video->insertFrame(msecs, surface, &damage, sceneCut)) == false){
 	printf("video->insertFrame() FAILED.\n");
 	return -1; 
       }
     }
 
-    SDL_FreeSurface(surface);
-    
-    SDL_UpdateWindowSurface(window);
+    if(damage.empty() == false)
+      presenter.present(&damage);
+
+    if(tick == 1){
+      fprintf(stderr, "time to first frame: %.1f ms\n", startup.elapsed());
+      fflush(stderr);
+    }
+
+    {
+      auto frameEnd = std::chrono::steady_clock::now();
+      const double frameMsecs =
+	std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+      
+      if(scaleController.update(frameMsecs)){
+	if(createCanvas() == false) return -1;
+	steadyFrom = tick + WARMUPFRAMES;
+
+	// stdout may carry the live stream
+	fprintf(stderr, "render scale: %d%%\n", (int)(100.0*scaleController.getScale() + 0.5));
+      }
+    }
     
     while(SDL_PollEvent(&event)){ 
       if(event.type == SDL_KEYDOWN &&
@@ -352,10 +1219,66 @@ int main(int argc, char** argv)
     auto t1 = std::chrono::system_clock::now().time_since_epoch();
     auto t1ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1).count();
     
-    video->stopEncoding((unsigned long long)(t1ms - programStarted));
+    // recorder may be still starting
+    const bool recorderStarted = (recorderTask >= 0 && startup.wait(recorderTask));
+    
+    if(spool){
+      if(recorderStarted){
+	spool->stopEncoding();
+	fprintf(stderr, "spool: %llu frames in %s (--transcode %s to compress)\n",
+		spool->getFrames(), spoolFile.c_str(), spoolFile.c_str());
+      }
+
+      delete spool;
+    }
+    else if(encoderProcess){
+      if(recorderStarted){
+	encoderProcess->stopEncoding((unsigned long long)(t1ms - programStarted));
+
+	const SDLAVEncoderProcess::ProcessStats st = encoderProcess->getStats();
+	fprintf(stderr, "encoder process: %llu frames, %llu dropped, %llu restarts\n",
+		st.frames, st.dropped, st.restarts);
+      }
+      
+      delete encoderProcess;
+    }
+    else if(ladder){
+      if(recorderStarted) ladder->stopEncoding((unsigned long long)(t1ms - programStarted));
+      delete ladder;
+    }
+    else{
+      if(recorderStarted) video->stopEncoding((unsigned long long)(t1ms - programStarted));
+
+      if(streamURL.size() > 0){
+	const SDLAVCodec::LatencyStats latency = video->getLatencyStats();
+	fprintf(stderr, "stream latency: %.1f ms average, %.1f ms max\n",
+		latency.avgMsecs, latency.maxMsecs);
+
+	const SDLAVCodec::SpeedStats speed = video->getSpeedStats();
+	fprintf(stderr, "encoder speed: level %u (%llu faster, %llu slower, %llu restarts), load %.2f\n",
+		speed.level, speed.speedUps, speed.slowDowns, speed.reopens, speed.load);
+      }
+      
+      delete video;
+    }
   }
 
+  timeline.stop();
+  printSceneStats();
+
+  fprintf(stderr, "steady state frames: %llu of %llu allocated (%llu allocations, %llu bytes)\n",
+	  allocatingFrames, steadyFrames, steadyAllocs.allocations, steadyAllocs.bytes);
+
+  startup.waitAll();
+  startup.report(stderr);
+  
+  presenter.close();
   SDL_Quit();
+
+  if(checkAllocs && allocatingFrames > 0){
+    printf("Rendering allocated heap memory in steady state frames.\n");
+    return -1;
+  }
   
 #endif
     
@@ -366,17 +1289,15 @@ int main(int argc, char** argv)
 
 
 
-bool renderPlot(const unsigned long long tick,
-		const double phase1, const double phase2, const double phase3,
-		double& curveParameter,
-		unsigned long long& latestTickCurveDrawn,
-		const double TICKSPERCURVE,
-		std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > >& startPoint,
-		std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > >& endPoint,
-		SDL_Surface* surface)
+bool blobGeometry(const unsigned long long tick,
+		  const double phase1, const double phase2, const double phase3,
+		  const uint64_t seed,
+		  const unsigned int TICKSPERCURVE,
+		  const float tolerance, const unsigned int maxSamples,
+		  const unsigned int SCREEN_WIDTH, const unsigned int SCREEN_HEIGHT,
+		  std::vector<SDL_Point>& projected,
+		  SDL_Color& color)
 {
-  const unsigned int SCREEN_WIDTH = surface->w;
-  const unsigned int SCREEN_HEIGHT= surface->h;
 
   const double t = tick/25.0;
   
@@ -391,127 +1312,114 @@ bool renderPlot(const unsigned long long tick,
   
   {
     {
-      unsigned int r = 0xFF & rand();
-      unsigned int g = 0xFF & rand();
-      unsigned int b = 0xFF & rand();
-      
-      r = 0xFF*((1.0 + sin(angle1))/2.0);
-      g = 0xFF*((1.0 + cos(angle2))/2.0);
-      b = 0xFF*((1.0 + sin(cos(angle3)))/2.0);
+      unsigned int r = 0xFF*((1.0 + sin(angle1))/2.0);
+      unsigned int g = 0xFF*((1.0 + cos(angle2))/2.0);
+      unsigned int b = 0xFF*((1.0 + sin(cos(angle3)))/2.0);
       
       if(r > 0xFF) r = 0xFF;
       if(g > 0xFF) g = 0xFF;
       if(b > 0xFF) b = 0xFF;
       
-      SDL_FillRect(surface, NULL, SDL_MapRGBA(surface->format, r, g, b, 0x80));
+      color = SDL_Color{ (Uint8)r, (Uint8)g, (Uint8)b, 0x80 };
     }
     
     {
-      std::vector< math::vertex< math::blas_real<double> > > curve;
-      std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > > points;
+      // reused between frames: no allocations after the first frame
+      static thread_local std::vector<fastmath::vec3> curve;
+      curve.reserve(maxSamples + 1);
       const unsigned int NPOINTS = 5;
       const unsigned int DIMENSION = 3;
+      fastmath::vec3 points[NPOINTS];
       
       {
-	points.resize(NPOINTS);
-	
-	if(curveParameter > 1.0)
+	// index:th control points are generated directly from the seed
+	auto controlPoints = [&](const unsigned long long index, fastmath::vec3* p)
 	{
-	  points.resize(NPOINTS);
+	  fastmath::Random random(seed, index);
 	  
-	  for(auto& p : points){
-	    p.resize(DIMENSION);
-	    
+	  for(unsigned int j=0;j<NPOINTS;j++){
 	    for(unsigned int d=0;d<DIMENSION;d++){
-	      whiteice::math::blas_real<float> value = rng.uniform()*2.0f - 1.0f; // [-1,1]
-	      p[d] = value.c[0];
+	      p[j][d] = random.uniform()*2.0f - 1.0f; // [-1,1]
 	    }
-	    
-	  }
-	  
-	  startPoint = endPoint;
-	  endPoint = points;
-	  
-	  if(startPoint.size() == 0)
-	    startPoint = points;
-	  
-	  latestTickCurveDrawn = tick;
-	}
-	
-	curveParameter = (tick - latestTickCurveDrawn)/TICKSPERCURVE;
-	
-	for(unsigned int j=0;j<points.size();j++){
-	  points[j].resize(DIMENSION);
-	  for(unsigned int d=0;d<DIMENSION;d++){
-	    points[j][d] = (1.0 - curveParameter)*startPoint[j][d] + curveParameter*endPoint[j][d];
 	  }
-	  
-	}
-      }
-      
-      createHermiteCurve(curve, points, 0.0, 200);
-      
-      SDL_Renderer* renderer = SDL_CreateSoftwareRenderer(surface);
-      
-      if(renderer == NULL)
-	return false;
-      
-      
-      SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
-      
-      math::matrix< math::blas_real<double> > R; // rotation matrix
-      R.rotation(2*angle1, 2*angle2, 2*angle3);
-      
-      for(unsigned int i=0;i<curve.size();i++){
-	auto p = curve[i];
-	
-	unsigned int index = i;
-	if(index == 0) index = curve.size()-1;
-	else index--;
-	auto pprev = curve[index];
+	};
 	
-	// rotates points
+	// moves from the previous curve's control points to the current ones
+	const unsigned long long index = tick/TICKSPERCURVE;
+	fastmath::vec3 startPoint[NPOINTS], endPoint[NPOINTS];
 	
-	auto pv = p;
-	pv.resize(4);
-	pv[0] = p[0]; pv[1] = p[1]; pv[2] = p[2]; pv[3] = 1.0;
-	pv = R*pv;
-	p[0] = pv[0]; p[1] = pv[1]; p[2] = pv[2];
+	controlPoints(index, endPoint);
 	
-	pv[0] = pprev[0]; pv[1] = pprev[1]; pv[2] = pprev[2]; pv[3] = 1.0;
-	pv = R*pv;
-	pprev[0] = pv[0]; pprev[1] = pv[1]; pprev[2] = pv[2];
+	if(index > 0) controlPoints(index - 1, startPoint);
+	else controlPoints(index, startPoint);
 	
+	const float c = (float)(tick % TICKSPERCURVE)/TICKSPERCURVE;
 	
-	double z = 4.0f + p[2].c[0];
-	double zp = 4.0f + pprev[2].c[0];
-	
-	int x = 0;
-	const double scalingx = 2.2*SCREEN_WIDTH/4;
-	math::convert(x, scalingx*p[0]/z + SCREEN_WIDTH/2);
-	
-	int y = 0;
-	const double scalingy = 2.2*SCREEN_HEIGHT/4;
-	math::convert(y, scalingy*p[1]/z + SCREEN_HEIGHT/2);
+	for(unsigned int j=0;j<NPOINTS;j++)
+	  points[j] = startPoint[j]*(1.0f - c) + endPoint[j]*c;
+      }
+      
+      const fastmath::mat3 R = fastmath::rotation(2*angle1, 2*angle2, 2*angle3);
+
+      const float scalingx = 2.2f*SCREEN_WIDTH/4;
+      const float scalingy = 2.2f*SCREEN_HEIGHT/4;
+
+      // rotates and projects curve point to screen
+      auto project = [&](const fastmath::vec3& x) -> fastmath::vec2
+      {
+	const fastmath::vec3 p = R*x;
 	
-	int xp = 0;
-	math::convert(xp, scalingx*pprev[0]/zp + SCREEN_WIDTH/2);
+	const float z = 4.0f + p[2];
 	
-	int yp = 0;
-	math::convert(yp, scalingy*pprev[1]/zp + SCREEN_HEIGHT/2);
+	return fastmath::vec2{{ scalingx*p[0]/z + SCREEN_WIDTH/2,
+				scalingy*p[1]/z + SCREEN_HEIGHT/2 }};
+      };
+
+      // number of samples follows the size of the blob on the screen
+      createAdaptiveHermiteCurve(curve, points, NPOINTS, std::cref(project),
+				 tolerance, maxSamples);
+      
+      projected.reserve(maxSamples + 1);
+      projected.resize(curve.size());
+
+      for(unsigned int i=0;i<curve.size();i++){
+	const fastmath::vec2 p = project(curve[i]);
 	
-	SDL_RenderDrawLine(renderer, xp, yp, x, y);
+	projected[i].x = (int)p[0];
+	projected[i].y = (int)p[1];
       }
-      
-      SDL_DestroyRenderer(renderer);
-      
-      floodfill(0, 0, surface, 0x20, 0x20, 0x20);
-      floodfill(0, SCREEN_HEIGHT-1, surface, 0x20, 0x20, 0x20);
-      floodfill(SCREEN_WIDTH-1, 0, surface, 0x20, 0x20, 0x20);
-      floodfill(SCREEN_WIDTH-1, SCREEN_HEIGHT-1, surface, 0x20, 0x20, 0x20);
+
     }
 
   }
 
   return true;
 }
+
+
+
+SDL_Rect polylineBounds(const std::vector<SDL_Point>& polyline,
+			const int width, const int height)
+{
+  SDL_Rect bbox = { 0, 0, 0, 0 };
+  
+  if(polyline.size() > 0){
+    int xmin = polyline[0].x, xmax = polyline[0].x;
+    int ymin = polyline[0].y, ymax = polyline[0].y;
+    
+    for(const auto& p : polyline){
+      if(p.x < xmin) xmin = p.x;
+      if(p.x > xmax) xmax = p.x;
+      if(p.y < ymin) ymin = p.y;
+      if(p.y > ymax) ymax = p.y;
+    }
+    
+    SDL_Rect box = { xmin - 1, ymin - 1, xmax - xmin + 3, ymax - ymin + 3 };
+    SDL_Rect screen = { 0, 0, width, height };
+    
+    if(SDL_IntersectRect(&box, &screen, &bbox) == SDL_FALSE)
+      bbox = SDL_Rect{ 0, 0, 0, 0 };
+  }
+
+  return bbox;
+}
@@ -0,0 +1,181 @@
+/*
+ * arena.cpp
+ *
+ */
+
+#include "arena.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <new>
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+// nesting depth of ArenaScopes in this thread: heap allocations
+// are counted only inside scopes (render path)
+static thread_local unsigned int scopeDepth = 0;
+
+static std::atomic<unsigned long long> scopeAllocations(0);
+static std::atomic<unsigned long long> scopeBytes(0);
+
+static inline void countAllocation(size_t bytes)
+{
+  if(scopeDepth > 0){
+    scopeAllocations.fetch_add(1, std::memory_order_relaxed);
+    scopeBytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+}
+
+
+AllocationStats renderAllocationStats()
+{
+  AllocationStats s;
+  s.allocations = scopeAllocations.load(std::memory_order_relaxed);
+  s.bytes = scopeBytes.load(std::memory_order_relaxed);
+  return s;
+}
+
+
+FrameArena& FrameArena::local()
+{
+  static thread_local FrameArena arena;
+  return arena;
+}
+
+
+FrameArena::FrameArena()
+{
+  current = 0;
+  offset = 0;
+}
+
+
+FrameArena::~FrameArena()
+{
+  for(auto& b : blocks)
+    free(b.data);
+
+  blocks.clear();
+}
+
+
+void* FrameArena::allocate(size_t bytes, size_t alignment)
+{
+  if(bytes == 0) bytes = 1;
+
+  while(current < blocks.size()){
+    const FrameArena::block& b = blocks[current];
+
+    const uintptr_t base = (uintptr_t)b.data;
+    const size_t start =
+      ((base + offset + alignment - 1) & ~((uintptr_t)alignment - 1)) - base;
+
+    if(start + bytes <= b.size){
+      offset = start + bytes;
+      return b.data + start;
+    }
+
+    // later blocks are free (rewound), too small ones are skipped
+    current++;
+    offset = 0;
+  }
+
+  // the first frames grow the arena until it holds the largest frame
+  const size_t MINBLOCK = 256*1024;
+  size_t size = (blocks.size() > 0) ? 2*blocks.back().size : MINBLOCK;
+  if(size < bytes + alignment) size = bytes + alignment;
+
+  FrameArena::block b;
+  b.data = (char*)malloc(size);
+  b.size = size;
+
+  if(b.data == NULL){
+    logging.fatal("arena: out of memory");
+    throw std::bad_alloc();
+  }
+
+  countAllocation(size);
+
+  blocks.push_back(b);
+  current = blocks.size() - 1;
+  offset = 0;
+
+  return allocate(bytes, alignment);
+}
+
+
+FrameArena::Marker FrameArena::mark() const
+{
+  FrameArena::Marker m;
+  m.block = current;
+  m.offset = offset;
+  return m;
+}
+
+
+void FrameArena::rewind(const FrameArena::Marker& m)
+{
+  current = m.block;
+  offset = m.offset;
+}
+
+
+size_t FrameArena::capacity() const
+{
+  size_t total = 0;
+
+  for(const auto& b : blocks)
+    total += b.size;
+
+  return total;
+}
+
+
+ArenaScope::ArenaScope() : arena(FrameArena::local())
+{
+  marker = arena.mark();
+  scopeDepth++;
+}
+
+
+ArenaScope::~ArenaScope()
+{
+  scopeDepth--;
+  arena.rewind(marker);
+}
+
+
+}
+}
+
+
+// counts heap allocations of the render path, other allocations go
+// directly to malloc(). Array and nothrow forms call these
+void* operator new(size_t size)
+{
+  whiteice::resonanz::countAllocation(size);
+
+  void* p = malloc(size ? size : 1);
+  if(p == NULL) throw std::bad_alloc();
+
+  return p;
+}
+
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+
+void operator delete(void* p, size_t) noexcept
+{
+  free(p);
+}
@@ -0,0 +1,116 @@
+/*
+ * arena.h
+ *
+ * per-thread bump allocator for render temporaries: memory is taken
+ * from the thread's blocks by moving a pointer and everything allocated
+ * inside an ArenaScope is released at once when the scope ends (frame
+ * or scheduler task boundary). Blocks are kept so frames after the first
+ * ones do not touch the heap. Heap allocations (operator new) made inside
+ * arena scopes are counted so render path allocations can be checked
+ *
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+#include <vector>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class FrameArena {
+    public:
+      // arena of the calling thread
+      static FrameArena& local();
+
+      // memory is valid until the innermost enclosing ArenaScope ends,
+      // must not be called outside of scopes (memory would never be released)
+      void* allocate(size_t bytes, size_t alignment = alignof(max_align_t));
+
+      struct Marker {
+	unsigned int block;
+	size_t offset;
+      };
+
+      Marker mark() const;
+      void rewind(const Marker& m); // releases memory allocated after mark()
+
+      // bytes in blocks owned by the arena
+      size_t capacity() const;
+
+      ~FrameArena();
+
+    private:
+      FrameArena();
+
+      FrameArena(const FrameArena&) = delete;
+      FrameArena& operator=(const FrameArena&) = delete;
+
+      struct block {
+	char* data;
+	size_t size;
+      };
+
+      std::vector<FrameArena::block> blocks;
+      unsigned int current; // block allocated from
+      size_t offset;        // used bytes in the current block
+    };
+
+
+    // releases arena memory of the calling thread allocated during the
+    // scope's lifetime, scopes nest (frame scope contains task scopes)
+    class ArenaScope {
+    public:
+      ArenaScope();
+      ~ArenaScope();
+
+      ArenaScope(const ArenaScope&) = delete;
+      ArenaScope& operator=(const ArenaScope&) = delete;
+
+    private:
+      FrameArena& arena;
+      FrameArena::Marker marker;
+    };
+
+
+    // STL allocator for temporaries: deallocation is a no-op, memory is
+    // released by the enclosing ArenaScope of the allocating thread
+    template <typename T>
+    class ArenaAllocator {
+    public:
+      typedef T value_type;
+
+      ArenaAllocator() noexcept { }
+      template <typename U> ArenaAllocator(const ArenaAllocator<U>&) noexcept { }
+
+      T* allocate(size_t n){
+	return (T*)FrameArena::local().allocate(n*sizeof(T), alignof(T));
+      }
+
+      void deallocate(T*, size_t) noexcept { }
+
+      template <typename U>
+      bool operator==(const ArenaAllocator<U>&) const noexcept { return true; }
+      template <typename U>
+      bool operator!=(const ArenaAllocator<U>&) const noexcept { return false; }
+    };
+
+    template <typename T>
+    using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+
+    struct AllocationStats {
+      unsigned long long allocations; // heap allocations inside arena scopes
+      unsigned long long bytes;
+    };
+
+    // totals of all threads since the program started
+    AllocationStats renderAllocationStats();
+
+  }
+}
+
+#endif
@@ -1,12 +1,44 @@
 #!/bin/sh
 
-g++ -O3 -fopenmp -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections SDLAVCodec.cpp
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections SDLAVCodec.cpp
 
-g++ -O3 -fopenmp -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections hermitecurve.cpp
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections SDLAVSegmentEncoder.cpp
 
-g++ -O3 -fopenmp -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections SDLtest.cpp
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections SDLAVLadder.cpp
 
-g++ -fopenmp SDLtest.o SDLAVCodec.o hermitecurve.o -fdata-sections -ffunction-sections -Wl,-gc-sections `pkg-config SDL2 --libs` `pkg-config SDL2_image --libs` `pkg-config SDL2_mixer --libs` `pkg-config SDL2_ttf --libs` `pkg-config dinrhiw --libs` `pkg-config libavcodec --libs` `pkg-config libavformat --libs` `pkg-config libavutil --libs` -o SDLtest
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections SDLAVSpool.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections SDLAVEncoderProcess.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections framering.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections yuvconvert.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections yuvraster.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections rgbraster.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` `pkg-config libavcodec --cflags` `pkg-config libavformat --cflags` `pkg-config libavutil --cflags` -fdata-sections -ffunction-sections framepool.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` -fdata-sections -ffunction-sections hermitecurve.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections renderscale.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections SDLPresenter.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections timeline.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections startup.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections scheduler.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections arena.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections geometrycache.cpp
+
+g++ -O3 -c `pkg-config SDL2 --cflags` `pkg-config SDL2_image --cflags``pkg-config SDL2_mixer --cflags` `pkg-config SDL2_ttf --cflags` `pkg-config dinrhiw --cflags` -fdata-sections -ffunction-sections SDLtest.cpp
+
+g++ -pthread SDLtest.o SDLAVCodec.o SDLAVSegmentEncoder.o SDLAVLadder.o SDLAVSpool.o SDLAVEncoderProcess.o framering.o SDLPresenter.o timeline.o startup.o scheduler.o yuvconvert.o yuvraster.o rgbraster.o arena.o framepool.o hermitecurve.o renderscale.o geometrycache.o -fdata-sections -ffunction-sections -Wl,-gc-sections `pkg-config SDL2 --libs` `pkg-config SDL2_image --libs` `pkg-config SDL2_mixer --libs` `pkg-config SDL2_ttf --libs` `pkg-config dinrhiw --libs` `pkg-config libavcodec --libs` `pkg-config libavformat --libs` `pkg-config libavutil --libs` -lrt -o SDLtest
 
 # strip SDLtest.exe
 
@@ -0,0 +1,94 @@
+/*
+ * damage.h
+ *
+ * damage (changed screen area) tracking: a set of non-overlapping
+ * rectangles of the screen that must be redrawn
+ *
+ */
+
+#ifndef DAMAGE_H_
+#define DAMAGE_H_
+
+#include <SDL.h>
+#include <vector>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class DamageRegion {
+    public:
+      DamageRegion(int width = 0, int height = 0){
+	this->width = width;
+	this->height = height;
+      }
+
+      void resize(int width, int height){
+	this->width = width;
+	this->height = height;
+	dirty.clear();
+      }
+
+      // adds rectangle (clipped to screen) to the damaged area,
+      // overlapping rectangles are merged so that the region never
+      // touches the same pixel twice
+      void add(const SDL_Rect& rect){
+	SDL_Rect screen = { 0, 0, width, height };
+	SDL_Rect r;
+
+	if(SDL_IntersectRect(&rect, &screen, &r) == SDL_FALSE)
+	  return;
+
+	bool merged = true;
+
+	while(merged){
+	  merged = false;
+
+	  for(unsigned int i=0;i<dirty.size();i++){
+	    if(SDL_HasIntersection(&dirty[i], &r)){
+	      SDL_Rect u;
+	      SDL_UnionRect(&dirty[i], &r, &u);
+	      r = u;
+	      dirty.erase(dirty.begin() + i);
+	      merged = true;
+	      break;
+	    }
+	  }
+	}
+
+	dirty.push_back(r);
+      }
+
+      void add(const DamageRegion& region){
+	for(const auto& r : region.dirty)
+	  add(r);
+      }
+
+      void addAll(){
+	dirty.clear();
+	add(SDL_Rect{ 0, 0, width, height });
+      }
+
+      void clear(){ dirty.clear(); }
+
+      bool empty() const { return (dirty.size() == 0); }
+
+      const std::vector<SDL_Rect>& rects() const { return dirty; }
+
+      // total number of damaged pixels
+      unsigned long long area() const {
+	unsigned long long a = 0;
+	for(const auto& r : dirty)
+	  a += ((unsigned long long)r.w)*r.h;
+	return a;
+      }
+
+    private:
+      int width, height;
+      std::vector<SDL_Rect> dirty;
+    };
+
+  }
+}
+
+#endif
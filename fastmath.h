@@ -0,0 +1,204 @@
+/*
+ * fastmath.h
+ *
+ * small fixed size vectors and matrices, Hermite spline and random
+ * number generator for the render path (header only, no allocations).
+ * Replaces dinrhiw's dynamically sized vertex/matrix/hermite/RNG
+ * in curve computations
+ *
+ */
+
+#ifndef FASTMATH_H_
+#define FASTMATH_H_
+
+#include <math.h>
+#include <stdint.h>
+
+
+namespace whiteice {
+  namespace resonanz {
+    namespace fastmath {
+
+      template <typename T, unsigned int N>
+      struct vec {
+	T v[N];
+
+	constexpr T& operator[](unsigned int i){ return v[i]; }
+	constexpr const T& operator[](unsigned int i) const { return v[i]; }
+
+	static constexpr unsigned int size(){ return N; }
+
+	static constexpr vec zero(){
+	  vec r{};
+	  for(unsigned int i=0;i<N;i++) r.v[i] = T(0);
+	  return r;
+	}
+
+	constexpr vec operator+(const vec& b) const {
+	  vec r{};
+	  for(unsigned int i=0;i<N;i++) r.v[i] = v[i] + b.v[i];
+	  return r;
+	}
+
+	constexpr vec operator-(const vec& b) const {
+	  vec r{};
+	  for(unsigned int i=0;i<N;i++) r.v[i] = v[i] - b.v[i];
+	  return r;
+	}
+
+	constexpr vec operator*(const T s) const {
+	  vec r{};
+	  for(unsigned int i=0;i<N;i++) r.v[i] = v[i]*s;
+	  return r;
+	}
+
+	constexpr vec& operator+=(const vec& b){
+	  for(unsigned int i=0;i<N;i++) v[i] += b.v[i];
+	  return *this;
+	}
+
+	constexpr vec& operator-=(const vec& b){
+	  for(unsigned int i=0;i<N;i++) v[i] -= b.v[i];
+	  return *this;
+	}
+
+	constexpr vec& operator*=(const T s){
+	  for(unsigned int i=0;i<N;i++) v[i] *= s;
+	  return *this;
+	}
+
+	constexpr T dot(const vec& b) const {
+	  T s = T(0);
+	  for(unsigned int i=0;i<N;i++) s += v[i]*b.v[i];
+	  return s;
+	}
+      };
+
+      typedef vec<float, 2> vec2;
+      typedef vec<float, 3> vec3;
+      typedef vec<float, 4> vec4;
+
+
+      // row major N x N matrix
+      template <typename T, unsigned int N>
+      struct mat {
+	T m[N][N];
+
+	static constexpr mat identity(){
+	  mat r{};
+	  for(unsigned int j=0;j<N;j++)
+	    for(unsigned int i=0;i<N;i++)
+	      r.m[j][i] = (i == j) ? T(1) : T(0);
+	  return r;
+	}
+
+	constexpr vec<T,N> operator*(const vec<T,N>& x) const {
+	  vec<T,N> r{};
+	  for(unsigned int j=0;j<N;j++){
+	    r.v[j] = T(0);
+	    for(unsigned int i=0;i<N;i++)
+	      r.v[j] += m[j][i]*x.v[i];
+	  }
+	  return r;
+	}
+
+	constexpr mat operator*(const mat& b) const {
+	  mat r{};
+	  for(unsigned int j=0;j<N;j++)
+	    for(unsigned int i=0;i<N;i++){
+	      r.m[j][i] = T(0);
+	      for(unsigned int k=0;k<N;k++)
+		r.m[j][i] += m[j][k]*b.m[k][i];
+	    }
+	  return r;
+	}
+      };
+
+      typedef mat<float, 3> mat3;
+
+
+      // rotation around x, y and z axes (in this order)
+      inline mat3 rotation(const float xr, const float yr, const float zr)
+      {
+	const float cx = cosf(xr), sx = sinf(xr);
+	const float cy = cosf(yr), sy = sinf(yr);
+	const float cz = cosf(zr), sz = sinf(zr);
+
+	const mat3 Rx = {{ { 1.0f, 0.0f, 0.0f }, { 0.0f, cx, -sx }, { 0.0f, sx, cx } }};
+	const mat3 Ry = {{ { cy, 0.0f, sy }, { 0.0f, 1.0f, 0.0f }, { -sy, 0.0f, cy } }};
+	const mat3 Rz = {{ { cz, -sz, 0.0f }, { sz, cz, 0.0f }, { 0.0f, 0.0f, 1.0f } }};
+
+	return Rz*(Ry*Rx);
+      }
+
+
+      // cubic Hermite spline through points (Catmull-Rom tangents) at
+      // parameter t in [0, numPoints-1], integer t is the point t
+      template <typename T, unsigned int N>
+      constexpr vec<T,N> hermiteAt(const vec<T,N>* points, const unsigned int numPoints,
+				   const T t)
+      {
+	unsigned int k = (t > T(0)) ? (unsigned int)t : 0;
+	if(k >= numPoints - 1) k = numPoints - 2;
+
+	const T u = t - T(k);
+	const T u2 = u*u;
+	const T u3 = u2*u;
+
+	const vec<T,N>& p0 = points[k];
+	const vec<T,N>& p1 = points[k+1];
+
+	const vec<T,N> m0 = (k > 0) ?
+	  (points[k+1] - points[k-1])*T(0.5) : (points[1] - points[0]);
+	const vec<T,N> m1 = (k+2 < numPoints) ?
+	  (points[k+2] - points[k])*T(0.5) : (points[k+1] - points[k]);
+
+	return
+	  p0*(T(2)*u3 - T(3)*u2 + T(1)) + m0*(u3 - T(2)*u2 + u) +
+	  p1*(T(-2)*u3 + T(3)*u2) + m1*(u3 - u2);
+      }
+
+
+      // SplitMix64 generator: small state, can be copied and seeded per blob
+      class Random {
+      public:
+	constexpr Random(uint64_t seed = 0x853C49E6748FEA9BULL) : state(seed) { }
+
+	// independent stream number index of the seed: random access to
+	// generated sequences without generating the previous ones
+	constexpr Random(uint64_t seed, uint64_t index) : state(mix(seed ^ mix(index))) { }
+
+	constexpr void seed(uint64_t s){ state = s; }
+
+	constexpr uint64_t next(){
+	  return mix(state += 0x9E3779B97F4A7C15ULL);
+	}
+
+	// SplitMix64 output function (bijective hash)
+	static constexpr uint64_t mix(uint64_t z){
+	  z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+	  z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+	  return z ^ (z >> 31);
+	}
+
+	// [0,1)
+	constexpr float uniform(){
+	  return (float)(next() >> 40)*(1.0f/16777216.0f);
+	}
+
+	// N(0,1) (Box-Muller)
+	float normal(){
+	  const float u1 = 1.0f - uniform(); // (0,1]
+	  const float u2 = uniform();
+	  return sqrtf(-2.0f*logf(u1))*cosf(6.2831853f*u2);
+	}
+
+      private:
+	uint64_t state;
+      };
+
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * framepool.cpp
+ *
+ */
+
+#include "framepool.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+AVFramePool::AVFramePool(int width, int height, int format)
+{
+  frameWidth = width;
+  frameHeight = height;
+  pixelFormat = format;
+  numAllocated = 0;
+}
+
+
+AVFramePool::~AVFramePool()
+{
+  std::lock_guard<std::mutex> lock(pool_mutex);
+
+  for(auto& f : pool)
+    av_frame_free(&f);
+
+  pool.clear();
+}
+
+
+AVFrame* AVFramePool::acquire()
+{
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+
+    // frames whose buffers are still referenced by an encoder are skipped
+    for(auto i = pool.begin(); i != pool.end(); i++){
+      if(av_frame_is_writable(*i)){
+	AVFrame* f = *i;
+	pool.erase(i);
+
+	f->pts = 0;
+	f->pict_type = AV_PICTURE_TYPE_NONE;
+	f->opaque = nullptr;
+
+	return f;
+      }
+    }
+  }
+
+  AVFrame* f = av_frame_alloc();
+  if(f == nullptr) return nullptr;
+
+  f->format = pixelFormat;
+  f->width  = frameWidth;
+  f->height = frameHeight;
+
+  if(av_frame_get_buffer(f, 0) != 0){
+    av_frame_free(&f);
+    return nullptr;
+  }
+
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  numAllocated++;
+
+  return f;
+}
+
+
+void AVFramePool::release(AVFrame* frame)
+{
+  if(frame == nullptr) return;
+
+  // frames of other size (or without buffers) are not reused
+  if(frame->width != frameWidth || frame->height != frameHeight ||
+     frame->format != pixelFormat || frame->buf[0] == nullptr){
+    av_frame_free(&frame);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  pool.push_back(frame);
+}
+
+
+unsigned int AVFramePool::allocated() const
+{
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  return numAllocated;
+}
+
+
+unsigned long long AVFramePool::frameBytes() const
+{
+  const unsigned long long luma = ((unsigned long long)frameWidth)*frameHeight;
+  return luma + 2*(luma/4);
+}
+
+
+}
+}
@@ -0,0 +1,54 @@
+/*
+ * framepool.h
+ *
+ * pool of preallocated YUV420P AVFrames shared between
+ * renderers and encoders so that frame buffers are reused
+ *
+ */
+
+#ifndef FRAMEPOOL_H_
+#define FRAMEPOOL_H_
+
+extern "C" {
+#include <libavutil/frame.h>
+};
+
+#include <list>
+#include <mutex>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class AVFramePool {
+    public:
+      AVFramePool(int width, int height, int format = AV_PIX_FMT_YUV420P);
+      virtual ~AVFramePool();
+
+      // returns writable frame (with undefined picture content) or nullptr
+      AVFrame* acquire();
+
+      // returns frame back to pool, pool keeps the buffers and reuses them
+      // once nobody else (encoder) has a reference to them anymore
+      void release(AVFrame* frame);
+
+      int width() const { return frameWidth; }
+      int height() const { return frameHeight; }
+      int format() const { return pixelFormat; }
+
+      // number of frames allocated (and in use) and bytes per frame
+      unsigned int allocated() const;
+      unsigned long long frameBytes() const;
+
+    private:
+      int frameWidth, frameHeight, pixelFormat;
+
+      mutable std::mutex pool_mutex;
+      std::list<AVFrame*> pool; // released frames
+      unsigned int numAllocated;
+    };
+
+  }
+}
+
+#endif
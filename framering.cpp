@@ -0,0 +1,331 @@
+/*
+ * framering.cpp
+ *
+ */
+
+#include "framering.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include <chrono>
+#include <new>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+// futex words are shared between processes: the atomics must be plain 32bit words
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+	      std::atomic<uint32_t>::is_always_lock_free,
+	      "futex word must be lock free 32bit integer");
+
+
+#ifdef __linux__
+
+// waits while *word == value (at most msecs), not private: word is in shared memory
+static void futex_wait(std::atomic<uint32_t>* word, uint32_t value, long long msecs)
+{
+  struct timespec ts;
+  ts.tv_sec = msecs/1000;
+  ts.tv_nsec = (msecs % 1000)*1000000L;
+
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t>* word)
+{
+  syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif
+
+
+SharedFrameRing::SharedFrameRing()
+{
+  creator = false;
+  memory = nullptr;
+  bytes = 0;
+  h = nullptr;
+}
+
+
+SharedFrameRing::~SharedFrameRing()
+{
+  close();
+}
+
+
+bool SharedFrameRing::create(const std::string& name,
+			     unsigned int width, unsigned int height, unsigned int pitch,
+			     Uint32 rmask, Uint32 gmask, Uint32 bmask,
+			     unsigned int numSlots)
+{
+#ifdef __linux__
+  if(memory) return false;
+  if(width == 0 || height == 0 || pitch < 4*width || numSlots == 0) return false;
+
+  // slot index is the frame counter modulo slots: power of two
+  // keeps the mapping continuous when the counters wrap around
+  unsigned int slots = 1;
+  while(slots < numSlots) slots *= 2;
+
+  const size_t PAGE = 4096;
+  const size_t slotBytes =
+    ((PIXELS_OFFSET + (size_t)pitch*height + PAGE - 1)/PAGE)*PAGE;
+  const size_t total = HEADER_BYTES + slots*slotBytes;
+
+  const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+  if(fd < 0){
+    logging.error("frame ring: cannot create shared memory");
+    return false;
+  }
+
+  if(ftruncate(fd, total) != 0){
+    logging.error("frame ring: cannot allocate shared memory");
+    ::close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if(memory == MAP_FAILED){
+    logging.error("frame ring: cannot map shared memory");
+    memory = nullptr;
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  this->name = name;
+  this->creator = true;
+  this->bytes = total;
+
+  h = new (memory) SharedFrameRing::header;
+  h->width = width;
+  h->height = height;
+  h->pitch = pitch;
+  h->rmask = rmask;
+  h->gmask = gmask;
+  h->bmask = bmask;
+  h->numSlots = slots;
+  h->slotBytes = slotBytes;
+  h->written = 0;
+  h->released = 0;
+
+  std::atomic_thread_fence(std::memory_order_release);
+  h->magic = MAGIC; // consumer checks the ring is initialized
+
+  return true;
+#else
+  logging.error("frame ring: shared memory frame ring is not supported on this platform");
+  return false;
+#endif
+}
+
+
+bool SharedFrameRing::attach(const std::string& name)
+{
+#ifdef __linux__
+  if(memory) return false;
+
+  const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+  if(fd < 0){
+    logging.error("frame ring: cannot open shared memory");
+    return false;
+  }
+
+  struct stat st;
+
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < HEADER_BYTES){
+    logging.error("frame ring: shared memory is not a frame ring");
+    ::close(fd);
+    return false;
+  }
+
+  memory = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+
+  if(memory == MAP_FAILED){
+    logging.error("frame ring: cannot map shared memory");
+    memory = nullptr;
+    return false;
+  }
+
+  this->name = name;
+  this->creator = false;
+  this->bytes = st.st_size;
+
+  h = (SharedFrameRing::header*)memory;
+
+  if(h->magic != MAGIC || HEADER_BYTES + h->numSlots*h->slotBytes > bytes){
+    logging.error("frame ring: shared memory is not a frame ring");
+    close();
+    return false;
+  }
+
+  std::atomic_thread_fence(std::memory_order_acquire);
+
+  return true;
+#else
+  logging.error("frame ring: shared memory frame ring is not supported on this platform");
+  return false;
+#endif
+}
+
+
+void SharedFrameRing::close()
+{
+#ifdef __linux__
+  if(memory){
+    munmap(memory, bytes);
+    if(creator) shm_unlink(name.c_str());
+  }
+#endif
+
+  memory = nullptr;
+  bytes = 0;
+  h = nullptr;
+  creator = false;
+}
+
+
+int SharedFrameRing::acquireSlot(unsigned int timeoutMsecs)
+{
+#ifdef __linux__
+  if(h == nullptr) return -1;
+
+  const auto deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMsecs);
+
+  while(1){
+    const uint32_t released = h->released.load(std::memory_order_acquire);
+    const uint32_t written = h->written.load(std::memory_order_relaxed);
+
+    if(written - released < h->numSlots)
+      return written % h->numSlots;
+
+    const long long left = std::chrono::duration_cast<std::chrono::milliseconds>
+      (deadline - std::chrono::steady_clock::now()).count();
+
+    if(left <= 0) return -1;
+
+    futex_wait(&h->released, released, left);
+  }
+#else
+  return -1;
+#endif
+}
+
+
+void SharedFrameRing::publish()
+{
+#ifdef __linux__
+  if(h == nullptr) return;
+
+  h->written.fetch_add(1, std::memory_order_release);
+  futex_wake(&h->written);
+#endif
+}
+
+
+void SharedFrameRing::reset()
+{
+#ifdef __linux__
+  if(h == nullptr) return;
+
+  h->released.store(h->written.load(std::memory_order_relaxed), std::memory_order_release);
+  futex_wake(&h->released);
+#endif
+}
+
+
+int SharedFrameRing::waitFrame(unsigned int timeoutMsecs)
+{
+#ifdef __linux__
+  if(h == nullptr) return -1;
+
+  const auto deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMsecs);
+
+  while(1){
+    const uint32_t written = h->written.load(std::memory_order_acquire);
+    const uint32_t released = h->released.load(std::memory_order_relaxed);
+
+    if(written != released)
+      return released % h->numSlots;
+
+    const long long left = std::chrono::duration_cast<std::chrono::milliseconds>
+      (deadline - std::chrono::steady_clock::now()).count();
+
+    if(left <= 0) return -1;
+
+    futex_wait(&h->written, written, left);
+  }
+#else
+  return -1;
+#endif
+}
+
+
+void SharedFrameRing::release()
+{
+#ifdef __linux__
+  if(h == nullptr) return;
+
+  h->released.fetch_add(1, std::memory_order_release);
+  futex_wake(&h->released);
+#endif
+}
+
+
+Uint8* SharedFrameRing::pixels(unsigned int slot)
+{
+  if(h == nullptr || slot >= h->numSlots) return nullptr;
+  return ((Uint8*)memory) + HEADER_BYTES + slot*h->slotBytes + PIXELS_OFFSET;
+}
+
+
+SharedFrameRing::FrameInfo* SharedFrameRing::info(unsigned int slot)
+{
+  if(h == nullptr || slot >= h->numSlots) return nullptr;
+  return (SharedFrameRing::FrameInfo*)(((Uint8*)memory) + HEADER_BYTES + slot*h->slotBytes);
+}
+
+
+unsigned int SharedFrameRing::getSlots() const { return h ? h->numSlots : 0; }
+unsigned int SharedFrameRing::getWidth() const { return h ? h->width : 0; }
+unsigned int SharedFrameRing::getHeight() const { return h ? h->height : 0; }
+unsigned int SharedFrameRing::getPitch() const { return h ? h->pitch : 0; }
+
+
+void SharedFrameRing::getMasks(Uint32& rmask, Uint32& gmask, Uint32& bmask) const
+{
+  rmask = h ? h->rmask : 0;
+  gmask = h ? h->gmask : 0;
+  bmask = h ? h->bmask : 0;
+}
+
+
+unsigned int SharedFrameRing::queued() const
+{
+  if(h == nullptr) return 0;
+  return h->written.load(std::memory_order_relaxed) - h->released.load(std::memory_order_relaxed);
+}
+
+
+}
+}
@@ -0,0 +1,114 @@
+/*
+ * framering.h
+ *
+ * single producer, single consumer ring of preallocated frame slots in
+ * POSIX shared memory for passing frames between processes: the producer
+ * writes pixels directly into a free slot and publishes it, the consumer
+ * reads the slot in place and releases it. Waiting is done with futexes
+ * on the ring's frame counters (Linux only)
+ *
+ */
+
+#ifndef FRAMERING_H_
+#define FRAMERING_H_
+
+#include <SDL.h>
+#include <stdint.h>
+
+#include <string>
+#include <atomic>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class SharedFrameRing {
+    public:
+      SharedFrameRing();
+      virtual ~SharedFrameRing();
+
+      // producer: creates shared memory object name ("/name") holding numSlots
+      // frames of height rows of pitch bytes (32bit pixels with given masks)
+      bool create(const std::string& name,
+		  unsigned int width, unsigned int height, unsigned int pitch,
+		  Uint32 rmask, Uint32 gmask, Uint32 bmask,
+		  unsigned int numSlots);
+
+      // consumer: maps ring created by another process
+      bool attach(const std::string& name);
+
+      // unmaps ring, the creator also removes the shared memory object
+      void close();
+
+      static const unsigned int MAX_RECTS = 32;
+
+      // written by the producer into slot before publishing it
+      struct FrameInfo {
+	uint64_t msecs;
+	uint32_t keyframe;   // scene cut hint
+	uint32_t last;       // producer stops: consumer finishes after this frame
+	uint32_t fullDamage; // whole picture changed (rects are not used)
+	uint32_t numRects;   // damaged area
+	SDL_Rect rects[MAX_RECTS];
+      };
+
+      // producer: index of the next free slot or -1 if the consumer has not
+      // released one within timeoutMsecs (0 = does not wait)
+      int acquireSlot(unsigned int timeoutMsecs);
+
+      // producer: hands the acquired slot over to the consumer
+      void publish();
+
+      // producer: drops frames not yet released after consumer has died
+      void reset();
+
+      // consumer: index of the next published slot or -1 on timeout
+      int waitFrame(unsigned int timeoutMsecs);
+
+      // consumer: gives the slot returned by waitFrame() back to the producer
+      void release();
+
+      Uint8* pixels(unsigned int slot);
+      SharedFrameRing::FrameInfo* info(unsigned int slot);
+
+      const std::string& getName() const { return name; }
+      unsigned int getSlots() const;
+      unsigned int getWidth() const;
+      unsigned int getHeight() const;
+      unsigned int getPitch() const;
+      void getMasks(Uint32& rmask, Uint32& gmask, Uint32& bmask) const;
+
+      // published frames not yet released by the consumer
+      unsigned int queued() const;
+
+    private:
+      // at the start of the shared memory, slots follow it
+      struct header {
+	uint32_t magic;
+	uint32_t width, height, pitch;
+	uint32_t rmask, gmask, bmask;
+	uint32_t numSlots;
+	uint64_t slotBytes; // FrameInfo and pixels (page aligned)
+
+	// futex words: frames published and released since the start
+	// (wrap around), written - released is the number of queued frames
+	std::atomic<uint32_t> written;
+	std::atomic<uint32_t> released;
+      };
+
+      static const uint32_t MAGIC = 0x52494E47; // "RING"
+      static const size_t HEADER_BYTES = 4096;
+      static const size_t PIXELS_OFFSET = 4096; // from the start of slot
+
+      std::string name;
+      bool creator;
+
+      void* memory;
+      size_t bytes;
+      SharedFrameRing::header* h;
+    };
+
+  }
+}
+
+#endif
@@ -0,0 +1,277 @@
+/*
+ * geometrycache.cpp
+ *
+ */
+
+#include "geometrycache.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+namespace whiteice {
+namespace resonanz {
+
+static const char GEOMETRY_MAGIC[8] = { 'C', 'H', 'R', 'M', 'G', 'E', 'O', '1' };
+static const uint32_t GEOMETRY_VERSION = 1;
+
+static const unsigned int HEADER_SIZE = 8 + 4 + 4 + 8 + 8;
+static const unsigned int ENTRY_SIZE = 8 + 4 + 4;
+
+
+GeometryBaker::GeometryBaker()
+{
+  handle = NULL;
+  numBlobs = 0;
+  offset = 0;
+}
+
+
+GeometryBaker::~GeometryBaker()
+{
+  if(handle) close();
+}
+
+
+bool GeometryBaker::open(const std::string& filename, unsigned int numBlobs)
+{
+  if(handle || numBlobs == 0) return false;
+
+  handle = fopen(filename.c_str(), "wb");
+  if(handle == NULL) return false;
+
+  this->numBlobs = numBlobs;
+  index.clear();
+
+  // header is written when the index location is known
+  uint8_t header[HEADER_SIZE];
+  memset(header, 0, HEADER_SIZE);
+
+  if(fwrite(header, HEADER_SIZE, 1, handle) != 1){
+    fclose(handle);
+    handle = NULL;
+    return false;
+  }
+
+  offset = HEADER_SIZE;
+
+  return true;
+}
+
+
+bool GeometryBaker::addBlob(const std::vector<SDL_Point>& polyline, const SDL_Color& color)
+{
+  if(handle == NULL) return false;
+
+  std::vector<int16_t> points(2*polyline.size());
+
+  for(unsigned int i=0;i<polyline.size();i++){
+    int x = polyline[i].x, y = polyline[i].y;
+
+    if(x < -32767) x = -32767; else if(x > 32767) x = 32767;
+    if(y < -32767) y = -32767; else if(y > 32767) y = 32767;
+
+    points[2*i+0] = (int16_t)x;
+    points[2*i+1] = (int16_t)y;
+  }
+
+  if(points.size() > 0)
+    if(fwrite(points.data(), sizeof(int16_t), points.size(), handle) != points.size())
+      return false;
+
+  GeometryBaker::entry e;
+  e.offset = offset;
+  e.points = (uint32_t)polyline.size();
+  e.color[0] = color.r;
+  e.color[1] = color.g;
+  e.color[2] = color.b;
+  e.color[3] = color.a;
+
+  index.push_back(e);
+  offset += points.size()*sizeof(int16_t);
+
+  return true;
+}
+
+
+bool GeometryBaker::close()
+{
+  if(handle == NULL) return false;
+
+  bool ok = true;
+
+  // incomplete last frame is not part of the file
+  const uint64_t frames = index.size()/numBlobs;
+
+  for(uint64_t i=0;i<frames*numBlobs && ok;i++){
+    uint8_t e[ENTRY_SIZE];
+    memcpy(e + 0, &index[i].offset, 8);
+    memcpy(e + 8, &index[i].points, 4);
+    memcpy(e + 12, index[i].color, 4);
+
+    ok = (fwrite(e, ENTRY_SIZE, 1, handle) == 1);
+  }
+
+  uint8_t header[HEADER_SIZE];
+  memcpy(header + 0, GEOMETRY_MAGIC, 8);
+  memcpy(header + 8, &GEOMETRY_VERSION, 4);
+  memcpy(header + 12, &numBlobs, 4);
+  memcpy(header + 16, &frames, 8);
+  memcpy(header + 24, &offset, 8);
+
+  if(ok) ok = (fseek(handle, 0, SEEK_SET) == 0);
+  if(ok) ok = (fwrite(header, HEADER_SIZE, 1, handle) == 1);
+
+  if(fclose(handle) != 0) ok = false;
+  handle = NULL;
+  index.clear();
+
+  return ok;
+}
+
+
+GeometryCache::GeometryCache()
+{
+  data = NULL;
+  size = 0;
+  numFrames = 0;
+  numBlobs = 0;
+  index = NULL;
+
+#ifdef _WIN32
+  file = INVALID_HANDLE_VALUE;
+  mapping = NULL;
+#else
+  fd = -1;
+#endif
+}
+
+
+GeometryCache::~GeometryCache()
+{
+  close();
+}
+
+
+bool GeometryCache::open(const std::string& filename)
+{
+  close();
+
+#ifdef _WIN32
+  file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		     OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(file == INVALID_HANDLE_VALUE) return false;
+
+  LARGE_INTEGER fileSize;
+  if(GetFileSizeEx(file, &fileSize) == 0){ close(); return false; }
+  size = fileSize.QuadPart;
+
+  if(size < HEADER_SIZE){ close(); return false; }
+
+  mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if(mapping == NULL){ close(); return false; }
+
+  data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if(data == NULL){ close(); return false; }
+#else
+  fd = ::open(filename.c_str(), O_RDONLY);
+  if(fd < 0) return false;
+
+  struct stat st;
+  if(fstat(fd, &st) != 0){ close(); return false; }
+  size = st.st_size;
+
+  if(size < HEADER_SIZE){ close(); return false; }
+
+  void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if(p == MAP_FAILED){ close(); return false; }
+  data = (const uint8_t*)p;
+#endif
+
+  uint32_t version = 0;
+  uint64_t frames = 0, indexOffset = 0;
+
+  memcpy(&version, data + 8, 4);
+  memcpy(&numBlobs, data + 12, 4);
+  memcpy(&frames, data + 16, 8);
+  memcpy(&indexOffset, data + 24, 8);
+
+  if(memcmp(data, GEOMETRY_MAGIC, 8) != 0 || version != GEOMETRY_VERSION ||
+     numBlobs == 0 || indexOffset > size ||
+     (size - indexOffset)/ENTRY_SIZE/numBlobs < frames){
+    close();
+    return false;
+  }
+
+  numFrames = frames;
+  index = data + indexOffset;
+
+  return true;
+}
+
+
+void GeometryCache::close()
+{
+#ifdef _WIN32
+  if(data) UnmapViewOfFile(data);
+  if(mapping) CloseHandle(mapping);
+  if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+
+  mapping = NULL;
+  file = INVALID_HANDLE_VALUE;
+#else
+  if(data) munmap((void*)data, size);
+  if(fd >= 0) ::close(fd);
+
+  fd = -1;
+#endif
+
+  data = NULL;
+  size = 0;
+  numFrames = 0;
+  numBlobs = 0;
+  index = NULL;
+}
+
+
+bool GeometryCache::getBlob(unsigned long long frame, unsigned int blob,
+			    const int width, const int height,
+			    std::vector<SDL_Point>& polyline, SDL_Color& color) const
+{
+  if(data == NULL || frame >= numFrames || blob >= numBlobs)
+    return false;
+
+  const uint8_t* e = index + (frame*numBlobs + blob)*ENTRY_SIZE;
+
+  uint64_t offset = 0;
+  uint32_t points = 0;
+  memcpy(&offset, e + 0, 8);
+  memcpy(&points, e + 8, 4);
+
+  if(offset < HEADER_SIZE || offset > size || (size - offset)/4 < points)
+    return false;
+
+  color = SDL_Color{ e[12], e[13], e[14], e[15] };
+
+  const int16_t* p = (const int16_t*)(data + offset);
+
+  polyline.resize(points);
+
+  for(unsigned int i=0;i<points;i++){
+    polyline[i].x = (p[2*i+0]*width)/GEOMETRY_SCALE;
+    polyline[i].y = (p[2*i+1]*height)/GEOMETRY_SCALE;
+  }
+
+  return true;
+}
+
+
+}
+}
@@ -0,0 +1,98 @@
+/*
+ * geometrycache.h
+ *
+ * baked blob geometry: projected polylines and fill colours of every
+ * blob in every frame are written into a binary file which is later
+ * memory mapped and replayed without computing the curves again
+ *
+ * file format (little endian):
+ *   header: magic "CHRMGEO1", uint32 version, uint32 blobs,
+ *           uint64 frames, uint64 index offset
+ *   points: int16 x, y pairs in GEOMETRY_SCALE x GEOMETRY_SCALE screen
+ *   index:  frames*blobs entries of uint64 offset, uint32 points, uint8 rgba[4]
+ *
+ */
+
+#ifndef GEOMETRYCACHE_H_
+#define GEOMETRYCACHE_H_
+
+#include <SDL.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    // baked coordinates are for screen of this size (resolution independent)
+    const int GEOMETRY_SCALE = 8192;
+
+    class GeometryBaker {
+    public:
+      GeometryBaker();
+      virtual ~GeometryBaker();
+
+      bool open(const std::string& filename, unsigned int numBlobs);
+
+      // adds blob's polyline (GEOMETRY_SCALE screen coordinates) to the
+      // current frame, a frame is complete when all of its blobs are added
+      bool addBlob(const std::vector<SDL_Point>& polyline, const SDL_Color& color);
+
+      // writes index and header and closes the file
+      bool close();
+
+      unsigned long long frames() const { return index.size()/(numBlobs ? numBlobs : 1); }
+
+    private:
+      struct entry {
+	uint64_t offset;
+	uint32_t points;
+	uint8_t color[4];
+      };
+
+      FILE* handle;
+      unsigned int numBlobs;
+      uint64_t offset;
+      std::vector<GeometryBaker::entry> index;
+    };
+
+
+    class GeometryCache {
+    public:
+      GeometryCache();
+      virtual ~GeometryCache();
+
+      // memory maps baked geometry file
+      bool open(const std::string& filename);
+      void close();
+
+      unsigned long long frames() const { return numFrames; }
+      unsigned int blobs() const { return numBlobs; }
+
+      // blob's polyline in frame scaled to width x height screen (thread safe)
+      bool getBlob(unsigned long long frame, unsigned int blob,
+		   const int width, const int height,
+		   std::vector<SDL_Point>& polyline, SDL_Color& color) const;
+
+    private:
+      const uint8_t* data;
+      unsigned long long size;
+
+      unsigned long long numFrames;
+      unsigned int numBlobs;
+      const uint8_t* index;
+
+#ifdef _WIN32
+      void* file;
+      void* mapping;
+#else
+      int fd;
+#endif
+    };
+
+  }
+}
+
+#endif
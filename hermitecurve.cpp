@@ -1,102 +1,161 @@
 
 #include "hermitecurve.h"
-#include <dinrhiw.h>
+#include "arena.h"
+#include <math.h>
 #include <vector>
+#include <algorithm>
 
-using namespace whiteice;;
+using namespace whiteice::resonanz;
 
 
-void createHermiteCurve(std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > >& samples,
-			std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > > points,
-			double noise_stdev, // 0.02
-			// const unsigned int NPOINTS, const unsigned int DIMENSION,
-			const unsigned int NSAMPLES)
+// distance of point p from line segment a-b
+static float segmentDistance(const fastmath::vec2& p,
+			     const fastmath::vec2& a, const fastmath::vec2& b)
 {
-  // const unsigned int NPOINTS = 5;
-  // const unsigned int DIMENSION = 2;
-  // const unsigned int NSAMPLES = 10000; // 10.000 samples
-	
+  const fastmath::vec2 ab = b - a;
+  const fastmath::vec2 ap = p - a;
+
+  const float len2 = ab.dot(ab);
+  float u = (len2 > 0.0f) ? ap.dot(ab)/len2 : 0.0f;
+
+  if(u < 0.0f) u = 0.0f;
+  else if(u > 1.0f) u = 1.0f;
+
+  const fastmath::vec2 d = ap - ab*u;
+  return sqrtf(d.dot(d));
+}
+
+
+void createAdaptiveHermiteCurve(std::vector<fastmath::vec3>& samples,
+				const fastmath::vec3* points,
+				const unsigned int NPOINTS,
+				const std::function<fastmath::vec2(const fastmath::vec3&)>& project,
+				const float tolerance,
+				const unsigned int maxSamples)
+{
+  if(NPOINTS <= 2) return; // need at least 2 points to interpolate between
+
+  // temporaries are taken from the calling thread's frame arena
+  ArenaVector<fastmath::vec3> normalized(NPOINTS);
+
+  {
+    // normalization to zero mean and unit variance is an affine mapping
+    // which can be applied to the control points instead of the samples
+    const unsigned int NSTATS = 64;
+    fastmath::vec3 m = fastmath::vec3::zero();
+    fastmath::vec3 v = fastmath::vec3::zero();
+
+    for(unsigned int s=0;s<NSTATS;s++){
+      const fastmath::vec3 x =
+	fastmath::hermiteAt(points, NPOINTS, (s*(NPOINTS - 1.0f))/(NSTATS - 1));
+      m += x;
+
+      for(unsigned int i=0;i<x.size();i++)
+	v[i] += x[i]*x[i];
+    }
+
+    m *= 1.0f/NSTATS;
+    v *= 1.0f/NSTATS;
+
+    for(unsigned int i=0;i<m.size();i++){
+      v[i] -= m[i]*m[i];
+      v[i] = v[i] > 0.0f ? sqrtf(v[i]) : 1.0f; // st.dev.
+      v[i] = 1.0f/v[i];
+    }
+
+    for(unsigned int j=0;j<NPOINTS;j++){
+      normalized[j] = points[j] - m;
+
+      for(unsigned int i=0;i<m.size();i++)
+	normalized[j][i] *= v[i];
+    }
+  }
+
+  const fastmath::vec3* p = normalized.data();
+
+  struct span {
+    float t0, t1;
+    fastmath::vec3 p0;     // curve at t0
+    fastmath::vec2 s0, s1; // projected end points
+    float error;           // screen distance of the curve from the chord
+  };
+
+  // error is measured at thirds of the span so that S-shaped
+  // spans whose midpoint is on the chord are subdivided too
+  auto makeSpan = [&](float t0, float t1, const fastmath::vec3& p0,
+		      const fastmath::vec2& s0, const fastmath::vec2& s1)
   {
-    // std::cout << "Generating d-dimensional curve dataset for learning.." << std::endl;
-
-    if(points.size() <= 2) return; // need at least 2 points to interpolate between
-    
-    // pick N random points from DIMENSION dimensional space [-10,10]^D (initially N=5, DIMENSION=2)
-    // calculate hermite curve interpolation between N points and generate data
-    // add random noise N(0,1) to the spline to generate distribution
-    // target is then to learn spline curve distribution
-    
-    {
-      whiteice::math::hermite< math::vertex< math::blas_real<double> >, math::blas_real<double> > curve;
-      whiteice::RNG< whiteice::math::blas_real<double> > rng;
-      
-      // std::vector< whiteice::math::vertex< math::blas_real<double> > > points;
-
-      curve.calculate(points, (int)NSAMPLES);
-      samples.clear();
-
-      for(unsigned s=0;s<NSAMPLES;s++){
-	auto& m = curve[s];
-	auto  n = m;
-	rng.normal(n);
-	whiteice::math::blas_real<double> stdev = noise_stdev*rng.uniform();
-	n = m + n*stdev;
-
-	samples.push_back(n);
-      }
+    span sp = { t0, t1, p0, s0, s1, 0.0f };
+
+    for(unsigned int k=1;k<=2;k++){
+      const fastmath::vec2 s =
+	project(fastmath::hermiteAt(p, NPOINTS, t0 + (t1 - t0)*k/3.0f));
+      const float e = segmentDistance(s, s0, s1);
+      if(e > sp.error) sp.error = e;
     }
 
-    {
-      // normalizes mean and variance for each dimension
-      whiteice::math::vertex< whiteice::math::blas_real<double> > m, v;
-      const unsigned int DIMENSION = points[0].size();
-      m.resize(DIMENSION);
-      v.resize(DIMENSION);
-      m.zero();
-      v.zero();
-
-      for(unsigned int s=0;s<NSAMPLES;s++){
-	auto x = samples[s];
-	m += x;
-	
-	for(unsigned int i=0;i<x.size();i++)
-	  v[i] += x[i]*x[i];
-      }
-      
-      m /= NSAMPLES;
-      v /= NSAMPLES;
-
-      for(unsigned int i=0;i<m.size();i++){
-	v[i] -= m[i]*m[i];
-	v[i] = sqrt(v[i]); // st.dev.
-      }
-
-      // normalizes mean to be zero and st.dev. / variance to be one
-      for(unsigned int s=0;s<NSAMPLES;s++){
-	auto x = samples[s];
-	x -= m;
-	
-	for(unsigned int i=0;i<x.size();i++)
-	  x[i] /= v[i];
-	
-	samples[s] = x;
-#if 0
-	auto& n    = samples[s];
-	auto  z0   = n[2];
-	z0         = 2.0;
-
-	if(n[2] != 0.0){
-	  n[0] = n[0] / (z0 + n[2]);
-	  n[1] = n[1] / (z0 + n[2]);
-	  n.resize(2);
-	}
-#endif
-      }
-
-      
+    return sp;
+  };
+
+  auto largerError = [](const span& a, const span& b){ return a.error < b.error; };
+
+  ArenaVector<span> spans;
+  spans.reserve(maxSamples + 1); // heap never grows past this
+
+  const float T = (float)(NPOINTS - 1);
+
+  // starts from two segments per control point interval
+  unsigned int initial = 2*(NPOINTS - 1);
+  if(maxSamples < initial + 1)
+    initial = (maxSamples > 2) ? maxSamples - 1 : 1;
+
+  {
+    float t0 = 0.0f;
+    fastmath::vec3 p0 = p[0];
+    fastmath::vec2 s0 = project(p0);
+
+    for(unsigned int k=1;k<=initial;k++){
+      const float t1 = (k*T)/initial;
+      const fastmath::vec3 p1 = fastmath::hermiteAt(p, NPOINTS, t1);
+      const fastmath::vec2 s1 = project(p1);
+
+      spans.push_back(makeSpan(t0, t1, p0, s0, s1));
+
+      t0 = t1;
+      p0 = p1;
+      s0 = s1;
     }
+  }
+
+  std::make_heap(spans.begin(), spans.end(), largerError);
+
+  unsigned int count = initial + 1;
+
+  while(count < maxSamples && spans.front().error > tolerance){
+    std::pop_heap(spans.begin(), spans.end(), largerError);
+    const span sp = spans.back();
+    spans.pop_back();
+
+    const float tm = 0.5f*(sp.t0 + sp.t1);
+    const fastmath::vec3 pm = fastmath::hermiteAt(p, NPOINTS, tm);
+    const fastmath::vec2 sm = project(pm);
+
+    spans.push_back(makeSpan(sp.t0, tm, sp.p0, sp.s0, sm));
+    std::push_heap(spans.begin(), spans.end(), largerError);
 
-    // saveSamples("splinecurve.txt", samples);
+    spans.push_back(makeSpan(tm, sp.t1, pm, sm, sp.s1));
+    std::push_heap(spans.begin(), spans.end(), largerError);
+
+    count++;
   }
-  
+
+  std::sort(spans.begin(), spans.end(),
+	    [](const span& a, const span& b){ return a.t0 < b.t0; });
+
+  samples.resize(spans.size() + 1);
+
+  for(unsigned int i=0;i<spans.size();i++)
+    samples[i] = spans[i].p0;
+
+  samples[spans.size()] = p[NPOINTS - 1];
 }
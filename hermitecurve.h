@@ -2,13 +2,22 @@
 #define __hermitecurve_h
 
 #include <vector>
-#include <dinrhiw.h>
+#include <functional>
+#include "fastmath.h"
 
-void createHermiteCurve(std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > >& samples,
-			std::vector< whiteice::math::vertex< whiteice::math::blas_real<double> > > points,
-			double noise_stdev,
-			// const unsigned int NPOINTS, const unsigned int DIMENSION,
-			const unsigned int NSAMPLES);
+// samples Hermite curve going through points, normalized to zero mean and
+// unit variance in each dimension, adaptively:
+// segments are subdivided until the curve projected to the screen (project()
+// returns pixel coordinates) is within tolerance pixels of the polyline,
+// largest errors first until maxSamples samples have been used. Temporaries
+// are allocated from FrameArena: must be called inside an ArenaScope
+void createAdaptiveHermiteCurve(std::vector<whiteice::resonanz::fastmath::vec3>& samples,
+				const whiteice::resonanz::fastmath::vec3* points,
+				const unsigned int NPOINTS,
+				const std::function<whiteice::resonanz::fastmath::vec2
+				(const whiteice::resonanz::fastmath::vec3&)>& project,
+				const float tolerance,
+				const unsigned int maxSamples);
 
 #endif
 
@@ -0,0 +1,133 @@
+/*
+ * raster.h
+ *
+ * scan conversion shared by the YUV and RGB canvases: polygons are
+ * converted into horizontal spans and polylines into pixels, the
+ * canvas only writes the pixels (header only). Scratch memory comes
+ * from FrameArena: call inside an ArenaScope
+ *
+ */
+
+#ifndef RASTER_H_
+#define RASTER_H_
+
+#include <SDL.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include <vector>
+#include <algorithm>
+
+#include "arena.h"
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    // calls span(y, x0, x1) for pixels [x0,x1) of row y inside closed polygon
+    // (non-zero winding rule, pixel centers are sampled) and clip rectangle
+    template <typename Span>
+    void polygonSpans(const std::vector<SDL_Point>& polygon, const SDL_Rect& clip,
+		      Span span)
+    {
+      if(polygon.size() < 3 || clip.w <= 0 || clip.h <= 0) return;
+
+      struct edge { int y0, y1; SDL_Point p0, p1; };
+      struct crossing { double x; int winding; };
+
+      // from the calling thread's frame arena (released by the enclosing ArenaScope)
+      ArenaVector<edge> edges;
+      edges.reserve(polygon.size());
+
+      // only edges crossing the rows of the clip rectangle are scanned
+      for(unsigned int i=0;i<polygon.size();i++){
+	const SDL_Point& p0 = polygon[i];
+	const SDL_Point& p1 = polygon[(i+1) % polygon.size()];
+
+	if(p0.y == p1.y) continue;
+
+	const SDL_Point& top = (p0.y < p1.y) ? p0 : p1;
+	const SDL_Point& bottom = (p0.y < p1.y) ? p1 : p0;
+
+	if(bottom.y <= clip.y || top.y >= clip.y + clip.h) continue;
+
+	edges.push_back(edge{ top.y, bottom.y, p0, p1 });
+      }
+
+      if(edges.size() == 0) return;
+
+      ArenaVector<crossing> crossings;
+      crossings.reserve(edges.size());
+
+      for(int y=clip.y;y<clip.y+clip.h;y++){
+	const double yc = y + 0.5; // samples at pixel centers
+
+	crossings.clear();
+
+	for(const auto& e : edges){
+	  if(e.y0 <= yc && yc < e.y1){
+	    const double x = e.p0.x + (yc - e.p0.y)*(e.p1.x - e.p0.x)/(double)(e.p1.y - e.p0.y);
+	    crossings.push_back(crossing{ x, (e.p1.y > e.p0.y) ? 1 : -1 });
+	  }
+	}
+
+	std::sort(crossings.begin(), crossings.end(),
+		  [](const crossing& a, const crossing& b){ return a.x < b.x; });
+
+	int winding = 0;
+
+	for(unsigned int i=0;i+1<crossings.size();i++){
+	  winding += crossings[i].winding;
+	  if(winding == 0) continue;
+
+	  int x0 = (int)ceil(crossings[i].x - 0.5);
+	  int x1 = (int)ceil(crossings[i+1].x - 0.5);
+
+	  if(x0 < clip.x) x0 = clip.x;
+	  if(x1 > clip.x + clip.w) x1 = clip.x + clip.w;
+
+	  if(x0 < x1) span(y, x0, x1);
+	}
+      }
+    }
+
+
+    // calls plot(x, y) for pixels of one pixel wide closed polyline inside clip rectangle
+    template <typename Plot>
+    void polylinePixels(const std::vector<SDL_Point>& polyline, const SDL_Rect& clip,
+			Plot plot)
+    {
+      if(clip.w <= 0 || clip.h <= 0) return;
+
+      for(unsigned int i=0;i<polyline.size();i++){
+	const SDL_Point& p0 = polyline[(i + polyline.size() - 1) % polyline.size()];
+	const SDL_Point& p1 = polyline[i];
+
+	// segments outside of the clip rectangle are skipped
+	if(std::max(p0.x, p1.x) < clip.x || std::min(p0.x, p1.x) >= clip.x + clip.w ||
+	   std::max(p0.y, p1.y) < clip.y || std::min(p0.y, p1.y) >= clip.y + clip.h)
+	  continue;
+
+	// bresenham
+	int x = p0.x, y = p0.y;
+	const int dx = abs(p1.x - p0.x), sx = (p0.x < p1.x) ? 1 : -1;
+	const int dy = -abs(p1.y - p0.y), sy = (p0.y < p1.y) ? 1 : -1;
+	int err = dx + dy;
+
+	while(1){
+	  if(x >= clip.x && y >= clip.y && x < clip.x + clip.w && y < clip.y + clip.h)
+	    plot(x, y);
+
+	  if(x == p1.x && y == p1.y) break;
+
+	  const int e2 = 2*err;
+	  if(e2 >= dy){ err += dy; x += sx; }
+	  if(e2 <= dx){ err += dx; y += sy; }
+	}
+      }
+    }
+
+  }
+}
+
+#endif
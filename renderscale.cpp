@@ -0,0 +1,164 @@
+/*
+ * renderscale.cpp
+ *
+ */
+
+#include "renderscale.h"
+#include "scheduler.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+void upscaleBilinear(const SDL_Surface* src, SDL_Surface* dst, const SDL_Rect& dstRect)
+{
+  const int sw = src->w, sh = src->h;
+  if(sw < 2 || sh < 2) return;
+
+  // 16.16 fixed point source coordinates of pixel centers
+  const int stepx = (int)((((long long)sw)<<16)/dst->w);
+  const int stepy = (int)((((long long)sh)<<16)/dst->h);
+
+  const int x1 = dstRect.x + dstRect.w;
+  const int y1 = dstRect.y + dstRect.h;
+
+  TaskScheduler::instance().parallelFor(STAGE_RENDER, dstRect.y, y1, [&](int y){
+    int sy = (y*stepy) + stepy/2 - 0x8000;
+    if(sy < 0) sy = 0;
+
+    int y0 = sy >> 16;
+    int fy = (sy >> 9) & 0x7F; // 7 bit weights
+
+    if(y0 >= sh-1){ y0 = sh-2; fy = 0x80; }
+
+    const Uint8* row0 = ((const Uint8*)src->pixels) + y0*src->pitch;
+    const Uint8* row1 = row0 + src->pitch;
+    Uint32* out = (Uint32*)(((Uint8*)dst->pixels) + y*dst->pitch);
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wy1 = _mm_set1_epi16(fy);
+    const __m128i wy0 = _mm_set1_epi16(0x80 - fy);
+#endif
+
+    for(int x=dstRect.x;x<x1;x++){
+      int sx = (x*stepx) + stepx/2 - 0x8000;
+      if(sx < 0) sx = 0;
+
+      int x0 = sx >> 16;
+      int fx = (sx >> 9) & 0x7F;
+
+      if(x0 >= sw-1){ x0 = sw-2; fx = 0x80; }
+
+#ifdef __SSE2__
+      // two neighbouring pixels from both rows: 8 channels as 16 bit values
+      __m128i p0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row0 + 4*x0)), zero);
+      __m128i p1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(row1 + 4*x0)), zero);
+
+      // vertical interpolation
+      __m128i v = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(p0, wy0),
+					       _mm_mullo_epi16(p1, wy1)), 7);
+
+      // horizontal interpolation: left pixel in low half, right pixel in high half
+      const __m128i wx = _mm_set_epi16(fx, fx, fx, fx,
+				       0x80-fx, 0x80-fx, 0x80-fx, 0x80-fx);
+      __m128i h = _mm_mullo_epi16(v, wx);
+      h = _mm_srli_epi16(_mm_add_epi16(h, _mm_srli_si128(h, 8)), 7);
+
+      out[x] = (Uint32)_mm_cvtsi128_si32(_mm_packus_epi16(h, zero));
+#else
+      const Uint8* a = row0 + 4*x0;
+      const Uint8* b = row1 + 4*x0;
+      Uint32 result = 0;
+
+      for(int c=0;c<4;c++){
+	const int left  = (a[c]*(0x80 - fy) + b[c]*fy) >> 7;
+	const int right = (a[c+4]*(0x80 - fy) + b[c+4]*fy) >> 7;
+	const int value = (left*(0x80 - fx) + right*fx) >> 7;
+
+	((Uint8*)&result)[c] = (Uint8)value;
+      }
+
+      out[x] = result;
+#endif
+    }
+  });
+}
+
+
+RenderScaleController::RenderScaleController(double targetFPS,
+					     double minScale, double maxScale)
+{
+  if(targetFPS <= 0.0) targetFPS = 60.0;
+
+  this->target = 1000.0/targetFPS;
+  this->minScale = minScale;
+  this->maxScale = maxScale;
+  this->scale = maxScale;
+  this->average = 0.0;
+  this->slowFrames = 0;
+  this->fastFrames = 0;
+  this->fixed = false;
+}
+
+
+void RenderScaleController::setFixedScale(double scale)
+{
+  if(scale < minScale) scale = minScale;
+  else if(scale > maxScale) scale = maxScale;
+
+  this->scale = scale;
+  this->fixed = true;
+}
+
+
+bool RenderScaleController::update(double frameMsecs)
+{
+  if(fixed) return false;
+
+  if(average <= 0.0) average = frameMsecs;
+  else average = 0.9*average + 0.1*frameMsecs;
+
+  // hysteresis: scale is reduced quickly when frames are late and
+  // increased only after a longer period of frames well within budget
+  if(average > 1.05*target){ slowFrames++; fastFrames = 0; }
+  else if(average < 0.75*target){ fastFrames++; slowFrames = 0; }
+  else{ slowFrames = 0; fastFrames = 0; }
+
+  const double STEP = 0.05;
+
+  if(slowFrames >= 10 && scale > minScale){
+    scale -= STEP;
+    if(scale < minScale) scale = minScale;
+    slowFrames = 0;
+    average = 0.0;
+    return true;
+  }
+  else if(fastFrames >= 60 && scale < maxScale){
+    scale += STEP;
+    if(scale > maxScale) scale = maxScale;
+    fastFrames = 0;
+    average = 0.0;
+    return true;
+  }
+
+  return false;
+}
+
+
+int RenderScaleController::scaled(int size) const
+{
+  int s = (int)(size*scale + 0.5);
+  if(s < 2) s = 2;
+  if(s > size) s = size;
+  return s;
+}
+
+
+}
+}
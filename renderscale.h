@@ -0,0 +1,54 @@
+/*
+ * renderscale.h
+ *
+ * dynamic resolution scaling: blob layers are rendered at lower internal
+ * resolution and upscaled to the screen when frame time budget is exceeded
+ *
+ */
+
+#ifndef RENDERSCALE_H_
+#define RENDERSCALE_H_
+
+#include <SDL.h>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    // bilinearly upscales 32bit src surface into dstRect area of 32bit dst surface,
+    // src covers whole dst surface (src may be smaller than dst). Uses SSE2 when available.
+    void upscaleBilinear(const SDL_Surface* src, SDL_Surface* dst, const SDL_Rect& dstRect);
+
+
+    // adjusts internal render scale from measured frame times so
+    // that target frames per second is kept
+    class RenderScaleController {
+    public:
+      RenderScaleController(double targetFPS = 60.0,
+			    double minScale = 0.5, double maxScale = 1.0);
+
+      // fixed scale (clamped to [minScale, maxScale]): disables automatic adjustments
+      void setFixedScale(double scale);
+
+      // reports time used to render the latest frame,
+      // returns true if the render scale was changed
+      bool update(double frameMsecs);
+
+      double getScale() const { return scale; }
+
+      // size of scaled render target for the given output size
+      int scaled(int size) const;
+
+    private:
+      double target;  // msecs per frame
+      double minScale, maxScale;
+      double scale;
+      double average; // exponential moving average of the frame time
+      unsigned int slowFrames, fastFrames;
+      bool fixed;
+    };
+
+  }
+}
+
+#endif
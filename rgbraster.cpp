@@ -0,0 +1,95 @@
+/*
+ * rgbraster.cpp
+ *
+ */
+
+#include "rgbraster.h"
+#include "raster.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+RGBCanvas::RGBCanvas(SDL_Surface* surface)
+{
+  this->surface = surface;
+  this->screen = SDL_Rect{ 0, 0, surface->w, surface->h };
+
+  rshift = surface->format->Rshift;
+  gshift = surface->format->Gshift;
+  bshift = surface->format->Bshift;
+}
+
+
+Uint32 RGBCanvas::blend(Uint32 dst, const SDL_Color& c) const
+{
+  // same rounding as YUVCanvas
+  const Uint32 a = c.a;
+  const Uint32 r = (c.r*a + ((dst >> rshift) & 0xFF)*(255 - a) + 127)/255;
+  const Uint32 g = (c.g*a + ((dst >> gshift) & 0xFF)*(255 - a) + 127)/255;
+  const Uint32 b = (c.b*a + ((dst >> bshift) & 0xFF)*(255 - a) + 127)/255;
+
+  const Uint32 rgbmask = (0xFFu << rshift) | (0xFFu << gshift) | (0xFFu << bshift);
+
+  return (dst & ~rgbmask) | (r << rshift) | (g << gshift) | (b << bshift);
+}
+
+
+void RGBCanvas::span(int y, int x0, int x1, const SDL_Color& c)
+{
+  if(x0 >= x1) return;
+
+  Uint32* row = (Uint32*)(((Uint8*)surface->pixels) + y*surface->pitch);
+
+  if(c.a == 0xFF){
+    const Uint32 p = blend(0, c);
+    for(int x=x0;x<x1;x++)
+      row[x] = p;
+  }
+  else{
+    for(int x=x0;x<x1;x++)
+      row[x] = blend(row[x], c);
+  }
+}
+
+
+void RGBCanvas::plot(int x, int y, const SDL_Color& c)
+{
+  Uint32* row = (Uint32*)(((Uint8*)surface->pixels) + y*surface->pitch);
+  row[x] = blend(row[x], c);
+}
+
+
+void RGBCanvas::fillRect(const SDL_Rect& rect, const SDL_Color& c)
+{
+  SDL_Rect r;
+  if(SDL_IntersectRect(&rect, &screen, &r) == SDL_FALSE) return;
+
+  for(int y=r.y;y<r.y+r.h;y++)
+    span(y, r.x, r.x + r.w, c);
+}
+
+
+void RGBCanvas::fillPolygon(const std::vector<SDL_Point>& polygon, const SDL_Color& c,
+			    const SDL_Rect& clip)
+{
+  SDL_Rect r;
+  if(SDL_IntersectRect(&clip, &screen, &r) == SDL_FALSE) return;
+
+  polygonSpans(polygon, r, [&](int y, int x0, int x1){ span(y, x0, x1, c); });
+}
+
+
+void RGBCanvas::drawPolyline(const std::vector<SDL_Point>& polyline, const SDL_Color& c,
+			     const SDL_Rect& clip)
+{
+  SDL_Rect r;
+  if(SDL_IntersectRect(&clip, &screen, &r) == SDL_FALSE) return;
+
+  polylinePixels(polyline, r, [&](int x, int y){ plot(x, y, c); });
+}
+
+
+}
+}
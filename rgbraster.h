@@ -0,0 +1,51 @@
+/*
+ * rgbraster.h
+ *
+ * rasterization of flat colour shapes directly into 32bit RGB surfaces
+ * (framebuffer), the same operations as YUVCanvas so that the scene is
+ * composited without per blob layers
+ *
+ */
+
+#ifndef RGBRASTER_H_
+#define RGBRASTER_H_
+
+#include <SDL.h>
+#include <vector>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    // draws into 32bit surface (alpha channel is not written), all
+    // operations are alpha blended and restricted to clip rectangle.
+    // Surface must not need locking (no RLE)
+    class RGBCanvas {
+    public:
+      RGBCanvas(SDL_Surface* surface);
+
+      void fillRect(const SDL_Rect& rect, const SDL_Color& c);
+
+      // fills closed polygon (non-zero winding rule)
+      void fillPolygon(const std::vector<SDL_Point>& polygon, const SDL_Color& c,
+		       const SDL_Rect& clip);
+
+      // draws closed polyline with one pixel wide lines
+      void drawPolyline(const std::vector<SDL_Point>& polyline, const SDL_Color& c,
+			const SDL_Rect& clip);
+
+    private:
+      void span(int y, int x0, int x1, const SDL_Color& c);
+      void plot(int x, int y, const SDL_Color& c);
+
+      Uint32 blend(Uint32 dst, const SDL_Color& c) const;
+
+      SDL_Surface* surface;
+      SDL_Rect screen;
+      Uint32 rshift, gshift, bshift;
+    };
+
+  }
+}
+
+#endif
@@ -0,0 +1,314 @@
+/*
+ * scheduler.cpp
+ *
+ */
+
+#include "scheduler.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "arena.h"
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+TaskScheduler& TaskScheduler::instance()
+{
+  static TaskScheduler scheduler;
+  return scheduler;
+}
+
+
+TaskScheduler::TaskScheduler()
+{
+  pinning = false;
+  running = false;
+
+  for(unsigned int s=0;s<NUM_STAGES;s++){
+    busy[s] = 0;
+    tasks[s] = 0;
+  }
+
+  for(auto& g : groups){
+    g.threads = 1;
+    g.firstCore = 0;
+  }
+
+  configure();
+}
+
+
+TaskScheduler::~TaskScheduler()
+{
+  std::lock_guard<std::mutex> lock(config_mutex);
+  stop_workers();
+}
+
+
+bool TaskScheduler::configure(unsigned int renderThreads,
+			      unsigned int encodeThreads,
+			      bool pinThreads)
+{
+  std::lock_guard<std::mutex> lock(config_mutex);
+
+  stop_workers();
+
+  unsigned int cores = std::thread::hardware_concurrency();
+  if(cores == 0) cores = 1;
+
+  // encoder gets a third of the cores by default
+  if(encodeThreads == 0){
+    encodeThreads = cores/3;
+    if(encodeThreads == 0) encodeThreads = 1;
+  }
+
+  if(renderThreads == 0){
+    renderThreads = (cores > encodeThreads) ? cores - encodeThreads : 1;
+  }
+
+  pinning = pinThreads;
+
+  groups[0].threads = renderThreads;
+  groups[0].firstCore = 0;
+  groups[1].threads = encodeThreads;
+  groups[1].firstCore = renderThreads % cores;
+
+  for(unsigned int s=0;s<NUM_STAGES;s++){
+    busy[s] = 0;
+    tasks[s] = 0;
+  }
+
+  started = std::chrono::steady_clock::now();
+  running = true;
+
+  // calling threads participate in parallelFor(): one worker less. Encode
+  // cores are used by the encoder threads and codecs' own threads
+  for(unsigned int i=1;i<groups[0].threads;i++){
+    try{
+      groups[0].workers.push_back(new std::thread(&TaskScheduler::worker_loop, this, 0));
+    }
+    catch(std::exception& e){
+      logging.error("scheduler: cannot start worker thread");
+      break;
+    }
+  }
+
+  return true;
+}
+
+
+unsigned int TaskScheduler::getThreads(SchedulerStage stage) const
+{
+  return (stage == STAGE_ENCODE) ? groups[1].threads : groups[0].threads;
+}
+
+
+TaskScheduler::group& TaskScheduler::group_of(SchedulerStage stage)
+{
+  return (stage == STAGE_ENCODE) ? groups[1] : groups[0];
+}
+
+
+void TaskScheduler::parallel_for(SchedulerStage stage, int begin, int end,
+				  const std::function<void(int)>& f, int grain)
+{
+  if(end <= begin) return;
+
+  TaskScheduler::group& g = group_of(stage);
+
+  TaskScheduler::job j;
+  j.function = &f;
+  j.stage = stage;
+  j.next = begin;
+  j.end = end;
+  j.chunk = (grain > 0) ? grain : (end - begin)/(4*g.threads);
+  if(j.chunk <= 0) j.chunk = 1;
+  j.active = 0;
+
+  const bool shared = (g.workers.size() > 0 && (end - begin) > 1);
+
+  if(shared){
+    std::lock_guard<std::mutex> lock(g.mutex);
+    g.jobs.push_back(&j);
+    g.work_cond.notify_all();
+  }
+
+  run_job(&j);
+
+  if(shared){
+    // no new workers can join after the job is removed from the queue
+    std::unique_lock<std::mutex> lock(g.mutex);
+
+    for(auto i=g.jobs.begin();i!=g.jobs.end();i++){
+      if(*i == &j){ g.jobs.erase(i); break; }
+    }
+
+    while(j.active > 0)
+      g.done_cond.wait(lock);
+  }
+}
+
+
+void TaskScheduler::run_job(TaskScheduler::job* j)
+{
+  const auto t0 = std::chrono::steady_clock::now();
+  unsigned long long count = 0;
+
+  ArenaScope scope; // temporaries of the calls
+
+  while(1){
+    const int first = j->next.fetch_add(j->chunk);
+    if(first >= j->end) break;
+
+    const int last = (first + j->chunk < j->end) ? first + j->chunk : j->end;
+
+    for(int i=first;i<last;i++)
+      (*j->function)(i);
+
+    count += last - first;
+  }
+
+  if(count > 0){
+    const auto t1 = std::chrono::steady_clock::now();
+    busy[j->stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+    tasks[j->stage] += count;
+  }
+}
+
+
+void TaskScheduler::worker_loop(unsigned int groupIndex)
+{
+  TaskScheduler::group& g = groups[groupIndex];
+
+  if(pinning) pin(g.firstCore, g.threads);
+
+  std::unique_lock<std::mutex> lock(g.mutex);
+
+  while(running){
+    if(g.jobs.size() == 0){
+      g.work_cond.wait(lock);
+      continue;
+    }
+
+    TaskScheduler::job* j = g.jobs.front();
+
+    if(j->next >= j->end){
+      // all chunks taken: job is finished by the threads executing it
+      g.jobs.erase(g.jobs.begin());
+      continue;
+    }
+
+    j->active++;
+    lock.unlock();
+
+    run_job(j);
+
+    lock.lock();
+    j->active--;
+
+    g.done_cond.notify_all();
+  }
+}
+
+
+void TaskScheduler::stop_workers()
+{
+  for(auto& g : groups){
+    {
+      std::lock_guard<std::mutex> lock(g.mutex);
+      running = false; // under group mutex so sleeping workers cannot miss it
+      g.work_cond.notify_all();
+    }
+
+    for(auto& w : g.workers){
+      w->join();
+      delete w;
+    }
+
+    g.workers.clear();
+  }
+}
+
+
+void TaskScheduler::joinStage(SchedulerStage stage)
+{
+  const TaskScheduler::group& g = group_of(stage);
+
+  if(pinning) pin(g.firstCore, g.threads);
+}
+
+
+void TaskScheduler::addBusyTime(SchedulerStage stage, double msecs)
+{
+  busy[stage] += (unsigned long long)(msecs*1000000.0);
+  tasks[stage]++;
+}
+
+
+TaskScheduler::StageStats TaskScheduler::getStats(SchedulerStage stage) const
+{
+  TaskScheduler::StageStats s;
+
+  s.tasks = tasks[stage];
+  s.busyMsecs = busy[stage]/1000000.0;
+
+  const double elapsed = std::chrono::duration<double, std::milli>
+    (std::chrono::steady_clock::now() - started).count();
+
+  const unsigned int threads = getThreads(stage);
+
+  s.utilization = (elapsed > 0.0) ? s.busyMsecs/(elapsed*threads) : 0.0;
+
+  return s;
+}
+
+
+void TaskScheduler::report(FILE* out) const
+{
+  const char* names[NUM_STAGES] = { "render", "convert", "encode" };
+
+  for(unsigned int s=0;s<NUM_STAGES;s++){
+    const TaskScheduler::StageStats st = getStats((SchedulerStage)s);
+
+    fprintf(out, "scheduler: %s %.1f%% of %u cores (%.0f ms busy, %llu tasks)\n",
+	    names[s], 100.0*st.utilization, getThreads((SchedulerStage)s),
+	    st.busyMsecs, st.tasks);
+  }
+}
+
+
+void TaskScheduler::pin(unsigned int firstCore, unsigned int cores)
+{
+  unsigned int total = std::thread::hardware_concurrency();
+  if(total == 0) return;
+
+#ifdef _WIN32
+  DWORD_PTR mask = 0;
+
+  for(unsigned int i=0;i<cores;i++)
+    mask |= ((DWORD_PTR)1) << ((firstCore + i) % total);
+
+  SetThreadAffinityMask(GetCurrentThread(), mask);
+#else
+  cpu_set_t set;
+  CPU_ZERO(&set);
+
+  for(unsigned int i=0;i<cores;i++)
+    CPU_SET((firstCore + i) % total, &set);
+
+  if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    logging.error("scheduler: pinning thread to cores failed");
+#endif
+}
+
+
+}
+}
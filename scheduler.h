@@ -0,0 +1,126 @@
+/*
+ * scheduler.h
+ *
+ * single task scheduler shared by rendering, pixel conversions and
+ * encoding: cores are split between render and encode worker groups
+ * (optionally pinned to cores) so that the stages do not oversubscribe
+ * the processor. Workers sleep when idle (no spin waiting) and busy time
+ * of each stage is measured for tuning the split
+ *
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdio.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    enum SchedulerStage {
+      STAGE_RENDER = 0,  // effect rendering and compositing
+      STAGE_CONVERT = 1, // RGB/YUV conversions and scaling (render cores)
+      STAGE_ENCODE = 2,  // encoder threads (encode cores)
+      NUM_STAGES = 3
+    };
+
+    class TaskScheduler {
+    public:
+      // scheduler shared by the whole program
+      static TaskScheduler& instance();
+
+      virtual ~TaskScheduler();
+
+      // sets core split: render threads include the thread calling parallelFor(),
+      // 0 means automatic. Restarts worker threads (call before using the scheduler)
+      bool configure(unsigned int renderThreads = 0,
+		     unsigned int encodeThreads = 0,
+		     bool pinThreads = false);
+
+      unsigned int getThreads(SchedulerStage stage) const;
+
+      // calls f(i) for every i in [begin, end) using the stage's worker group
+      // and the calling thread, returns when all calls have completed. Each
+      // thread's share runs inside an ArenaScope (temporaries are released).
+      // Threads take grain indexes at a time (0 = automatic, use 1 for long
+      // calls that must complete roughly in order)
+      template <typename F>
+      void parallelFor(SchedulerStage stage, int begin, int end, const F& f,
+		       int grain = 0){
+	// referenced, not copied: no heap allocation per call
+	parallel_for(stage, begin, end, std::cref(f), grain);
+      }
+
+      // pins calling thread to the cores of the stage (if pinning is enabled),
+      // used by long running threads like encoders
+      void joinStage(SchedulerStage stage);
+
+      // adds busy time measured outside of parallelFor() (encoder threads)
+      void addBusyTime(SchedulerStage stage, double msecs);
+
+      struct StageStats {
+	unsigned long long tasks;
+	double busyMsecs;
+	double utilization; // busy time per available core time [0,1]
+      };
+
+      StageStats getStats(SchedulerStage stage) const;
+
+      void report(FILE* out) const;
+
+    private:
+      TaskScheduler();
+
+      struct job {
+	const std::function<void(int)>* function;
+	SchedulerStage stage;
+	std::atomic<int> next;
+	int end;
+	int chunk;
+	int active; // workers executing the job (protected by group mutex)
+      };
+
+      struct group {
+	unsigned int threads;        // including threads calling parallelFor()
+	unsigned int firstCore;
+	std::vector<std::thread*> workers;
+
+	std::mutex mutex;
+	std::condition_variable work_cond, done_cond;
+	std::vector<TaskScheduler::job*> jobs; // keeps capacity (no allocations)
+      };
+
+      void parallel_for(SchedulerStage stage, int begin, int end,
+			const std::function<void(int)>& f, int grain);
+
+      void worker_loop(unsigned int groupIndex);
+      void run_job(TaskScheduler::job* j);
+      void stop_workers();
+
+      TaskScheduler::group& group_of(SchedulerStage stage);
+      void pin(unsigned int firstCore, unsigned int cores);
+
+      TaskScheduler::group groups[2]; // render (and convert), encode
+      bool pinning;
+      bool running;
+
+      std::atomic<unsigned long long> busy[NUM_STAGES]; // nanoseconds
+      std::atomic<unsigned long long> tasks[NUM_STAGES];
+      std::chrono::steady_clock::time_point started;
+
+      std::mutex config_mutex;
+    };
+
+  }
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * startup.cpp
+ *
+ */
+
+#include "startup.h"
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+StartupTasks::StartupTasks() : created(std::chrono::steady_clock::now())
+{
+}
+
+
+StartupTasks::~StartupTasks()
+{
+  waitAll();
+}
+
+
+int StartupTasks::addTask(const std::string& name, std::function<bool()> function,
+			  const std::vector<int>& dependencies)
+{
+  std::lock_guard<std::mutex> lock(task_mutex);
+
+  for(const auto& d : dependencies)
+    if(d < 0 || d >= (int)tasks.size()) return -1;
+
+  StartupTasks::task t;
+  t.name = name;
+  t.function = function;
+  t.dependencies = dependencies;
+  t.state = TASK_PENDING;
+  t.started = 0.0;
+  t.ended = 0.0;
+
+  tasks.push_back(t);
+
+  const int index = (int)tasks.size() - 1;
+
+  try{
+    threads.push_back(new std::thread(&StartupTasks::run_task, this, index));
+  }
+  catch(std::exception& e){
+    tasks[index].state = TASK_FAILED;
+    logging.error("startup: cannot start task thread");
+  }
+
+  return index;
+}
+
+
+bool StartupTasks::wait(int index)
+{
+  std::unique_lock<std::mutex> lock(task_mutex);
+
+  if(index < 0 || index >= (int)tasks.size()) return false;
+
+  while(tasks[index].state == TASK_PENDING || tasks[index].state == TASK_RUNNING)
+    task_cond.wait(lock);
+
+  return (tasks[index].state == TASK_OK);
+}
+
+
+bool StartupTasks::finished(int index) const
+{
+  std::lock_guard<std::mutex> lock(task_mutex);
+
+  if(index < 0 || index >= (int)tasks.size()) return true;
+
+  return (tasks[index].state == TASK_OK || tasks[index].state == TASK_FAILED);
+}
+
+
+void StartupTasks::waitAll()
+{
+  std::vector<std::thread*> running;
+
+  {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    running.swap(threads);
+  }
+
+  for(auto& t : running){
+    t->join();
+    delete t;
+  }
+}
+
+
+double StartupTasks::elapsed() const
+{
+  return std::chrono::duration<double, std::milli>
+    (std::chrono::steady_clock::now() - created).count();
+}
+
+
+void StartupTasks::report(FILE* out) const
+{
+  std::lock_guard<std::mutex> lock(task_mutex);
+
+  for(const auto& t : tasks){
+    if(t.state == TASK_OK || t.state == TASK_FAILED)
+      fprintf(out, "startup: %s %.1f - %.1f ms%s\n", t.name.c_str(),
+	      t.started, t.ended, t.state == TASK_FAILED ? " FAILED" : "");
+    else
+      fprintf(out, "startup: %s not completed\n", t.name.c_str());
+  }
+}
+
+
+void StartupTasks::run_task(int index)
+{
+  std::unique_lock<std::mutex> lock(task_mutex);
+
+  // dependencies have smaller indexes: waiting cannot deadlock
+  bool ok = true;
+
+  for(unsigned int i=0;i<tasks[index].dependencies.size();i++){
+    const int d = tasks[index].dependencies[i];
+
+    while(tasks[d].state == TASK_PENDING || tasks[d].state == TASK_RUNNING)
+      task_cond.wait(lock);
+
+    if(tasks[d].state != TASK_OK) ok = false;
+  }
+
+  if(ok){
+    tasks[index].state = TASK_RUNNING;
+    tasks[index].started = elapsed();
+
+    std::function<bool()> function = tasks[index].function;
+
+    lock.unlock();
+    ok = function ? function() : true;
+    lock.lock();
+  }
+  else{
+    tasks[index].started = elapsed();
+  }
+
+  tasks[index].ended = elapsed();
+  tasks[index].state = ok ? TASK_OK : TASK_FAILED;
+
+  if(ok == false){
+    char buffer[256];
+    snprintf(buffer, 256, "startup: task %s failed", tasks[index].name.c_str());
+    logging.error(buffer);
+  }
+
+  task_cond.notify_all();
+}
+
+
+}
+}
@@ -0,0 +1,78 @@
+/*
+ * startup.h
+ *
+ * startup task graph: independent initialization steps (font, audio,
+ * music, encoder..) run concurrently in background threads, each task
+ * starts when the tasks it depends on have completed successfully.
+ * Tasks can be added at any time so setup can be deferred until needed
+ *
+ */
+
+#ifndef STARTUP_H_
+#define STARTUP_H_
+
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class StartupTasks {
+    public:
+      StartupTasks();
+      virtual ~StartupTasks(); // waits for all tasks
+
+      // starts task in a background thread after its dependencies,
+      // returns task id (or -1 if dependencies are not valid tasks)
+      int addTask(const std::string& name, std::function<bool()> task,
+		  const std::vector<int>& dependencies = std::vector<int>());
+
+      // waits for task to complete, returns false if the task or
+      // one of its dependencies failed
+      bool wait(int task);
+
+      // task has completed (successfully or not) or is not a valid task
+      bool finished(int task) const;
+
+      void waitAll();
+
+      // msecs since the creation of this object (the start of the program)
+      double elapsed() const;
+
+      // prints start and end times of the tasks
+      void report(FILE* out) const;
+
+    private:
+      enum TaskState { TASK_PENDING, TASK_RUNNING, TASK_OK, TASK_FAILED };
+
+      struct task {
+	std::string name;
+	std::function<bool()> function;
+	std::vector<int> dependencies;
+	TaskState state;
+	double started, ended; // msecs
+      };
+
+      void run_task(int index);
+
+      const std::chrono::steady_clock::time_point created;
+
+      std::vector<StartupTasks::task> tasks;
+      std::vector<std::thread*> threads;
+
+      mutable std::mutex task_mutex;
+      std::condition_variable task_cond;
+    };
+
+  }
+}
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ * timeline.cpp
+ *
+ */
+
+#include "timeline.h"
+#include <chrono>
+
+#include "Log.h"
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+Timeline::Timeline(unsigned long long prepareAheadMsecs)
+{
+  prepareAhead = prepareAheadMsecs;
+  now = 0;
+  running = false;
+  switched = false;
+  worker = nullptr;
+}
+
+
+Timeline::~Timeline()
+{
+  stop();
+
+  for(auto& s : scenes)
+    delete s.effect;
+
+  scenes.clear();
+}
+
+
+bool Timeline::addScene(const std::string& name, Effect* effect,
+			unsigned long long startMsecs,
+			unsigned long long endMsecs)
+{
+  if(effect == nullptr || endMsecs <= startMsecs) return false;
+
+  std::lock_guard<std::mutex> lock(scene_mutex);
+
+  if(running) return false;
+
+  Timeline::scene s;
+  s.name = name;
+  s.effect = effect;
+  s.start = startMsecs;
+  s.end = endMsecs;
+  s.state = SCENE_WAITING;
+  s.frames = 0;
+  s.totalMsecs = 0.0;
+  s.maxMsecs = 0.0;
+  s.stallMsecs = 0.0;
+
+  scenes.push_back(s);
+
+  return true;
+}
+
+
+bool Timeline::start()
+{
+  std::lock_guard<std::mutex> lock(scene_mutex);
+
+  if(running || scenes.size() == 0) return false;
+
+  now = 0;
+  running = true;
+
+  try{
+    worker = new std::thread(&Timeline::prepare_loop, this);
+  }
+  catch(std::exception& e){
+    running = false;
+    worker = nullptr;
+    return false;
+  }
+
+  return true;
+}
+
+
+void Timeline::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(scene_mutex);
+    running = false;
+    scene_cond.notify_all();
+  }
+
+  if(worker){
+    worker->join();
+    delete worker;
+  }
+
+  worker = nullptr;
+
+  for(auto& s : scenes){
+    if(s.state == SCENE_READY){
+      s.effect->teardown();
+      s.state = SCENE_DONE;
+    }
+  }
+}
+
+
+bool Timeline::render(unsigned long long msecs, SDL_Surface* surface,
+		      DamageRegion& damage)
+{
+  bool ok = true;
+
+  active.swap(previous);
+  active.clear();
+
+  {
+    std::unique_lock<std::mutex> lock(scene_mutex);
+
+    if(running == false) return false;
+
+    now = msecs;
+    scene_cond.notify_all(); // upcoming scenes can be prepared
+
+    for(unsigned int i=0;i<scenes.size();i++){
+      Timeline::scene& s = scenes[i];
+
+      if(msecs < s.start || msecs >= s.end) continue;
+
+      if(s.state == SCENE_WAITING || s.state == SCENE_PREPARING){
+	// preparation started too late: this frame is going to be late
+	auto waitStart = std::chrono::steady_clock::now();
+
+	while(running && (s.state == SCENE_WAITING || s.state == SCENE_PREPARING))
+	  scene_cond.wait(lock);
+
+	s.stallMsecs += std::chrono::duration<double, std::milli>
+	  (std::chrono::steady_clock::now() - waitStart).count();
+      }
+
+      if(s.state == SCENE_READY)
+	active.push_back(i);
+      else if(s.state == SCENE_FAILED)
+	ok = false;
+    }
+  }
+
+  switched = (active != previous);
+
+  // scenes can be only torn down after their end time so
+  // they can be rendered here without holding the lock
+  for(const auto& i : active){
+    Timeline::scene& s = scenes[i];
+
+    auto renderStart = std::chrono::steady_clock::now();
+
+    if(s.effect->render(msecs - s.start, surface, damage) == false){
+      logging.error("timeline: rendering scene failed");
+      ok = false;
+    }
+
+    // new scene redraws the whole screen (marked after rendering because
+    // the effect sets up the damage region for the frame)
+    if(s.frames == 0 && surface){
+      damage.resize(surface->w, surface->h);
+      damage.addAll();
+    }
+
+    const double ms = std::chrono::duration<double, std::milli>
+      (std::chrono::steady_clock::now() - renderStart).count();
+
+    std::lock_guard<std::mutex> lock(scene_mutex);
+    s.frames++;
+    s.totalMsecs += ms;
+    if(ms > s.maxMsecs) s.maxMsecs = ms;
+  }
+
+  return ok;
+}
+
+
+std::vector<Timeline::SceneStats> Timeline::getStats() const
+{
+  std::lock_guard<std::mutex> lock(scene_mutex);
+
+  std::vector<Timeline::SceneStats> stats;
+
+  for(const auto& s : scenes){
+    Timeline::SceneStats st;
+    st.name = s.name;
+    st.frames = s.frames;
+    st.avgMsecs = s.frames ? s.totalMsecs/s.frames : 0.0;
+    st.maxMsecs = s.maxMsecs;
+    st.stallMsecs = s.stallMsecs;
+
+    stats.push_back(st);
+  }
+
+  return stats;
+}
+
+
+int Timeline::next_task(bool& teardown) const
+{
+  // ended scenes are freed first, then the earliest upcoming scene is prepared
+  for(unsigned int i=0;i<scenes.size();i++){
+    if(scenes[i].state == SCENE_READY && scenes[i].end <= now){
+      teardown = true;
+      return (int)i;
+    }
+  }
+
+  int next = -1;
+
+  for(unsigned int i=0;i<scenes.size();i++){
+    const Timeline::scene& s = scenes[i];
+
+    if(s.state != SCENE_WAITING || s.end <= now) continue;
+    if(s.start > now + prepareAhead) continue;
+
+    if(next < 0 || s.start < scenes[next].start)
+      next = (int)i;
+  }
+
+  teardown = false;
+  return next;
+}
+
+
+void Timeline::prepare_loop()
+{
+  std::unique_lock<std::mutex> lock(scene_mutex);
+
+  while(running){
+    bool teardown = false;
+    const int index = next_task(teardown);
+
+    if(index < 0){
+      scene_cond.wait(lock);
+      continue;
+    }
+
+    Timeline::scene& s = scenes[index];
+
+    if(teardown){
+      s.state = SCENE_DONE;
+
+      lock.unlock();
+      s.effect->teardown();
+      lock.lock();
+    }
+    else{
+      s.state = SCENE_PREPARING;
+
+      lock.unlock();
+      const bool ok = s.effect->prepare();
+      lock.lock();
+
+      if(ok == false)
+	logging.error("timeline: preparing scene failed");
+
+      s.state = ok ? SCENE_READY : SCENE_FAILED;
+      scene_cond.notify_all();
+    }
+  }
+}
+
+
+}
+}
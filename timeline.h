@@ -0,0 +1,144 @@
+/*
+ * timeline.h
+ *
+ * scene engine: effects are scheduled on a time axis and the engine
+ * prepares upcoming scenes (loads fonts, curves, tables..) in a
+ * background thread before their start time so that scene changes
+ * do not stall rendering. Frame cost of each scene is measured
+ *
+ */
+
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+#include <SDL.h>
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#include "damage.h"
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    class Effect {
+    public:
+      virtual ~Effect() { }
+
+      // allocates and precomputes everything the effect needs,
+      // called in background thread before the scene starts
+      virtual bool prepare() = 0;
+
+      // draws the effect at msecs from the start of the scene into surface,
+      // changed area of the surface is added to damage
+      virtual bool render(unsigned long long msecs, SDL_Surface* surface,
+			  DamageRegion& damage) = 0;
+
+      // frees resources after the scene has ended
+      virtual void teardown() = 0;
+    };
+
+
+    // effect made of functions (for effects that live inside main())
+    class FunctionEffect : public Effect {
+    public:
+      FunctionEffect(std::function<bool()> prepare,
+		     std::function<bool(unsigned long long, SDL_Surface*, DamageRegion&)> render,
+		     std::function<void()> teardown = nullptr) :
+	prepareFunction(prepare), renderFunction(render), teardownFunction(teardown) { }
+
+      bool prepare(){ return prepareFunction ? prepareFunction() : true; }
+
+      bool render(unsigned long long msecs, SDL_Surface* surface, DamageRegion& damage){
+	return renderFunction(msecs, surface, damage);
+      }
+
+      void teardown(){ if(teardownFunction) teardownFunction(); }
+
+    private:
+      std::function<bool()> prepareFunction;
+      std::function<bool(unsigned long long, SDL_Surface*, DamageRegion&)> renderFunction;
+      std::function<void()> teardownFunction;
+    };
+
+
+    class Timeline {
+    public:
+      // scenes are prepared prepareAheadMsecs before their start time
+      Timeline(unsigned long long prepareAheadMsecs = 2000);
+      virtual ~Timeline();
+
+      static const unsigned long long FOREVER = ~0ULL;
+
+      // schedules effect to be shown in [startMsecs, endMsecs), timeline
+      // takes ownership of the effect. Scenes may overlap and are drawn
+      // in the order they were added
+      bool addScene(const std::string& name, Effect* effect,
+		    unsigned long long startMsecs,
+		    unsigned long long endMsecs = FOREVER);
+
+      // starts background preparation of scenes
+      bool start();
+
+      // stops preparation thread and tears down all prepared scenes
+      void stop();
+
+      // renders active scenes at msecs (must not decrease between calls),
+      // waits for scenes whose preparation has not completed yet
+      bool render(unsigned long long msecs, SDL_Surface* surface,
+		  DamageRegion& damage);
+
+      // set of scenes shown changed in the latest render() call (a scene
+      // started or ended): the frame does not continue the previous one
+      bool sceneSwitched() const { return switched; }
+
+      struct SceneStats {
+	std::string name;
+	unsigned long long frames;
+	double avgMsecs, maxMsecs; // render time per frame
+	double stallMsecs;         // time waited for prepare() to complete
+      };
+
+      std::vector<SceneStats> getStats() const;
+
+    private:
+      enum SceneState { SCENE_WAITING, SCENE_PREPARING, SCENE_READY, SCENE_DONE, SCENE_FAILED };
+
+      struct scene {
+	std::string name;
+	Effect* effect;
+	unsigned long long start, end;
+	SceneState state;
+
+	unsigned long long frames;
+	double totalMsecs, maxMsecs, stallMsecs;
+      };
+
+      void prepare_loop();
+
+      // next scene to prepare or tear down (-1 if none), called with scene_mutex
+      int next_task(bool& teardown) const;
+
+      unsigned long long prepareAhead;
+
+      std::vector<Timeline::scene> scenes;
+      std::vector<unsigned int> active; // scenes rendered by render() (keeps capacity)
+      std::vector<unsigned int> previous; // scenes rendered by the previous render()
+      bool switched;
+      unsigned long long now;
+      bool running;
+
+      mutable std::mutex scene_mutex;
+      std::condition_variable scene_cond;
+      std::thread* worker;
+    };
+
+  }
+}
+
+#endif
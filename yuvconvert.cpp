@@ -0,0 +1,316 @@
+/*
+ * yuvconvert.cpp
+ *
+ */
+
+#include "yuvconvert.h"
+#include "scheduler.h"
+#include <math.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+void convertRGBToYUV420(const SDL_Surface* surface, AVFrame* frame,
+			int firstRow, int lastRow)
+{
+  const unsigned int pitch = surface->pitch/4;
+
+  if(lastRow < 0 || lastRow > frame->height) lastRow = frame->height;
+  if(firstRow < 0) firstRow = 0;
+  firstRow &= ~1;
+  
+  // perfect opportunity for parallelization: pixel conversions are independet from each other
+  TaskScheduler::instance().parallelFor(STAGE_CONVERT, firstRow, lastRow, [&](int y){
+    const unsigned int* source = ((const unsigned int*)(surface->pixels)) + pitch*y;
+    
+    for(int x=0; x<frame->width; x++) {
+      const unsigned int r = (source[x] & 0x00FF0000)>>16;
+      const unsigned int g = (source[x] & 0x0000FF00)>> 8;
+      const unsigned int b = (source[x] & 0x000000FF)>> 0;
+      
+      auto Y  =  (0.257*r) + (0.504*g) + (0.098*b) + 16.0;
+      
+      if(Y < 0.0) Y = 0.0;
+      else if(Y > 255.0) Y = 255.0;
+      
+      frame->data[0][y * frame->linesize[0] + x] =
+	(unsigned char)round(Y);  // Y
+    }
+  });
+  
+  // chroma planes are subsampled: takes the bottom right pixel of each 2x2 block
+  TaskScheduler::instance().parallelFor(STAGE_CONVERT, firstRow/2, (lastRow+1)/2, [&](int yy){
+    int y = 2*yy+1;
+    if(y >= frame->height) y = frame->height-1;
+    
+    const unsigned int* source = ((const unsigned int*)(surface->pixels)) + pitch*y;
+    
+    for(int xx=0; xx<(frame->width+1)/2; xx++) {
+      int x = 2*xx+1;
+      if(x >= frame->width) x = frame->width-1;
+      
+      const unsigned int r = (source[x] & 0x00FF0000)>>16;
+      const unsigned int g = (source[x] & 0x0000FF00)>> 8;
+      const unsigned int b = (source[x] & 0x000000FF)>> 0;
+      
+      auto Cr =  (0.439*r) - (0.368*g) - (0.071*b) + 128.0;
+      auto Cb = -(0.148*r) - (0.291*g) + (0.439*b) + 128.0;
+      
+      if(Cr < 0.0) Cr = 0.0;
+      else if(Cr > 255.0) Cr = 255.0;
+      
+      if(Cb < 0.0) Cb = 0.0;
+      else if(Cb > 255.0) Cb = 255.0;
+      
+      frame->data[1][yy * frame->linesize[1] + xx] =
+	(unsigned char)round(Cb);  // Cb
+      frame->data[2][yy * frame->linesize[2] + xx] =
+	(unsigned char)round(Cr);  // Cr
+    }
+  });
+}
+
+
+// 6 bit fixed point coefficients of the inverse transform
+#define YUV_Y   74 // 1.164
+#define YUV_RV 102 // 1.596
+#define YUV_GU  25 // 0.391
+#define YUV_GV  52 // 0.813
+#define YUV_BU 129 // 2.018
+
+static inline unsigned char yuv_clamp(int v)
+{
+  v = (v + 32) >> 6;
+  if(v < 0) return 0;
+  else if(v > 255) return 255;
+  else return (unsigned char)v;
+}
+
+
+void convertYUV420ToRGB(const AVFrame* frame, SDL_Surface* surface)
+{
+  const int width = (frame->width < surface->w) ? frame->width : surface->w;
+  const int height = (frame->height < surface->h) ? frame->height : surface->h;
+
+  const SDL_PixelFormat* fmt = surface->format;
+  
+  const bool xrgb = (fmt->BytesPerPixel == 4 &&
+		     fmt->Rmask == 0x00FF0000 &&
+		     fmt->Gmask == 0x0000FF00 &&
+		     fmt->Bmask == 0x000000FF);
+
+  TaskScheduler::instance().parallelFor(STAGE_CONVERT, 0, height, [&](int y){
+    const unsigned char* Yp = frame->data[0] + y*frame->linesize[0];
+    const unsigned char* Up = frame->data[1] + (y/2)*frame->linesize[1];
+    const unsigned char* Vp = frame->data[2] + (y/2)*frame->linesize[2];
+
+    Uint8* row = ((Uint8*)surface->pixels) + y*surface->pitch;
+
+    int x = 0;
+
+#ifdef __SSE2__
+    if(xrgb){
+      Uint32* out = (Uint32*)row;
+      
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i c16  = _mm_set1_epi16(16);
+      const __m128i c128 = _mm_set1_epi16(128);
+      const __m128i round = _mm_set1_epi16(32);
+      const __m128i alpha = _mm_set1_epi8((char)0xFF);
+      
+      const __m128i cy  = _mm_set1_epi16(YUV_Y);
+      const __m128i crv = _mm_set1_epi16(YUV_RV);
+      const __m128i cgu = _mm_set1_epi16(YUV_GU);
+      const __m128i cgv = _mm_set1_epi16(YUV_GV);
+      const __m128i cbu = _mm_set1_epi16(YUV_BU);
+      
+      // 8 pixels per step, chroma samples are shared by pixel pairs
+      for(;x+8<=width;x+=8){
+	__m128i Y = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(Yp + x)), zero);
+	__m128i U = _mm_cvtsi32_si128(*((const int*)(Up + x/2)));
+	__m128i V = _mm_cvtsi32_si128(*((const int*)(Vp + x/2)));
+	
+	U = _mm_unpacklo_epi8(_mm_unpacklo_epi8(U, U), zero);
+	V = _mm_unpacklo_epi8(_mm_unpacklo_epi8(V, V), zero);
+	
+	Y = _mm_mullo_epi16(_mm_sub_epi16(Y, c16), cy);
+	U = _mm_sub_epi16(U, c128);
+	V = _mm_sub_epi16(V, c128);
+
+	// saturation only happens when the result is above 255 anyway
+	__m128i R = _mm_adds_epi16(Y, _mm_mullo_epi16(V, crv));
+	__m128i G = _mm_subs_epi16(_mm_subs_epi16(Y, _mm_mullo_epi16(U, cgu)),
+				   _mm_mullo_epi16(V, cgv));
+	__m128i B = _mm_adds_epi16(Y, _mm_mullo_epi16(U, cbu));
+
+	R = _mm_srai_epi16(_mm_adds_epi16(R, round), 6);
+	G = _mm_srai_epi16(_mm_adds_epi16(G, round), 6);
+	B = _mm_srai_epi16(_mm_adds_epi16(B, round), 6);
+
+	// 0xAARRGGBB pixels: bytes B, G, R, A in memory
+	const __m128i bg = _mm_unpacklo_epi8(_mm_packus_epi16(B, zero), _mm_packus_epi16(G, zero));
+	const __m128i ra = _mm_unpacklo_epi8(_mm_packus_epi16(R, zero), alpha);
+
+	_mm_storeu_si128((__m128i*)(out + x), _mm_unpacklo_epi16(bg, ra));
+	_mm_storeu_si128((__m128i*)(out + x + 4), _mm_unpackhi_epi16(bg, ra));
+      }
+    }
+#endif
+
+    for(;x<width;x++){
+      const int Y = YUV_Y*(Yp[x] - 16);
+      const int U = Up[x/2] - 128;
+      const int V = Vp[x/2] - 128;
+
+      const unsigned char r = yuv_clamp(Y + YUV_RV*V);
+      const unsigned char g = yuv_clamp(Y - YUV_GU*U - YUV_GV*V);
+      const unsigned char b = yuv_clamp(Y + YUV_BU*U);
+
+      if(xrgb)
+	((Uint32*)row)[x] = 0xFF000000 | (r << 16) | (g << 8) | b;
+      else{
+	const Uint32 pixel = SDL_MapRGB(surface->format, r, g, b);
+	
+	switch(fmt->BytesPerPixel){
+	case 1: row[x] = (Uint8)pixel; break;
+	case 2: ((Uint16*)row)[x] = (Uint16)pixel; break;
+	case 3: memcpy(row + 3*x, &pixel, 3); break; // little endian
+	case 4: ((Uint32*)row)[x] = pixel; break;
+	}
+      }
+    }
+  });
+}
+
+
+static void scalePlane(const unsigned char* src, int sw, int sh, int spitch,
+		       unsigned char* dst, int dw, int dh, int dpitch)
+{
+  if(dw == sw/2 && dh == sh/2){
+    // 2x2 box filter: average of vertical averages
+    TaskScheduler::instance().parallelFor(STAGE_CONVERT, 0, dh, [&](int y){
+      const unsigned char* r0 = src + (2*y)*spitch;
+      const unsigned char* r1 = r0 + spitch;
+      unsigned char* out = dst + y*dpitch;
+
+      int x = 0;
+
+#ifdef __SSE2__
+      const __m128i even = _mm_set1_epi16(0x00FF);
+      
+      for(;x+16<=dw;x+=16){
+	const __m128i a0 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + 2*x)),
+					_mm_loadu_si128((const __m128i*)(r1 + 2*x)));
+	const __m128i a1 = _mm_avg_epu8(_mm_loadu_si128((const __m128i*)(r0 + 2*x + 16)),
+					_mm_loadu_si128((const __m128i*)(r1 + 2*x + 16)));
+
+	const __m128i h0 = _mm_avg_epu16(_mm_and_si128(a0, even), _mm_srli_epi16(a0, 8));
+	const __m128i h1 = _mm_avg_epu16(_mm_and_si128(a1, even), _mm_srli_epi16(a1, 8));
+
+	_mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(h0, h1));
+      }
+#endif
+
+      for(;x<dw;x++){
+	const int v0 = (r0[2*x] + r1[2*x] + 1) >> 1;
+	const int v1 = (r0[2*x+1] + r1[2*x+1] + 1) >> 1;
+	out[x] = (unsigned char)((v0 + v1 + 1) >> 1);
+      }
+    });
+
+    return;
+  }
+
+  // bilinear filter with 16.16 fixed point coordinates of pixel centers
+  const int stepx = (int)((((long long)sw)<<16)/dw);
+  const int stepy = (int)((((long long)sh)<<16)/dh);
+
+  TaskScheduler::instance().parallelFor(STAGE_CONVERT, 0, dh, [&](int y){
+    int sy = (y*stepy) + stepy/2 - 0x8000;
+    if(sy < 0) sy = 0;
+
+    int y0 = sy >> 16;
+    int fy = (sy >> 8) & 0xFF;
+    if(y0 >= sh-1){ y0 = sh-1; fy = 0; }
+    const int y1 = (y0+1 < sh) ? y0+1 : y0;
+
+    const unsigned char* r0 = src + y0*spitch;
+    const unsigned char* r1 = src + y1*spitch;
+    unsigned char* out = dst + y*dpitch;
+
+    for(int x=0;x<dw;x++){
+      int sx = (x*stepx) + stepx/2 - 0x8000;
+      if(sx < 0) sx = 0;
+
+      int x0 = sx >> 16;
+      int fx = (sx >> 8) & 0xFF;
+      if(x0 >= sw-1){ x0 = sw-1; fx = 0; }
+      const int x1 = (x0+1 < sw) ? x0+1 : x0;
+
+      const int top = r0[x0]*(256 - fx) + r0[x1]*fx;
+      const int bottom = r1[x0]*(256 - fx) + r1[x1]*fx;
+
+      out[x] = (unsigned char)((top*(256 - fy) + bottom*fy + 32768) >> 16);
+    }
+  });
+}
+
+
+void scaleYUV420(const AVFrame* src, AVFrame* dst)
+{
+  scalePlane(src->data[0], src->width, src->height, src->linesize[0],
+	     dst->data[0], dst->width, dst->height, dst->linesize[0]);
+
+  for(int p=1;p<=2;p++)
+    scalePlane(src->data[p], (src->width+1)/2, (src->height+1)/2, src->linesize[p],
+	       dst->data[p], (dst->width+1)/2, (dst->height+1)/2, dst->linesize[p]);
+}
+
+
+bool samePixels(const SDL_Surface* a, const SDL_Surface* b, const SDL_Rect& rect)
+{
+  const Uint32 mask = a->format->Rmask | a->format->Gmask | a->format->Bmask;
+
+  for(int y=rect.y;y<rect.y+rect.h;y++){
+    const Uint32* p = (const Uint32*)(((const Uint8*)a->pixels) + y*a->pitch) + rect.x;
+    const Uint32* q = (const Uint32*)(((const Uint8*)b->pixels) + y*b->pitch) + rect.x;
+
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128i m = _mm_set1_epi32((int)mask);
+    const __m128i zero = _mm_setzero_si128();
+
+    // 16 pixels per step, differences are collected before the test
+    for(;x+16<=rect.w;x+=16){
+      __m128i d = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + x)),
+				_mm_loadu_si128((const __m128i*)(q + x)));
+      d = _mm_or_si128(d, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + x + 4)),
+					_mm_loadu_si128((const __m128i*)(q + x + 4))));
+      d = _mm_or_si128(d, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + x + 8)),
+					_mm_loadu_si128((const __m128i*)(q + x + 8))));
+      d = _mm_or_si128(d, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + x + 12)),
+					_mm_loadu_si128((const __m128i*)(q + x + 12))));
+
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(d, m), zero)) != 0xFFFF)
+	return false;
+    }
+#endif
+
+    for(;x<rect.w;x++)
+      if((p[x] ^ q[x]) & mask) return false;
+  }
+
+  return true;
+}
+
+
+}
+}
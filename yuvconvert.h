@@ -0,0 +1,48 @@
+/*
+ * yuvconvert.h
+ *
+ * SDL_Surface (32bit RGB) to AVFrame (YUV420P) pixel conversions
+ * shared by the encoder classes and back for the decoder
+ *
+ */
+
+#ifndef YUVCONVERT_H_
+#define YUVCONVERT_H_
+
+#include <SDL.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+};
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    // converts 32bit 0x00RRGGBB pixels of the surface into YUV420P planes
+    // of the frame. surface and frame must have the same width and height
+    // and frame buffers must be already allocated and writable.
+    // Only rows [firstRow, lastRow) are converted (lastRow < 0 means all rows),
+    // firstRow must be even.
+    void convertRGBToYUV420(const SDL_Surface* surface, AVFrame* frame,
+			    int firstRow = 0, int lastRow = -1);
+
+    // converts YUV420P frame into the pixels of the surface (inverse of
+    // convertRGBToYUV420()), only the area common to both is converted.
+    // 32bit 0x00RRGGBB surfaces are written directly using SIMD, other
+    // formats pixel by pixel. The surface must be locked if it needs locking.
+    void convertYUV420ToRGB(const AVFrame* frame, SDL_Surface* surface);
+
+    // scales YUV420P frame to the (smaller) size of dst frame. Halving is
+    // done with SIMD 2x2 box filter and other ratios with bilinear filter,
+    // ratios above 2 should be done in several steps (pyramid)
+    void scaleYUV420(const AVFrame* src, AVFrame* dst);
+
+    // compares RGB values (alpha is ignored) of rect area of two 32bit
+    // surfaces with the same pixel format, rect must be inside both
+    bool samePixels(const SDL_Surface* a, const SDL_Surface* b, const SDL_Rect& rect);
+
+  }
+}
+
+#endif
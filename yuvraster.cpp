@@ -0,0 +1,210 @@
+/*
+ * yuvraster.cpp
+ *
+ */
+
+#include "yuvraster.h"
+#include "raster.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace whiteice {
+namespace resonanz {
+
+
+static inline Uint8 clamp255(double v)
+{
+  if(v < 0.0) return 0;
+  else if(v > 255.0) return 255;
+  else return (Uint8)round(v);
+}
+
+
+static inline Uint8 blend(Uint8 dst, Uint8 src, Uint8 a)
+{
+  return (Uint8)((src*a + dst*(255 - a) + 127)/255);
+}
+
+
+YUVColor rgbToYUVColor(Uint8 r, Uint8 g, Uint8 b, Uint8 a)
+{
+  YUVColor c;
+
+  c.y = clamp255( (0.257*r) + (0.504*g) + (0.098*b) + 16.0);
+  c.v = clamp255( (0.439*r) - (0.368*g) - (0.071*b) + 128.0); // Cr
+  c.u = clamp255(-(0.148*r) - (0.291*g) + (0.439*b) + 128.0); // Cb
+  c.a = a;
+
+  return c;
+}
+
+
+bool createYUVSprite(SDL_Surface* surface, YUVSprite& sprite)
+{
+  if(surface == NULL) return false;
+
+  if(SDL_LockSurface(surface) != 0) return false;
+
+  sprite.w = surface->w;
+  sprite.h = surface->h;
+
+  const unsigned int N = sprite.w*sprite.h;
+
+  sprite.Y.resize(N);
+  sprite.U.resize(N);
+  sprite.V.resize(N);
+  sprite.A.resize(N);
+
+  for(int y=0;y<sprite.h;y++){
+    const Uint32* row = (const Uint32*)(((const Uint8*)surface->pixels) + y*surface->pitch);
+
+    for(int x=0;x<sprite.w;x++){
+      Uint8 r, g, b, a;
+      SDL_GetRGBA(row[x], surface->format, &r, &g, &b, &a);
+
+      const YUVColor c = rgbToYUVColor(r, g, b, a);
+      const unsigned int index = x + y*sprite.w;
+
+      sprite.Y[index] = c.y;
+      sprite.U[index] = c.u;
+      sprite.V[index] = c.v;
+      sprite.A[index] = c.a;
+    }
+  }
+
+  SDL_UnlockSurface(surface);
+
+  return true;
+}
+
+
+YUVCanvas::YUVCanvas(AVFrame* frame)
+{
+  this->frame = frame;
+  this->screen = SDL_Rect{ 0, 0, frame->width, frame->height };
+}
+
+
+void YUVCanvas::span(int y, int x0, int x1, const YUVColor& c)
+{
+  if(x0 >= x1) return;
+
+  Uint8* Y = frame->data[0] + y*frame->linesize[0];
+
+  if(c.a == 0xFF){
+    memset(Y + x0, c.y, x1 - x0);
+  }
+  else{
+    for(int x=x0;x<x1;x++)
+      Y[x] = blend(Y[x], c.y, c.a);
+  }
+
+  if((y & 1) == 0 && y != frame->height-1) return;
+
+  // chroma samples whose source pixel (2*xx+1) is inside [x0,x1)
+  const int yy = y/2;
+  int xx0 = x0/2;
+  int xx1 = x1/2;
+
+  if(x1 == frame->width && (frame->width & 1)) xx1++; // odd width: last column
+
+  Uint8* U = frame->data[1] + yy*frame->linesize[1];
+  Uint8* V = frame->data[2] + yy*frame->linesize[2];
+
+  if(c.a == 0xFF){
+    memset(U + xx0, c.u, xx1 - xx0);
+    memset(V + xx0, c.v, xx1 - xx0);
+  }
+  else{
+    for(int xx=xx0;xx<xx1;xx++){
+      U[xx] = blend(U[xx], c.u, c.a);
+      V[xx] = blend(V[xx], c.v, c.a);
+    }
+  }
+}
+
+
+void YUVCanvas::plot(int x, int y, const YUVColor& c)
+{
+  Uint8& Y = frame->data[0][y*frame->linesize[0] + x];
+  Y = blend(Y, c.y, c.a);
+
+  const bool cx = (x & 1) || (x == frame->width-1);
+  const bool cy = (y & 1) || (y == frame->height-1);
+
+  if(cx && cy){
+    Uint8& U = frame->data[1][(y/2)*frame->linesize[1] + x/2];
+    Uint8& V = frame->data[2][(y/2)*frame->linesize[2] + x/2];
+    U = blend(U, c.u, c.a);
+    V = blend(V, c.v, c.a);
+  }
+}
+
+
+void YUVCanvas::fillRect(const SDL_Rect& rect, const YUVColor& c)
+{
+  SDL_Rect r;
+  if(SDL_IntersectRect(&rect, &screen, &r) == SDL_FALSE) return;
+
+  for(int y=r.y;y<r.y+r.h;y++)
+    span(y, r.x, r.x + r.w, c);
+}
+
+
+void YUVCanvas::fillPolygon(const std::vector<SDL_Point>& polygon, const YUVColor& c,
+			    const SDL_Rect& clip)
+{
+  SDL_Rect r;
+  if(SDL_IntersectRect(&clip, &screen, &r) == SDL_FALSE) return;
+
+  polygonSpans(polygon, r, [&](int y, int x0, int x1){ span(y, x0, x1, c); });
+}
+
+
+void YUVCanvas::drawPolyline(const std::vector<SDL_Point>& polyline, const YUVColor& c,
+			     const SDL_Rect& clip)
+{
+  SDL_Rect r;
+  if(SDL_IntersectRect(&clip, &screen, &r) == SDL_FALSE) return;
+
+  polylinePixels(polyline, r, [&](int x, int y){ plot(x, y, c); });
+}
+
+
+void YUVCanvas::blendSprite(const YUVSprite& sprite, int x, int y, const SDL_Rect& clip)
+{
+  SDL_Rect area = { x, y, sprite.w, sprite.h };
+  SDL_Rect c, r;
+
+  if(SDL_IntersectRect(&clip, &screen, &c) == SDL_FALSE) return;
+  if(SDL_IntersectRect(&area, &c, &r) == SDL_FALSE) return;
+
+  for(int j=r.y;j<r.y+r.h;j++){
+    Uint8* Y = frame->data[0] + j*frame->linesize[0];
+    const unsigned int row = (j - y)*sprite.w;
+
+    for(int i=r.x;i<r.x+r.w;i++){
+      const unsigned int index = row + (i - x);
+      Y[i] = blend(Y[i], sprite.Y[index], sprite.A[index]);
+    }
+
+    if((j & 1) == 0 && j != frame->height-1) continue;
+
+    Uint8* U = frame->data[1] + (j/2)*frame->linesize[1];
+    Uint8* V = frame->data[2] + (j/2)*frame->linesize[2];
+
+    for(int i=r.x;i<r.x+r.w;i++){
+      if((i & 1) == 0 && i != frame->width-1) continue;
+
+      const unsigned int index = row + (i - x);
+      U[i/2] = blend(U[i/2], sprite.U[index], sprite.A[index]);
+      V[i/2] = blend(V[i/2], sprite.V[index], sprite.A[index]);
+    }
+  }
+}
+
+
+}
+}
@@ -0,0 +1,72 @@
+/*
+ * yuvraster.h
+ *
+ * rasterization of flat colour shapes directly into YUV420P frames
+ * (recording without RGB framebuffer and per pixel colour conversion)
+ *
+ */
+
+#ifndef YUVRASTER_H_
+#define YUVRASTER_H_
+
+#include <SDL.h>
+
+extern "C" {
+#include <libavutil/frame.h>
+};
+
+#include <vector>
+
+
+namespace whiteice {
+  namespace resonanz {
+
+    struct YUVColor {
+      Uint8 y, u, v, a;
+    };
+
+    // converts RGB colour into YUV (same coefficients as convertRGBToYUV420())
+    YUVColor rgbToYUVColor(Uint8 r, Uint8 g, Uint8 b, Uint8 a = 0xFF);
+
+
+    // YUV+alpha image with full resolution chroma (for small sprites like text)
+    struct YUVSprite {
+      int w = 0, h = 0;
+      std::vector<Uint8> Y, U, V, A;
+    };
+
+    // converts 32bit RGBA surface (TTF_RenderUTF8_Blended() output) to sprite
+    bool createYUVSprite(SDL_Surface* surface, YUVSprite& sprite);
+
+
+    // draws into YUV420P frame, all operations are alpha blended and
+    // restricted to clip rectangle. Chroma is sampled from the bottom right
+    // pixel of each 2x2 block as in convertRGBToYUV420()
+    class YUVCanvas {
+    public:
+      YUVCanvas(AVFrame* frame);
+
+      void fillRect(const SDL_Rect& rect, const YUVColor& c);
+
+      // fills closed polygon (non-zero winding rule)
+      void fillPolygon(const std::vector<SDL_Point>& polygon, const YUVColor& c,
+		       const SDL_Rect& clip);
+
+      // draws closed polyline with one pixel wide lines
+      void drawPolyline(const std::vector<SDL_Point>& polyline, const YUVColor& c,
+			const SDL_Rect& clip);
+
+      void blendSprite(const YUVSprite& sprite, int x, int y, const SDL_Rect& clip);
+
+    private:
+      void span(int y, int x0, int x1, const YUVColor& c);
+      void plot(int x, int y, const YUVColor& c);
+
+      AVFrame* frame;
+      SDL_Rect screen;
+    };
+
+  }
+}
+
+#endif